@@ -0,0 +1,141 @@
+#ifndef INC_BVH
+#define INC_BVH
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "MeshGeometry.h"
+#include "PRTBaker.h"
+#include "Ray.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct BVHBuildParams
+{
+    // Candidate splits per axis
+    int bins = 16;
+    // Leaves may hold more triangles when the SAH finds that cheaper, up to
+    // maxLeafSize
+    int minLeafSize = 1, maxLeafSize = 8;
+    // Relative costs of visiting a node and of testing a triangle
+    float traversalCost = 1.f, intersectionCost = 1.f;
+    // Subtrees with more triangles than this build in parallel
+    int parallelThreshold = 1024;
+};
+
+enum class RayQueryMode
+{
+    // One ray at a time
+    SINGLE,
+    // Consecutive rays in packets of BVH::packetWidth()
+    PACKET,
+    // Rays sorted by the octant of their direction, then in packets
+    STREAM
+};
+
+/**
+ * Bounding volume hierarchy over a mesh's triangles, built top-down with a
+ * binned surface area heuristic (Wald 2007) and sibling subtrees built in
+ * parallel.
+ * 
+ * Nodes are 32 bytes, two to a cache line, and stored depth-first : the
+ * first child of an inner node directly follows it, so that traversal
+ * mostly walks forward in memory. Triangles are copied in leaf order, as a
+ * vertex and two edges ready for intersection, so that a leaf's triangles
+ * are contiguous too.
+ * 
+ * Batches of rays can be traced in packets, several rays walking the tree
+ * together with one SIMD lane each : a node is fetched once for the whole
+ * packet and visited if any of its rays hits it, which pays off when the
+ * rays are coherent, like those leaving the same point or sorted by
+ * direction.
+ */
+class BVH : public Occluder
+{
+public:
+    struct Node
+    {
+        float min[3];
+        // Inner nodes : distance to the second child. Leaves : first triangle.
+        uint32_t offset;
+        float max[3];
+        // Triangles of a leaf, 0 for inner nodes
+        uint16_t count;
+        // Axis the children were split along, to visit the nearest first
+        uint16_t axis;
+        
+        bool isLeaf() const { return count > 0; }
+    };
+    
+    BVH(const MeshGeometry &geometry, const BVHBuildParams &params = BVHBuildParams());
+    
+    /**
+     * Finds the closest hit along `ray` within (tMin, tMax), returning false
+     * on a miss.
+     */
+    bool intersect(const Ray &ray, Hit &hit) const;
+    /**
+     * Whether `ray` hits anything within (tMin, tMax), stopping at the
+     * first hit found.
+     */
+    bool occluded(const Ray &ray) const;
+    bool occluded(const Vector3f &origin, const Vector3f &dir, float tMax) const override;
+    
+    /**
+     * Rays per packet : 8 when the CPU has AVX2 (with GCC on x86, whatever
+     * the build flags), 4 otherwise, with SSE when available.
+     */
+    static int packetWidth();
+    /**
+     * Batched versions of the queries above, hits[i] and results[i] being
+     * those of rays[i] whatever the mode.
+     */
+    void intersect(const Ray *rays, Hit *hits, int count, RayQueryMode mode = RayQueryMode::STREAM) const;
+    void occluded(const Ray *rays, bool *results, int count, RayQueryMode mode) const;
+    // In streams
+    void occluded(const Ray *rays, bool *results, int count) const override;
+    
+    const vector<Node>& nodes() const { return _nodes; }
+    int depth() const { return _depth; }
+    /**
+     * Duration of the build, in milliseconds.
+     */
+    double buildTime() const { return _buildTime; }
+private:
+    struct Triangle
+    {
+        Vector3f v0, e1, e2;
+    };
+    
+    template<bool AnyHit>
+    bool traverse(const Ray &ray, Hit &hit) const;
+    /**
+     * Traces the `count` rays rays[indices[k]], at most L::WIDTH, as one
+     * packet, into hits[indices[k]] or results[indices[k]].
+     */
+    template<typename L, bool AnyHit>
+    void traversePacket(const Ray *rays, const uint32_t *indices, int count, Hit *hits, bool *results) const;
+    // traversePacket() for 8 lanes, compiled for AVX2
+    template<bool AnyHit>
+    void traversePacket8(const Ray *rays, const uint32_t *indices, int count, Hit *hits, bool *results) const;
+    template<bool AnyHit>
+    void traverseBatch(const Ray *rays, int count, RayQueryMode mode, Hit *hits, bool *results) const;
+    
+    vector<Node> _nodes;
+    vector<Triangle> _triangles;
+    // Index in the MeshGeometry of each triangle above
+    vector<uint32_t> _triangleIndices;
+    int _depth = 0;
+    double _buildTime = 0.;
+};
+
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef INC_BACKGROUND_SOLVE
+#define INC_BACKGROUND_SOLVE
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Before utils.h, whose trace() macro would clash with Eigen's
+#include <Eigen/Eigen>
+
+#include "utils.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+/**
+ * The latest of a stream of values, passed from one producer thread to one
+ * consumer thread without locks : the producer writes into a buffer of its
+ * own then swaps it with the middle one, and the consumer swaps the middle
+ * buffer with the one it reads when it holds a newer value. Neither ever
+ * waits for the other, and values the consumer was too slow to see are
+ * skipped.
+ */
+template<typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : _middle(2) { }
+    
+    /**
+     * Producer side : publishes a copy of `value`.
+     */
+    void publish(const T &value)
+    {
+        _buffers[_back] = value;
+        _back = _middle.exchange(_back | FRESH, memory_order_acq_rel) & INDEX;
+    }
+    /**
+     * Consumer side : makes latest() the last value published, returning
+     * false if none was since the last call.
+     */
+    bool update()
+    {
+        if(!(_middle.load(memory_order_relaxed) & FRESH))
+            return false;
+        _front = _middle.exchange(_front, memory_order_acq_rel) & INDEX;
+        return true;
+    }
+    const T& latest() const { return _buffers[_front]; }
+private:
+    // The middle buffer's index, and whether it holds a value the consumer
+    // hasn't seen yet
+    enum { INDEX = 3, FRESH = 4 };
+    
+    T _buffers[3];
+    int _back = 0, _front = 1;
+    atomic<int> _middle;
+};
+
+/**
+ * Runs a solver on a thread of its own, so that solves longer than a frame
+ * don't stall the render loop. The solver belongs to that thread once the
+ * BackgroundSolve is built : it is only changed through edit(), whose edits
+ * are applied in order before solving again, and its solutions come back
+ * through update() and latest(), intermediate iterates included.
+ *
+ * Edits preempt the solve in flight rather than queueing behind it : it
+ * stops at its next iterate, which the next solve starts from.
+ *
+ * Solver must define Solution, and its solve() must take a function<bool(
+ * const Solution&)> to call with each iterate, stopping when it returns
+ * false, like SGLightingSolver's and WaveletLightingSolver's.
+ */
+template<typename Solver>
+class BackgroundSolve
+{
+public:
+    typedef typename Solver::Solution Solution;
+    typedef function<void(Solver&)> Edit;
+    
+    BackgroundSolve(Solver &solver) :
+        _solver(solver),
+        _preempted(false),
+        _busy(false),
+        _solveTime(0.),
+        _iterations(0),
+        _thread(&BackgroundSolve::work, this)
+    {
+    }
+    /**
+     * Stops the solve in flight, dropping the edits left.
+     */
+    ~BackgroundSolve()
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stop = true;
+            _preempted = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+    }
+    
+    /**
+     * Queues `edit` to run on the solver, then a solve, preempting the one
+     * in flight.
+     */
+    void edit(Edit edit)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _edits.push_back(move(edit));
+            _preempted = true;
+        }
+        _wake.notify_one();
+    }
+    /**
+     * Makes latest() the last solution published, to be called once per
+     * frame. Returns false if there was none since the last call.
+     */
+    bool update() { return _solutions.update(); }
+    const Solution& latest() const { return _solutions.latest(); }
+    
+    /**
+     * Whether edits or a solve are running.
+     */
+    bool busy() const { return _busy; }
+    /**
+     * Duration of the last solve, preempted or not, with the edits before
+     * it, in milliseconds.
+     */
+    double lastSolveTime() const { return _solveTime; }
+    /**
+     * Iterates the last solve published before its solution.
+     */
+    int lastIterations() const { return _iterations; }
+private:
+    void work()
+    {
+        vector<Edit> edits;
+        while(true)
+        {
+            {
+                unique_lock<mutex> lock(_mutex);
+                _busy = false;
+                _wake.wait(lock, [this]() { return _stop || !_edits.empty(); });
+                if(_stop)
+                    return;
+                edits.swap(_edits);
+                _preempted = false;
+                _busy = true;
+            }
+            auto start = chrono::steady_clock::now();
+            int iterations = 0;
+            try
+            {
+                for(Edit &edit : edits)
+                    edit(_solver);
+                edits.clear();
+                if(_preempted)
+                    continue;
+                _solutions.publish(_solver.solve([&](const Solution &iterate)
+                {
+                    _solutions.publish(iterate);
+                    iterations++;
+                    return !_preempted;
+                }));
+            }
+            catch(exception &e)
+            {
+                // The solver keeps the edits applied so far
+                trace("Background solve failed : " << e.what());
+                edits.clear();
+            }
+            chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+            _solveTime = elapsed.count();
+            _iterations = iterations;
+        }
+    }
+    
+    Solver &_solver;
+    TripleBuffer<Solution> _solutions;
+    mutex _mutex;
+    condition_variable _wake;
+    vector<Edit> _edits;
+    bool _stop = false;
+    atomic<bool> _preempted, _busy;
+    atomic<double> _solveTime;
+    atomic<int> _iterations;
+    // Last, to start once everything else is built
+    thread _thread;
+};
+
+}
+
+#endif
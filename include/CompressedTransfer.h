@@ -0,0 +1,126 @@
+#ifndef INC_COMPRESSED_TRANSFER
+#define INC_COMPRESSED_TRANSFER
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "SphericalHarmonics.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct CPCAParams
+{
+    // Clusters of vertices, each with its own mean and basis
+    int clusters = 64;
+    // Basis vectors per cluster, that is weights per vertex
+    int basisSize = 4;
+    // Rounds of refitting the clusters, then moving each vertex to the
+    // cluster that reconstructs it best
+    int iterations = 8;
+};
+
+/**
+ * Transfer matrix compressed by clustered PCA, after Sloan et al.'s
+ * "Clustered Principal Components for Precomputed Radiance Transfer" : the
+ * vertices are split into clusters, and each vertex's row approximated by
+ * its cluster's mean plus a few of the cluster's principal directions,
+ *
+ *     T_v ~ M_c + sum_j w_vj B_cj
+ *
+ * so that a vertex keeps basisSize weights instead of (Order + 1)²
+ * coefficients. Whatever is linear in the rows is then computed once per
+ * cluster row rather than once per vertex : shading projects the radiance
+ * onto each cluster's 1 + basisSize rows and blends the projections with
+ * the weights, and the solver's normal equations only accumulate the
+ * weights' small Gram matrix in each cluster (see InverseLightingSolver).
+ */
+template<int Order>
+class CompressedTransfer
+{
+public:
+    typedef typename SH<Order>::Coefficients Coefficients;
+    static const int COEFFICIENTS = SH<Order>::COEFFICIENTS;
+    typedef Matrix<float, 1, COEFFICIENTS> Row;
+    typedef Matrix<float, Dynamic, COEFFICIENTS, RowMajor> TransferMatrix;
+    typedef Matrix<float, Dynamic, Dynamic, RowMajor> WeightMatrix;
+    
+    CompressedTransfer() { }
+    /**
+     * Clusters and compresses the rows of `transfer`, one per vertex, in
+     * parallel over vertices and clusters.
+     */
+    CompressedTransfer(const TransferMatrix &transfer, const CPCAParams &params = CPCAParams());
+    /**
+     * From the parts below, as saved. `clusterRows` holds 1 + basisSize
+     * rows per cluster, and `weights` basisSize columns per vertex.
+     */
+    CompressedTransfer(const vector<int> &clusters, const TransferMatrix &clusterRows, const WeightMatrix &weights);
+    
+    int vertexCount() const { return _clusters.size(); }
+    int clusterCount() const { return _clusterRows.rows() / (_basisSize + 1); }
+    int basisSize() const { return _basisSize; }
+    bool empty() const { return _clusters.empty(); }
+    
+    /**
+     * Cluster of each vertex.
+     */
+    const vector<int>& clusters() const { return _clusters; }
+    int cluster(int vertex) const { return _clusters[vertex]; }
+    /**
+     * Mean of each cluster followed by its basis vectors, most significant
+     * first.
+     */
+    const TransferMatrix& clusterRows() const { return _clusterRows; }
+    typename TransferMatrix::ConstRowsBlockXpr clusterRows(int cluster) const
+    {
+        return _clusterRows.middleRows(cluster * (_basisSize + 1), _basisSize + 1);
+    }
+    const WeightMatrix& weights() const { return _weights; }
+    
+    /**
+     * Weights of vertex `vertex` against its cluster's rows, 1 for the
+     * mean.
+     */
+    Matrix<float, 1, Dynamic> coordinates(int vertex) const;
+    /**
+     * Approximate row of vertex `vertex`.
+     */
+    Row row(int vertex) const;
+    TransferMatrix decompress() const;
+    
+    /**
+     * Radiance each vertex reflects under `radiance`, in parallel over
+     * vertices.
+     */
+    void shade(const Coefficients &radiance, vector<Vector3f> &radiances) const;
+    
+    /**
+     * RMS difference to the uncompressed rows, relative to their RMS.
+     */
+    float relativeError(const TransferMatrix &transfer) const;
+    /**
+     * Memory held, against vertexCount() * COEFFICIENTS floats for the
+     * full matrix.
+     */
+    size_t bytes() const;
+private:
+    int _basisSize = 0;
+    vector<int> _clusters;
+    TransferMatrix _clusterRows;
+    WeightMatrix _weights;
+    
+    // Means and bases of the clusters from the vertices assigned to them,
+    // restarting empty ones on the vertices of largest `errors`
+    void fit(const TransferMatrix &transfer, const vector<float> &errors);
+    // Reconstruction error of row `row` by cluster `cluster`
+    float error(const Row &row, int cluster) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef INC_CUBE_MAP_IMAGE
+#define INC_CUBE_MAP_IMAGE
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "EquirectImage.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * CPU-side RGB float cube map. Faces are stored in GL order (+X, -X, +Y,
+ * -Y, +Z, -Z), each one size x size and oriented like
+ * GL_TEXTURE_CUBE_MAP_POSITIVE_X + face expects it.
+ */
+struct CubeMapImage
+{
+    int size = 0;
+    vector<float> faces[6];
+    
+    CubeMapImage() { }
+    CubeMapImage(int s);
+    
+    float *row(int face, int y) { return &faces[face][3 * y * size]; }
+    const float *row(int face, int y) const { return &faces[face][3 * y * size]; }
+    
+    /**
+     * Resamples an equirectangular image, 4 texels at a time and in
+     * parallel over rows.
+     */
+    static CubeMapImage fromEquirect(const EquirectImage &image, int size);
+    
+    /**
+     * Direction at the center of texel (x, y) of `face`, not normalized.
+     */
+    Vector3f texelDirection(int face, int x, int y) const;
+    
+    /**
+     * Bilinear lookup in the direction `dir`, clamped within the face it hits.
+     */
+    Vector3f sample(const Vector3f &dir) const;
+    
+    /**
+     * Solid angle of the texel `dir` falls into.
+     */
+    float texelSolidAngle(const Vector3f &dir) const;
+    
+    CubeMapImage downsample() const;
+};
+
+/**
+ * Box-filtered mip chain of a cube map, with trilinear lookups.
+ */
+class CubeMapPyramid
+{
+public:
+    CubeMapPyramid(const CubeMapImage &image);
+    
+    int levels() const { return _levels.size(); }
+    const CubeMapImage &level(int i) const { return i == 0 ? _base : _levels[i]; }
+    
+    Vector3f sample(const Vector3f &dir, float lod) const;
+private:
+    const CubeMapImage &_base;
+    // _levels[0] is left empty and stands for _base
+    vector<CubeMapImage> _levels;
+};
+
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef INC_ENVIRONMENT_LIBRARY
+#define INC_ENVIRONMENT_LIBRARY
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "EnvironmentMap.h"
+#include "IBLBaker.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+struct EnvironmentLibraryOptions
+{
+    // Memory the cached environments may take, besides the current one
+    size_t deviceBudget = (size_t)512 << 20;
+    size_t hostBudget = (size_t)1 << 30;
+    // Environments on each side of the selected one to prefetch, wrapping
+    // around the list
+    int prefetchRadius = 1;
+    // Background loads running at once
+    int maxLoads = 2;
+};
+
+/**
+ * A list of HDR files to switch between at runtime. Environments that were
+ * used recently stay baked and uploaded in an LRU cache held within a GPU
+ * and a host memory budget, and the neighbours of the selected one in the
+ * list are prefetched on worker threads, so that switching to a cached
+ * environment only swaps texture handles with the EnvironmentMap.
+ *
+ * The library drives `map` and must be destroyed before it.
+ */
+class EnvironmentLibrary
+{
+public:
+    EnvironmentLibrary(EnvironmentMap &map, const vector<string> &paths, const IBLBakeParams &params = IBLBakeParams(),
+        const string &cacheDirectory = "iblcache", const EnvironmentLibraryOptions &options = EnvironmentLibraryOptions());
+    
+    int size() const { return _entries.size(); }
+    const string& path(int index) const { return _entries[index].path; }
+    /**
+     * Index of the environment the map renders, or -1 before the first one
+     * is ready.
+     */
+    int current() const { return _current; }
+    int selected() const { return _selected; }
+    
+    /**
+     * Switches to the index-th environment : right away if it is cached,
+     * otherwise once update() has loaded it, while the map keeps rendering
+     * the current one. Returns true if the switch already happened.
+     */
+    bool select(int index);
+    /**
+     * To be called once per frame, between two frames. Collects finished
+     * loads, spends the map's upload budget on the selected environment
+     * then on its neighbours, starts prefetches and evicts the least
+     * recently used environments over budget. Returns true when the
+     * current environment changed, see EnvironmentMap::swap().
+     */
+    bool update();
+    
+    /**
+     * Memory held by the cached environments.
+     */
+    size_t deviceBytes() const;
+    size_t hostBytes() const;
+private:
+    struct Entry
+    {
+        string path;
+        unique_ptr<EnvironmentSet> set;
+        future<unique_ptr<EnvironmentSet>> loading;
+        uint64_t lastUse = 0;
+        bool failed = false;
+    };
+    
+    void switchTo(int index);
+    bool inPrefetchWindow(int index) const;
+    void prefetch();
+    void evict();
+    
+    EnvironmentMap &_map;
+    IBLBakeParams _params;
+    string _cacheDirectory;
+    EnvironmentLibraryOptions _options;
+    vector<Entry> _entries;
+    int _current = -1, _selected = -1;
+    uint64_t _clock = 0;
+};
+
+}
+
+#endif
@@ -1,13 +1,27 @@
 #ifndef INC_ENVIRONMENT_MAP
 #define INC_ENVIRONMENT_MAP
 
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <Eigen/Eigen>
 #include <glad/glad.h>
 
+#include "CubeMapImage.h"
+#include "EnvironmentSampler.h"
+#include "EquirectImage.h"
+#include "HDRImage.h"
+#include "IBLBaker.h"
+#include "MedianCut.h"
+#include "OctahedralImage.h"
+#include "PixelFormats.h"
 #include "QuadRenderContext.h"
 #include "ShaderProgram.h"
+#include "SphericalGaussians.h"
+#include "SphericalHarmonics.h"
 #include "TrackballControls.h" // Camera3D
 
 using namespace std;
@@ -15,23 +29,268 @@ using namespace std;
 namespace invLight
 {
 
+/**
+ * How the environment is stored on the GPU and sampled.
+ */
+struct EnvironmentMapOptions
+{
+    // Also convert the equirect to a cube map, which the skybox and the
+    // precomputations then sample instead
+    bool cubeMap = false;
+    // Cube face size, 0 picks a quarter of the equirect's width
+    int cubeMapSize = 0;
+    // Filter across cube faces (GL_TEXTURE_CUBE_MAP_SEAMLESS)
+    bool seamless = true;
+    // Storage of the environment and of the maps baked from it on the CPU :
+    // PIXEL_HALF for GL_RGB16F or PIXEL_RGB9E5 for GL_RGB9_E5, half the
+    // size. Either way pixels are converted before reaching the driver.
+    PixelFormat textureFormat = PIXEL_HALF;
+    // Store the environment, irradiance and specular maps with the
+    // octahedral projection instead of the equirectangular one, see
+    // OctahedralImage. The IBL cache keeps equirects, resampled on upload.
+    bool octahedral = false;
+    // Side of the octahedral environment map, 0 picks half the equirect's
+    // width. Baked maps take half the width of their equirects.
+    int octahedralSize = 0;
+    // Bytes update() may upload per frame while swapping in an environment
+    // loaded in the background
+    size_t uploadBudget = 4 << 20;
+    // Width of the small copy kept for fits on other threads, see fitImage()
+    int fitImageWidth = 64;
+};
+
+/**
+ * One environment outside of an EnvironmentMap : the image as decoded, its
+ * baked IBL set, and once uploaded the textures built from them. Sets are
+ * prepared on worker threads, then uploaded and swapped in by an
+ * EnvironmentMap.
+ */
+struct EnvironmentSet
+{
+    string path;
+    HDRImage hdr;
+    // Float expansion of hdr, may be left empty
+    EquirectImage image;
+    // hdr box-filtered down to options.fitImageWidth texels wide at most
+    EquirectImage fitImage;
+    CubeMapImage cubeImage;
+    // Resampled environment, only kept until the set is uploaded
+    OctahedralImage octahedral;
+    SHCoefficients irradianceSH;
+    bool hasIrradianceSH = false;
+    int specularLevels = 0;
+    Texture map, cubeMap, irradianceMap, specularMap, brdfMap;
+    // Bytes of texture data uploaded so far
+    size_t deviceBytes = 0;
+    
+    // Only kept until the set is uploaded
+    vector<CubeMapImage> cubeLevels;
+    shared_ptr<IBLData> ibl;
+    // Each step uploads a bit of the textures and returns the bytes it sent
+    vector<function<size_t()>> steps;
+    unsigned int nextStep = 0;
+    
+    EnvironmentSet() { }
+    EnvironmentSet(const EnvironmentSet &) = delete;
+    EnvironmentSet& operator=(const EnvironmentSet &) = delete;
+    /**
+     * Frees the textures, on the GL thread if there are any.
+     */
+    ~EnvironmentSet();
+    
+    bool uploaded() const { return map.id && !ibl; }
+    /**
+     * Bytes of host memory held, mapped cache entries included.
+     */
+    size_t hostBytes() const;
+};
+
 class EnvironmentMap
 {
 public:
-    EnvironmentMap(const string &path);
+    /**
+     * Starts from a small uniform grey environment with all of its maps, to
+     * render while load() runs.
+     */
+    EnvironmentMap(const EnvironmentMapOptions &options = EnvironmentMapOptions());
+    EnvironmentMap(const string &path, const EnvironmentMapOptions &options = EnvironmentMapOptions());
+    /**
+     * Waits for a background load still in flight.
+     */
     ~EnvironmentMap();
+    /**
+     * Decodes the HDR file at `path` and maps or bakes its IBL set like
+     * precompute() does, on a worker thread, while the current environment
+     * keeps being rendered. update() then uploads the result and swaps it
+     * in. Loading again while the worker runs queues the new request, and
+     * the older result is dropped.
+     */
+    void load(const string &path, const IBLBakeParams &params = IBLBakeParams(), const string &cacheDirectory = "iblcache");
+    /**
+     * To be called once per frame, between two frames. Uploads up to
+     * options.uploadBudget bytes of a finished load into textures of its
+     * own, and once they are complete swaps them for the current ones.
+     * Returns true on that frame : textures registered in other programs
+     * must be registered again, see bindTextures().
+     */
+    bool update();
+    bool isLoading() const { return _loading.valid() || _pending; }
+    /**
+     * Worker side of load(), which doesn't touch GL and may run on any
+     * thread.
+     */
+    static unique_ptr<EnvironmentSet> prepare(const string &path, const IBLBakeParams &params, const string &cacheDirectory,
+        const EnvironmentMapOptions &options);
+    /**
+     * Uploads up to `budget` bytes of a prepared set into textures of its
+     * own, in this map's format. Returns true once the set is uploaded.
+     */
+    bool stage(EnvironmentSet &set, size_t budget);
+    /**
+     * Exchanges the current environment with an uploaded set : this map
+     * renders the set from now on, and the set holds what was current,
+     * textures included, ready to be swapped back. Only handles move, so
+     * this is cheap, but textures registered in other programs must be
+     * registered again.
+     */
+    void swap(EnvironmentSet &set);
+    /**
+     * Registers the irradiance, specular and BRDF maps in `program` as
+     * uIrradianceMap, uSpecularMap and uBRDFMap.
+     */
+    void bindTextures(ShaderProgram &program);
     void precomputeIrradiance(int width = 0, int height = 0);
-    void precomputeSpecular();
+    /**
+     * Projects the environment onto L2 spherical harmonics on the CPU and
+     * convolves it with the cosine lobe. The result is cached.
+     */
+    const SHCoefficients& computeIrradianceSH();
+    /**
+     * Fills the irradiance map from the SH coefficients instead of running
+     * the brute-force convolution shader.
+     */
+    void precomputeIrradianceSH(int width = 0, int height = 0);
+    /**
+     * Uploads the irradiance coefficients to the currently bound program
+     * as an array of 9 vec3.
+     */
+    void uploadIrradianceSH(ShaderProgram &program, const string &name = "uIrradianceSH");
+    /**
+     * Bakes the GGX-prefiltered radiance chain on the CPU and uploads it as
+     * the mip levels of the specular map, level i holding roughness
+     * i / (levels - 1). Defaults to a base at most 512 texels wide and a
+     * chain going down to 8 texels wide.
+     */
+    void precomputeSpecular(int width = 0, int height = 0, int levels = 0, int samples = 64);
+    /**
+     * Fills the BRDF map with the split-sum integration table, reading it
+     * from `cachePath` when it was already baked.
+     */
+    void precomputeBRDF(int size = 128, int samples = 512, const string &cachePath = "brdfLUT.bin");
+    /**
+     * Precomputes the irradiance, specular and BRDF maps at once through
+     * the on-disk cache in `cacheDirectory`, which is keyed by the contents
+     * of the HDR file and the bake parameters. A hit maps the cached file
+     * and uploads it directly ; a miss bakes on the CPU and fills the cache.
+     */
+    void precompute(const IBLBakeParams &params = IBLBakeParams(), const string &cacheDirectory = "iblcache");
+    /**
+     * Uploads a baked IBL set into the irradiance, specular and BRDF maps.
+     */
+    void upload(const IBLData &data);
+    /**
+     * Replaces the rectangle of the environment at (x, y) with `pixels`,
+     * width x height RGB floats, for localized edits. The SH irradiance is
+     * updated from the old and new texels of the rectangle only, then the
+     * irradiance map is refreshed from it rather than reconvolved. The
+     * specular map and the cube map are left as they were.
+     */
+    void updateRegion(int x, int y, int width, int height, const float *pixels);
     void render(Camera3D &cam, Matrix4f &invProjMat);
     
     const Texture& getMap() { return _map; }
+    const Texture& getCubeMap() { return _cubeMap; }
     const Texture& getIrradianceMap() { return _irradianceMap; }
     const Texture& getSpecularMap() { return _specularMap; }
+    int getSpecularLevels() const { return _specularLevels; }
     const Texture& getBRDFMap() { return _brdfMap; }
+    const string& getPath() const { return _path; }
+    const EnvironmentMapOptions& getOptions() const { return _options; }
+    const SHCoefficients& getIrradianceSH() { return computeIrradianceSH(); }
+    /**
+     * Luminance importance sampler over the environment, built on first use.
+     */
+    const EnvironmentSampler& getSampler();
+    /**
+     * Approximates the environment with `count` directional lights and a
+     * residual SH irradiance term, see invLight::extractLights(). The
+     * result is cached until another count is asked for.
+     */
+    const LightSet& extractLights(int count = 16);
+    /**
+     * Uploads the extracted lights to the currently bound program, along
+     * with the residual as uIrradianceSH, so that it shades with them
+     * instead of the prefiltered specular map. A count of 0 switches back.
+     */
+    void uploadLights(ShaderProgram &program, int count = 16);
+    /**
+     * Uploads `lobes`, fitted or solved ones, to the currently
+     * bound program, so that it shades with them instead of the SH
+     * irradiance and the prefiltered specular map. No lobes switch back.
+     */
+    static void uploadSphericalGaussians(ShaderProgram &program, const vector<SphericalGaussian> &lobes);
+    /**
+     * The environment box-filtered down to at most options.fitImageWidth
+     * texels wide, to copy for fits running on other threads. Loads prepare
+     * it on their worker, so that it follows swaps for free.
+     */
+    const EquirectImage& fitImage();
 private:
-    Texture _map, _irradianceMap, _specularMap, _brdfMap;
+    struct LoadRequest
+    {
+        string path;
+        IBLBakeParams params;
+        string cacheDirectory;
+    };
+    
+    const EquirectImage& image();
+    void createMaps();
+    /**
+     * Uploads the environment to _map, resampled when octahedral.
+     */
+    void uploadMap();
+    void createCubeMap();
+    void uploadSpecular(const vector<ImageView> &levels);
+    void startLoad(const LoadRequest &request);
+    /**
+     * Allocates the textures of `set` and splits their upload into steps.
+     */
+    void prepareUploads(EnvironmentSet &set);
+    
+    string _path;
+    EnvironmentMapOptions _options;
+    Texture _map, _cubeMap, _irradianceMap, _specularMap, _brdfMap;
+    CubeMapImage _cubeImage;
+    // Compact copy of the environment as decoded, and its float expansion,
+    // built lazily
+    HDRImage _hdr;
+    EquirectImage _image;
+    // See fitImage(), built lazily when the environment didn't come from a
+    // load
+    EquirectImage _fitImage;
+    unique_ptr<EnvironmentSampler> _sampler;
+    LightSet _lights;
+    int _lightCount = 0;
+    int _specularLevels = 0;
+    size_t _deviceBytes = 0;
+    SHCoefficients _irradianceSH;
+    bool _hasIrradianceSH = false;
     ShaderProgram _skyboxProgram;
     QuadRenderContext _skyboxContext;
+    future<unique_ptr<EnvironmentSet>> _loading;
+    unique_ptr<EnvironmentSet> _pending;
+    LoadRequest _nextLoad;
+    bool _hasNextLoad = false;
 };
 
 }
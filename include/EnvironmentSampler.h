@@ -0,0 +1,63 @@
+#ifndef INC_ENVIRONMENT_SAMPLER
+#define INC_ENVIRONMENT_SAMPLER
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "EquirectImage.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct EnvironmentSample
+{
+    Vector3f direction, radiance;
+    // With respect to solid angle
+    float pdf;
+};
+
+/**
+ * Importance sampling of an equirectangular environment proportionally to
+ * its luminance times sin(theta) : the marginal CDF over rows picks the
+ * row, then that row's conditional CDF picks the column. Inverting CDFs
+ * rather than using alias tables keeps stratified or low-discrepancy
+ * points well distributed. The environment is treated as piecewise
+ * constant over texels, and must outlive the sampler.
+ */
+class EnvironmentSampler
+{
+public:
+    /**
+     * Builds the tables, in parallel over rows.
+     */
+    EnvironmentSampler(const EquirectImage &image);
+    
+    /**
+     * Maps a point of the unit square to a direction, its radiance and
+     * its PDF, in O(log(width) + log(height)).
+     */
+    EnvironmentSample sample(const Vector2f &u) const;
+    
+    /**
+     * PDF with respect to solid angle of sampling the unit direction `dir`.
+     */
+    float pdf(const Vector3f &dir) const;
+private:
+    static void buildCDF(const float *weights, int count, float *cdf);
+    static int invertCDF(const float *cdf, int count, float u, float &fraction);
+    
+    const EquirectImage &_image;
+    // Marginal CDF over rows, then one conditional CDF per row, each with
+    // a trailing 1
+    vector<float> _rows, _columns;
+    // Density of each texel over the unit square
+    vector<float> _density;
+};
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef INC_EQUIRECT_IMAGE
+#define INC_EQUIRECT_IMAGE
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * CPU-side RGB float equirectangular image, laid out like the textures :
+ * row 0 is the +Y pole and directions map to texels through norm2equi().
+ */
+struct EquirectImage
+{
+    int width = 0, height = 0;
+    vector<float> pixels;
+    
+    EquirectImage() { }
+    EquirectImage(int w, int h) : width(w), height(h), pixels(w * h * 3) { }
+    
+    float *row(int y) { return &pixels[3 * y * width]; }
+    const float *row(int y) const { return &pixels[3 * y * width]; }
+    
+    /**
+     * Direction at the center of texel (x, y).
+     */
+    Vector3f texelDirection(int x, int y) const;
+    
+    /**
+     * Bilinear lookup in the direction `dir` (unit length), wrapping
+     * around horizontally.
+     */
+    Vector3f sample(const Vector3f &dir) const;
+    
+    /**
+     * Bilinear lookups in 4 unit directions at once, given component by
+     * component. Texture coordinates are computed with SSE when available ;
+     * `rgb` receives 4 consecutive RGB triplets.
+     */
+    void sample4(const float *x, const float *y, const float *z, float *rgb) const;
+    
+    /**
+     * Solid angle of the texels around the direction `dir`.
+     */
+    float texelSolidAngle(const Vector3f &dir) const;
+    
+    /**
+     * Returns the image box-filtered to half its size in each dimension.
+     */
+    EquirectImage downsample() const;
+};
+
+/**
+ * Box-filtered mip chain of an equirectangular image, with trilinear lookups.
+ */
+class EquirectPyramid
+{
+public:
+    EquirectPyramid(const EquirectImage &image);
+    
+    int levels() const { return _levels.size(); }
+    const EquirectImage &level(int i) const { return i == 0 ? _base : _levels[i]; }
+    
+    /**
+     * Lookup in the direction `dir` at fractional level of detail `lod`.
+     */
+    Vector3f sample(const Vector3f &dir, float lod) const;
+private:
+    const EquirectImage &_base;
+    // _levels[0] is left empty and stands for _base
+    vector<EquirectImage> _levels;
+};
+
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef INC_HDR_IMAGE
+#define INC_HDR_IMAGE
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "EquirectImage.h"
+#include "PixelFormats.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+/**
+ * RGB HDR image in a compact pixel format, as decoded from disk and
+ * uploaded to the GPU.
+ */
+struct HDRImage
+{
+    int width = 0, height = 0;
+    PixelFormat format = PIXEL_HALF;
+    vector<uint8_t> data;
+    
+    HDRImage() { }
+    HDRImage(int w, int h, PixelFormat f) : width(w), height(h), format(f), data((size_t)w * h * pixelSize(f)) { }
+    
+    uint8_t *row(int y) { return &data[(size_t)y * width * pixelSize(format)]; }
+    const uint8_t *row(int y) const { return &data[(size_t)y * width * pixelSize(format)]; }
+    
+    /**
+     * Expands the image to floats, in parallel over rows.
+     */
+    EquirectImage toEquirect() const;
+};
+
+/**
+ * Decodes the image at `path` into `format`. Radiance .hdr files (flat or
+ * RLE-RGBE scanlines, -Y H +X W orientation) are decoded natively : the
+ * file is mapped, scanline offsets are found in one sequential pass, then
+ * bands of scanlines are decoded and converted in parallel straight into
+ * the output, without any intermediate float image. Other files go
+ * through stb_image. Throws if the file can't be read.
+ */
+HDRImage loadHDRImage(const string &path, PixelFormat format);
+
+}
+
+#endif
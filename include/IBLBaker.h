@@ -0,0 +1,134 @@
+#ifndef INC_IBL_BAKER
+#define INC_IBL_BAKER
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "CubeMapImage.h"
+#include "EnvironmentSampler.h"
+#include "EquirectImage.h"
+#include "SphericalHarmonics.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Sizes and sample counts of every precomputed map. Zeros are resolved
+ * from the environment's size by resolved().
+ */
+struct IBLBakeParams
+{
+    int irradianceWidth = 64, irradianceHeight = 64;
+    int specularWidth = 0, specularHeight = 0, specularLevels = 0, specularSamples = 64;
+    int brdfSize = 128, brdfSamples = 512;
+    // Prefilter specular from a cube map this size instead of the equirect
+    int cubeMapSize = 0;
+    
+    /**
+     * Specular base at most 512 texels wide, with a chain going down to 8
+     * texels wide ; other zeros become the environment's size.
+     */
+    IBLBakeParams resolved(int environmentWidth, int environmentHeight) const;
+};
+
+/**
+ * Non-owning view of a float image with `channels` components per texel.
+ */
+struct ImageView
+{
+    int width = 0, height = 0, channels = 0;
+    const float *data = nullptr;
+};
+
+/**
+ * Everything the renderer needs for image-based lighting of one
+ * environment. The views point into memory kept alive by `storage`, which
+ * is either baked data or a mapped cache file.
+ */
+struct IBLData
+{
+    IBLBakeParams params;
+    SHCoefficients irradianceSH;
+    ImageView irradiance, brdf;
+    vector<ImageView> specular;
+    shared_ptr<const void> storage;
+};
+
+/**
+ * i-th point of the n-points Hammersley sequence.
+ */
+Vector2f hammersley(unsigned int i, unsigned int n);
+
+/**
+ * GGX half-vector importance sampling around +Z, with alpha = roughness^2.
+ */
+Vector3f importanceSampleGGX(const Vector2f &xi, float roughness);
+
+/**
+ * Prefilters the environment for the split-sum approximation, assuming
+ * n = v = r. Level i of the returned chain is (width >> i) x (height >> i)
+ * and corresponds to roughness i / (levels - 1). Each texel takes `samples`
+ * GGX importance samples, at least 1, and each sample reads from the
+ * source mip whose texel footprint matches its PDF (filtered importance
+ * sampling), which keeps the result noise-free with few samples. Runs in
+ * parallel over rows.
+ */
+vector<EquirectImage> bakeSpecular(const EquirectImage &environment, int width, int height, int levels, int samples);
+
+/**
+ * Same as above, reading from a cube map, which needs no inverse
+ * trigonometry per sample and has no poles.
+ */
+vector<EquirectImage> bakeSpecular(const CubeMapImage &environment, int width, int height, int levels, int samples);
+
+/**
+ * Monte Carlo irradiance around the unit `normal`, from `samples`
+ * Hammersley points drawn through `sampler`. Meant as a ground truth for
+ * the baked maps : sampling by luminance keeps the variance low even with
+ * a sun in the environment.
+ */
+Vector3f referenceIrradiance(const EnvironmentSampler &sampler, const Vector3f &normal, int samples);
+
+/**
+ * Ground truth for the prefiltered specular map : the GGX-weighted average
+ * of the radiance around `r` for n = v = r, estimated with `samples`
+ * points drawn through `sampler`. Only converges for rough lobes ; the
+ * mirror level is a plain lookup anyway.
+ */
+Vector3f referenceSpecular(const EnvironmentSampler &sampler, const Vector3f &r, float roughness, int samples);
+
+/**
+ * Split-sum BRDF integration table, as size x size RG pairs. Texel (i, j)
+ * holds the scale and bias to apply to F0 for NdotV = (i + .5) / size and
+ * roughness = (j + .5) / size, integrated with `samples` Hammersley points
+ * using the same G and F terms as brdf() in modelFragment.glsl. Runs in
+ * parallel over rows.
+ */
+vector<float> bakeBRDFLUT(int size, int samples);
+
+/**
+ * Reads the BRDF table from `path` if it was baked with the same
+ * parameters, otherwise bakes it and writes it there. The table does not
+ * depend on the environment, so this only ever integrates it once.
+ */
+vector<float> loadOrBakeBRDFLUT(const string &path, int size, int samples);
+
+/**
+ * Bakes every map on the CPU with the parameters resolved for the
+ * environment. The BRDF table goes through loadOrBakeBRDFLUT() when
+ * `brdfCachePath` is not empty. When params.cubeMapSize is set, specular
+ * is prefiltered from `cubeMap`, or from a conversion of the environment
+ * if it is null.
+ */
+shared_ptr<IBLData> bakeIBL(const EquirectImage &environment, const IBLBakeParams &params, const string &brdfCachePath = "",
+    const CubeMapImage *cubeMap = nullptr);
+
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef INC_IBL_CACHE
+#define INC_IBL_CACHE
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "IBLBaker.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+/**
+ * 64-bit hash of `size` bytes, chained from `seed`.
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/**
+ * Hash of a whole file's contents, computed in parallel over chunks of the
+ * mapped file. Throws if the file can't be read.
+ */
+uint64_t hashFile(const string &path);
+
+/**
+ * Directory of baked IBL sets, one file per environment and set of bake
+ * parameters. Files start with a versioned header and a section table,
+ * and every image is stored as raw floats at an aligned offset, so that a
+ * hit only costs mapping the file : the returned views point right into
+ * the mapping.
+ */
+class IBLCache
+{
+public:
+    /**
+     * Creates `directory` if needed.
+     */
+    IBLCache(const string &directory);
+    
+    /**
+     * Identifies the bake of the HDR file at `hdrPath` with `params`, which
+     * must already be resolved.
+     */
+    static uint64_t key(const string &hdrPath, const IBLBakeParams &params);
+    
+    /**
+     * Maps the entry for `key`, or returns nullptr if there is none or if it
+     * was written by another version of the format.
+     */
+    shared_ptr<IBLData> load(uint64_t key) const;
+    
+    /**
+     * Writes `data` as the entry for `key`, replacing any previous one.
+     */
+    void store(uint64_t key, const IBLData &data) const;
+    
+    string pathFor(uint64_t key) const;
+private:
+    string _directory;
+};
+
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef INC_ILLUMINATION_BRUSH
+#define INC_ILLUMINATION_BRUSH
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "InverseLighting.h"
+#include "MeshGeometry.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Turns strokes on the rendered mesh into constraints of an
+ * InverseLightingSolver : the vertices under the brush that face the
+ * camera and aren't hidden in the depth buffer are asked to reflect
+ * `color * intensity`, with a weight falling off towards the brush's edge.
+ */
+class IlluminationBrush
+{
+public:
+    Vector3f color = Vector3f::Ones();
+    float intensity = 1.f;
+    // In framebuffer pixels
+    float radius = 24.f;
+    
+    IlluminationBrush(const MeshGeometry &geometry, InverseLightingSolver<> &solver) :
+        _geometry(geometry), _solver(solver) { }
+    
+    /**
+     * Paints around the cursor (x, y), in framebuffer pixels from the top
+     * left corner, and solves again if any vertex was painted. Reads the
+     * depth buffer, so it must be called after the mesh was rendered with
+     * `viewProjection` into a width x height framebuffer. Returns the
+     * number of vertices painted.
+     */
+    int paint(float x, float y, const Matrix4f &viewProjection, const Vector3f &eye, int width, int height);
+    /**
+     * Vertices the last paint() call painted, with their weights, to
+     * forward the stroke to other solvers.
+     */
+    const vector<pair<int, float> >& lastPainted() const { return _painted; }
+private:
+    const MeshGeometry &_geometry;
+    InverseLightingSolver<> &_solver;
+    vector<float> _depths;
+    vector<pair<int, float> > _painted;
+};
+
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef INC_INVERSE_LIGHTING
+#define INC_INVERSE_LIGHTING
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "CompressedTransfer.h"
+#include "SphericalHarmonics.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct InverseLightingOptions
+{
+    /**
+     * Weight of the prior against the constraints, independent of how many
+     * there are. Each band l is penalized by (1 + l(l + 1))², so that the
+     * solution stays smooth where the strokes leave it free.
+     */
+    float regularization = .05f;
+    /**
+     * Solve for lighting that is nowhere negative, checked towards a few
+     * directions per coefficient. Without constraints, the prior is
+     * projected onto such lighting rather than used as is.
+     */
+    bool nonNegative = false;
+};
+
+/**
+ * Solves for the distant lighting that makes a diffuse mesh look the way
+ * the user painted it, after the "Illumination Brush" article : each
+ * painted vertex asks for a target radiance, which a white Lambertian
+ * surface of normal n reflects under the radiance L when
+ * 
+ *     target = E(n) / PI = sum_k A_k Y_k(n) L_k / PI
+ * 
+ * with A_k the cosine lobe of coefficient k's band. Stacking these rows
+ * gives the linear system A L = t, solved in the regularized weighted
+ * least squares sense
+ * 
+ *     min |W^½ (A L - t)|² + lambda sum(w) |D (L - L0)|²
+ * 
+ * around the prior L0, typically the current environment's. The unknowns
+ * are the (Order + 1)² coefficients of each channel, whatever the size of
+ * the mesh : the rows of A are computed once, and each solve accumulates
+ * the normal equations of the painted rows and factors a small SPD matrix,
+ * well under a millisecond at order 2.
+ * 
+ * With a compressed transfer, the rows of a cluster are combinations of
+ * its 1 + basisSize rows M_c, so that the painted rows' normal equations
+ * reduce to
+ * 
+ *     sum_c M_c^T (sum_v w_v x_v x_v^T) M_c
+ * 
+ * with x_v the vertex's coordinates : each constraint only adds to the
+ * small Gram matrix of its cluster, and each painted cluster costs a
+ * product the size of the unknowns.
+ * 
+ * The constraints' normal equations are kept up to date as vertices are
+ * painted over, and so is the Cholesky factor of the regularized ones, by
+ * rank-one updates and downdates : painting a vertex costs O(k²) in the k
+ * unknowns, whatever the number of constraints. The prior's penalty grows
+ * with their total weight, which changes the diagonal rather than by rank
+ * one : the factor is only recomputed once the total weight moved by a
+ * quarter, and a few conjugate gradient iterations preconditioned by it
+ * make up for the difference meanwhile.
+ * 
+ * Nothing keeps that solution from asking for negative light, which shows
+ * as black lobes and ringing. With nonNegative, the same objective is
+ * minimized under the radiance staying non-negative towards directions
+ * spread over the sphere, through its dual : a non-negative least squares
+ * problem in the constraints' multipliers, solved with Lawson and Hanson's
+ * active set method. Each solve starts from the directions the previous
+ * one held at zero, which a stroke only changes by a few. Irradiance is
+ * then non-negative too, up to the gaps between the directions.
+ */
+template<int Order = SH_ORDER>
+class InverseLightingSolver
+{
+public:
+    typedef SH<Order> Basis;
+    typedef typename Basis::Coefficients Coefficients;
+    static const int COEFFICIENTS = Basis::COEFFICIENTS;
+    typedef Matrix<float, Dynamic, COEFFICIENTS, RowMajor> TransferMatrix;
+    
+    /**
+     * `normals` are the unit normals of the mesh's vertices.
+     */
+    InverseLightingSolver(const vector<Vector3f> &normals, const InverseLightingOptions &options = InverseLightingOptions());
+    
+    /**
+     * One row per normal, mapping radiance coefficients to the radiance a
+     * white Lambertian surface reflects.
+     */
+    static TransferMatrix diffuseTransfer(const vector<Vector3f> &normals);
+    
+    /**
+     * Replaces the unshadowed rows, for instance with a baked transfer
+     * that accounts for self-shadowing (see bakeTransfer()). Needs one row
+     * per vertex.
+     */
+    void setTransfer(const TransferMatrix &transfer);
+    /**
+     * Same as above, solving and shading from the compressed rows, the
+     * full ones being released.
+     */
+    void setTransfer(const CompressedTransfer<Order> &transfer);
+    
+    const InverseLightingOptions& getOptions() const { return _options; }
+    void setOptions(const InverseLightingOptions &options)
+    {
+        _options = options;
+        _factored = false;
+    }
+    
+    /**
+     * Radiance the solution is pulled towards, black by default.
+     */
+    void setPrior(const Coefficients &radiance);
+    /**
+     * Same as above from irradiance coefficients, like the environment's.
+     * Bands the cosine lobe removes stay black.
+     */
+    void setPriorIrradiance(const Coefficients &irradiance);
+    
+    /**
+     * Asks for vertex `vertex` to reflect the radiance `target`, painting
+     * over its previous constraint if any.
+     */
+    void addConstraint(int vertex, const Vector3f &target, float weight = 1.f);
+    void clearConstraints();
+    int constraintCount() const { return _constraints.size(); }
+    
+    /**
+     * Solves for the radiance from the current constraints, the prior when
+     * there are none (made non-negative with options.nonNegative). Returns
+     * radiance().
+     */
+    const Coefficients& solve();
+    const Coefficients& radiance() const { return _radiance; }
+    /**
+     * Solved radiance convolved with the cosine lobe, as the shaders
+     * expect it.
+     */
+    Coefficients irradiance() const;
+    /**
+     * Radiance vertex `vertex` reflects under the solution.
+     */
+    Vector3f shading(int vertex) const;
+    /**
+     * Same as above for every vertex.
+     */
+    void shading(vector<Vector3f> &radiances) const;
+    
+    /**
+     * Duration of the last solve, in milliseconds.
+     */
+    double lastSolveTime() const { return _solveTime; }
+    /**
+     * Least squares solves of the last non-negative solve.
+     */
+    int lastIterations() const { return _iterations; }
+private:
+    typedef Matrix<float, 1, COEFFICIENTS> Row;
+    typedef Matrix<double, COEFFICIENTS, COEFFICIENTS> NormalMatrix;
+    
+    struct Constraint
+    {
+        int vertex;
+        Vector3f target;
+        float weight;
+    };
+    
+    InverseLightingOptions _options;
+    // Only one of them is set
+    TransferMatrix _transfer;
+    CompressedTransfer<Order> _compressedTransfer;
+    vector<Constraint> _constraints;
+    // Index in _constraints of each vertex's constraint, -1 if none
+    vector<int> _constraintIndices;
+    // Normal equations of the constraints, without the prior, of which only
+    // the lower triangle is kept
+    NormalMatrix _gram;
+    Matrix<double, COEFFICIENTS, 3> _moment;
+    double _totalWeight = 0.;
+    // Factor of the regularized normal equations at _factoredWeight
+    LLT<NormalMatrix> _factorization;
+    double _factoredWeight = 0.;
+    bool _factored = false;
+    Coefficients _prior, _radiance;
+    // Non-negative solves : basis towards each direction, and the last
+    // solution's multipliers of the directions it held at zero, to start
+    // the next from
+    Matrix<double, COEFFICIENTS, Dynamic> _directions;
+    Matrix<double, Dynamic, 3> _multipliers;
+    double _solveTime = 0.;
+    int _iterations = 0;
+    
+    Row row(int vertex) const;
+    // Adds a constraint's row to the normal equations and their factor,
+    // or removes it for `sign` -1
+    void accumulate(const Constraint &constraint, double sign);
+    // Normal equations from scratch, once the rows changed
+    void rebuild();
+    void factor(const NormalMatrix &normal);
+    // Solves from the factor of an older matrix, returning false if that
+    // doesn't converge
+    bool refine(const NormalMatrix &normal, const Matrix<double, COEFFICIENTS, 3> &rhs,
+        Matrix<double, COEFFICIENTS, 3> &solution) const;
+    void solveNonNegative(const NormalMatrix &normal, const Matrix<double, COEFFICIENTS, 3> &rhs);
+};
+
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef INC_MAPPED_FILE
+#define INC_MAPPED_FILE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace invLight
+{
+
+/**
+ * Read-only memory mapping of a whole file. valid() is false if the file
+ * couldn't be opened or is empty.
+ */
+class MappedFile
+{
+public:
+    MappedFile(const string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    
+    bool valid() const { return _data != nullptr; }
+    const uint8_t *data() const { return (const uint8_t *)_data; }
+    size_t size() const { return _size; }
+private:
+    void *_data = nullptr;
+    size_t _size = 0;
+};
+
+}
+
+#endif
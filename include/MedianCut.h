@@ -0,0 +1,54 @@
+#ifndef INC_MEDIAN_CUT
+#define INC_MEDIAN_CUT
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "EquirectImage.h"
+#include "SphericalHarmonics.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Light standing for a region of the environment : it receives the
+ * region's power from `direction`, so that it contributes
+ * radiance * solidAngle * max(0, n.l) to the irradiance.
+ */
+struct DirectionalLight
+{
+    Vector3f direction, radiance;
+    float solidAngle;
+    
+    Vector3f power() const { return radiance * solidAngle; }
+};
+
+struct LightSet
+{
+    vector<DirectionalLight> lights;
+    /**
+     * Irradiance coefficients of what the lights miss : the environment's
+     * L2 irradiance minus the lights'. Shading with the lights plus these
+     * matches the environment's SH irradiance at low frequencies.
+     */
+    SHCoefficients residualSH;
+};
+
+/**
+ * Median cut (Debevec 2005) : recursively splits the environment along
+ * its longest angular side into regions of equal energy, splitting the
+ * most energetic region first, until there are `count` regions. Each
+ * light sits at its region's energy centroid. Region sums are O(1) reads
+ * from summed-area tables, so each split costs a binary search. Images
+ * wider than `maxWidth` are box-filtered down first, which a few dozen
+ * lights never miss.
+ */
+LightSet extractLights(const EquirectImage &environment, int count, int maxWidth = 512);
+
+}
+
+#endif
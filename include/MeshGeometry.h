@@ -0,0 +1,45 @@
+#ifndef INC_MESH_GEOMETRY
+#define INC_MESH_GEOMETRY
+
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+using namespace std;
+using namespace Eigen;
+
+namespace tinygltf
+{
+class Model;
+}
+
+namespace invLight
+{
+
+/**
+ * CPU copy of the triangles a model is drawn with, in the model space the
+ * shaders work in, for the computations that need the geometry : picking,
+ * baking and solving. Normals are unit length.
+ */
+struct MeshGeometry
+{
+    vector<Vector3f> positions, normals;
+    // Three vertex indices per triangle
+    vector<uint32_t> indices;
+    
+    /**
+     * Reads the positions, normals and indices of the primitive the viewer
+     * renders from the glTF buffers. Throws if the primitive isn't made of
+     * indexed triangles.
+     */
+    static MeshGeometry fromGLTF(const tinygltf::Model &model);
+    
+    int vertexCount() const { return positions.size(); }
+    int triangleCount() const { return indices.size() / 3; }
+    AlignedBox3f bounds() const;
+};
+
+}
+
+#endif
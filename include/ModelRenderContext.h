@@ -8,6 +8,7 @@
 #include <glad/glad.h>
 #include "tiny_gltf.h"
 
+#include "MeshGeometry.h"
 #include "RenderContext.h"
 #include "ShaderProgram.h"
 
@@ -42,6 +43,12 @@ public:
      */
     void armForRendering();
     
+    /**
+     * CPU copy of the primitive rendered by armForRendering(), see
+     * MeshGeometry::fromGLTF().
+     */
+    MeshGeometry geometry() const;
+    
     GLuint indicesCount() const { return _indicesCount; }
     GLenum indicesType() const { return _indicesType; }
     
@@ -0,0 +1,65 @@
+#ifndef INC_OCTAHEDRAL_IMAGE
+#define INC_OCTAHEDRAL_IMAGE
+
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "EquirectImage.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * CPU-side RGB float octahedral map, size x size. Directions are projected
+ * onto the octahedron |x| + |y| + |z| = 1, whose upper half unfolds onto
+ * the diamond around the center (+Y) and lower half onto the corners (-Y),
+ * matching norm2oct() and oct2norm() in commonFragment.glsl. Row 0 is
+ * v = 0, like the textures.
+ *
+ * Texels spread far more evenly over the sphere than an equirect's, whose
+ * rows shrink towards the poles : a map half as wide as an equirect has
+ * half its texels, yet its average texel only covers 1.3 times the solid
+ * angle of an equirect texel on the equator.
+ */
+struct OctahedralImage
+{
+    int size = 0;
+    vector<float> pixels;
+    
+    OctahedralImage() { }
+    OctahedralImage(int s) : size(s), pixels(3 * s * s) { }
+    
+    float *row(int y) { return &pixels[3 * y * size]; }
+    const float *row(int y) const { return &pixels[3 * y * size]; }
+    
+    /**
+     * Coordinates in [0, 1]² of the unit direction `dir`.
+     */
+    static Vector2f encode(const Vector3f &dir);
+    /**
+     * Unit direction of the coordinates `uv` in [0, 1]².
+     */
+    static Vector3f decode(const Vector2f &uv);
+    
+    /**
+     * Resamples an equirectangular image, texel directions being decoded 4
+     * at a time with SSE when available, in parallel over rows.
+     */
+    static OctahedralImage fromEquirect(const EquirectImage &image, int size);
+    
+    Vector3f texelDirection(int x, int y) const;
+    
+    /**
+     * Bilinear lookup in the direction `dir` (unit length), clamped to the
+     * edges of the map.
+     */
+    Vector3f sample(const Vector3f &dir) const;
+};
+
+}
+
+#endif
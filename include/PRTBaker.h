@@ -0,0 +1,117 @@
+#ifndef INC_PRT_BAKER
+#define INC_PRT_BAKER
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "InverseLighting.h"
+#include "MeshGeometry.h"
+#include "Ray.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Visibility queries the transfer baker casts its rays through.
+ */
+class Occluder
+{
+public:
+    virtual ~Occluder() { }
+    /**
+     * Whether the ray origin + t * dir hits a triangle for some t in
+     * (0, tMax).
+     */
+    virtual bool occluded(const Vector3f &origin, const Vector3f &dir, float tMax) const = 0;
+    /**
+     * Same as above for `count` rays at once, into `results`, which lets
+     * occluders trace them together. Tests them one by one by default.
+     */
+    virtual void occluded(const Ray *rays, bool *results, int count) const;
+};
+
+/**
+ * Tests every ray against every triangle : a reference to check faster
+ * occluders against, far too slow to bake a whole mesh.
+ */
+class BruteForceOccluder : public Occluder
+{
+public:
+    BruteForceOccluder(const MeshGeometry &geometry);
+    bool occluded(const Vector3f &origin, const Vector3f &dir, float tMax) const override;
+    using Occluder::occluded;
+private:
+    // First vertex and the two edges leaving it, per triangle
+    vector<Vector3f> _v0, _e1, _e2;
+};
+
+struct PRTBakeParams
+{
+    // Each vertex casts samplesPerSide² rays, one per stratum of the
+    // cosine-weighted hemisphere
+    int samplesPerSide = 12;
+    // Without shadows, the transfer converges to diffuseTransfer()
+    bool shadowed = true;
+    // Ray origins leave the surface along the normal by this fraction of
+    // the mesh's bounding box diagonal
+    float bias = 1e-4f;
+    // Trace each vertex's rays together, through the batched query
+    bool batchRays = false;
+};
+
+struct PRTBakeStats
+{
+    uint64_t rays = 0;
+    // In milliseconds
+    double time = 0.;
+    
+    double raysPerSecond() const { return time > 0. ? rays / time * 1e3 : 0.; }
+};
+
+/**
+ * Precomputes the diffuse radiance transfer of every vertex of `geometry`
+ * (Sloan et al. 2002) : row i holds the projection onto SH of the cosine
+ * lobe around normal i, times the visibility of the distant environment,
+ * over PI. It maps the environment's radiance coefficients to the radiance
+ * a white Lambertian surface reflects, self-shadowing included, and can
+ * replace InverseLightingSolver's unshadowed rows.
+ * 
+ * Directions are drawn by stratified jittered sampling of the square,
+ * mapped to the cosine-weighted hemisphere so that the estimator is the
+ * plain average of V(w) Y(w). Runs in parallel over vertices, each vertex
+ * seeding its own random numbers so that bakes are reproducible whatever
+ * the number of threads.
+ */
+template<int Order>
+typename InverseLightingSolver<Order>::TransferMatrix bakeTransfer(const MeshGeometry &geometry, const Occluder &occluder,
+    const PRTBakeParams &params = PRTBakeParams(), PRTBakeStats *stats = nullptr);
+
+/**
+ * Writes a baked transfer, with its order and number of vertices.
+ */
+template<int Order>
+void saveTransfer(const string &path, const typename InverseLightingSolver<Order>::TransferMatrix &transfer);
+/**
+ * Reads a transfer saved above, returning false if the file is missing or
+ * holds another order.
+ */
+template<int Order>
+bool loadTransfer(const string &path, typename InverseLightingSolver<Order>::TransferMatrix &transfer);
+/**
+ * Same as above for a compressed transfer, with its clusters and basis
+ * size.
+ */
+template<int Order>
+void saveTransfer(const string &path, const CompressedTransfer<Order> &transfer);
+template<int Order>
+bool loadTransfer(const string &path, CompressedTransfer<Order> &transfer);
+
+}
+
+#endif
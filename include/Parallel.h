@@ -0,0 +1,95 @@
+#ifndef INC_PARALLEL
+#define INC_PARALLEL
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace invLight
+{
+
+/**
+ * Number of threads the CPU-side precomputations spread their work over.
+ */
+unsigned int workerCount();
+
+/**
+ * Overrides workerCount(), 0 going back to the number of cores. Only has an
+ * effect before the first parallel call, which starts the shared pool.
+ */
+void setWorkerCount(unsigned int count);
+
+/**
+ * Work-stealing thread pool. Each thread has its own queue, takes its
+ * newest task first and steals the oldest task of another queue when its
+ * own is empty, so that tasks submitted from within tasks, like the loops
+ * of a bake running on a worker, spread over idle threads instead of
+ * starting threads of their own. Threads that aren't workers submit to a
+ * queue of their own and take part through runUntil().
+ */
+class ThreadPool
+{
+public:
+    /**
+     * Pool of workerCount() - 1 threads used by parallelFor(), the thread
+     * calling runUntil() making up for the last one.
+     */
+    static ThreadPool& shared();
+    
+    ThreadPool(unsigned int threads);
+    /**
+     * Waits for the queued tasks to finish.
+     */
+    ~ThreadPool();
+    
+    unsigned int size() const { return _threads.size(); }
+    void submit(std::function<void()> task);
+    /**
+     * Runs queued tasks on the calling thread until done() returns true,
+     * sleeping while there are none. done() is checked between tasks and
+     * whenever notify() is called.
+     */
+    void runUntil(const std::function<bool()> &done);
+    /**
+     * Wakes the threads sleeping in runUntil() to check their condition.
+     */
+    void notify();
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+    
+    // Queue of the calling thread, the last one for threads outside the pool
+    unsigned int queueIndex() const;
+    bool pop(unsigned int index, std::function<void()> &task);
+    void work(unsigned int index);
+    
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::atomic<int> _queued;
+    bool _stop = false;
+};
+
+/**
+ * Splits [begin, end) into chunks of at most `grain` items and runs
+ * f(chunkBegin, chunkEnd) on all of them across the shared pool. The
+ * calling thread takes part in the work, and the function returns once
+ * every chunk is done, rethrowing the first exception a chunk threw. While
+ * waiting for the last chunks, the caller may run unrelated pool tasks, so
+ * it must not hold a lock these could take. A grain of 0 picks a chunk
+ * size automatically.
+ */
+void parallelFor(int begin, int end, const std::function<void(int, int)> &f, int grain = 0);
+
+}
+
+#endif
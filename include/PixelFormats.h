@@ -0,0 +1,61 @@
+#ifndef INC_PIXEL_FORMATS
+#define INC_PIXEL_FORMATS
+
+#include <cstddef>
+#include <cstdint>
+
+namespace invLight
+{
+
+/**
+ * In-memory encodings of an RGB HDR pixel.
+ */
+enum PixelFormat
+{
+    // Shared-exponent bytes as stored in Radiance files, 4 bytes
+    PIXEL_RGBE,
+    // IEEE half floats, 6 bytes
+    PIXEL_HALF,
+    // 32-bit floats, 12 bytes
+    PIXEL_FLOAT,
+    // GL_RGB9_E5 packed shared exponent, 4 bytes
+    PIXEL_RGB9E5
+};
+
+int pixelSize(PixelFormat format);
+
+/**
+ * Round-to-nearest-even conversion, overflowing to infinity.
+ */
+uint16_t floatToHalf(float f);
+float halfToFloat(uint16_t h);
+
+/**
+ * Bulk conversions of `count` values, using F16C instructions when the CPU
+ * has them.
+ */
+void floatToHalf(const float *src, uint16_t *dst, size_t count);
+void halfToFloat(const uint16_t *src, float *dst, size_t count);
+
+void rgbeToFloat(const uint8_t *rgbe, float *rgb);
+void floatToRGBE(const float *rgb, uint8_t *rgbe);
+
+/**
+ * Packing of EXT_texture_shared_exponent, for GL_UNSIGNED_INT_5_9_9_9_REV.
+ */
+uint32_t floatToRGB9E5(const float *rgb);
+void rgb9e5ToFloat(uint32_t packed, float *rgb);
+/**
+ * Exact repacking of an RGBE pixel's 8-bit mantissas, without going
+ * through floats.
+ */
+uint32_t rgbeToRGB9E5(const uint8_t *rgbe);
+
+/**
+ * Converts `count` pixels from `src` in `srcFormat` to `dst` in `dstFormat`.
+ */
+void convertPixels(const void *src, PixelFormat srcFormat, void *dst, PixelFormat dstFormat, int count);
+
+}
+
+#endif
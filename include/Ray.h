@@ -0,0 +1,33 @@
+#ifndef INC_RAY
+#define INC_RAY
+
+#include <cmath>
+
+#include <Eigen/Eigen>
+
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct Ray
+{
+    Vector3f origin, dir;
+    float tMin = 0.f, tMax = INFINITY;
+    
+    Ray() { }
+    Ray(const Vector3f &o, const Vector3f &d, float maxDistance = INFINITY) : origin(o), dir(d), tMax(maxDistance) { }
+};
+
+struct Hit
+{
+    float t = INFINITY;
+    // Barycentric coordinates of the hit point along the triangle's edges
+    float u = 0.f, v = 0.f;
+    // Index of the triangle in the MeshGeometry, -1 for a miss
+    int triangle = -1;
+};
+
+}
+
+#endif
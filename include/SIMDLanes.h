@@ -0,0 +1,227 @@
+#ifndef INC_SIMD_LANES
+#define INC_SIMD_LANES
+
+// W floats and W-lane masks with the few operations packet ray traversal
+// needs, as plain arrays for any width, as SSE (4) registers when the
+// compiler targets them and as AVX (8) ones with GCC on x86, so that
+// traversal is written once.
+
+#include <cstdint>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// 8 lanes are compiled for AVX2 whatever the build flags, for functions
+// that only run once the CPU is known to support it (see
+// BVH::packetWidth()). Those functions need AVX2_LANES too, for the lanes'
+// operations to inline into them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAS_AVX2_LANES
+#define AVX2_LANES __attribute__((target("avx2")))
+#endif
+
+namespace invLight
+{
+
+template<int W>
+struct LaneMask
+{
+    // Bit k is lane k
+    uint32_t bits;
+    
+    LaneMask() { }
+    LaneMask(uint32_t b) : bits(b) { }
+    
+    /**
+     * Lanes [0, count).
+     */
+    static LaneMask first(int count) { return count >= 32 ? ~0u : (1u << count) - 1; }
+    uint32_t mask() const { return bits; }
+};
+
+template<int W> inline LaneMask<W> operator&(LaneMask<W> a, LaneMask<W> b) { return a.bits & b.bits; }
+template<int W> inline LaneMask<W> operator|(LaneMask<W> a, LaneMask<W> b) { return a.bits | b.bits; }
+// a and not b
+template<int W> inline LaneMask<W> andNot(LaneMask<W> a, LaneMask<W> b) { return a.bits & ~b.bits; }
+
+template<int W>
+struct Lanes
+{
+    static const int WIDTH = W;
+    typedef LaneMask<W> Mask;
+    
+    float v[W];
+    
+    Lanes() { }
+    Lanes(float x)
+    {
+        for(int k = 0; k < W; k++)
+            v[k] = x;
+    }
+    
+    static Lanes load(const float *p)
+    {
+        Lanes l;
+        for(int k = 0; k < W; k++)
+            l.v[k] = p[k];
+        return l;
+    }
+    void store(float *p) const
+    {
+        for(int k = 0; k < W; k++)
+            p[k] = v[k];
+    }
+};
+
+#define LANES_OPERATOR(OP, EXPRESSION) \
+    template<int W> inline Lanes<W> OP(Lanes<W> a, Lanes<W> b) \
+    { \
+        Lanes<W> r; \
+        for(int k = 0; k < W; k++) \
+            r.v[k] = EXPRESSION; \
+        return r; \
+    }
+#define LANES_COMPARISON(OP) \
+    template<int W> inline LaneMask<W> operator OP(Lanes<W> a, Lanes<W> b) \
+    { \
+        uint32_t bits = 0; \
+        for(int k = 0; k < W; k++) \
+            bits |= (uint32_t)(a.v[k] OP b.v[k]) << k; \
+        return bits; \
+    }
+
+LANES_OPERATOR(operator+, a.v[k] + b.v[k])
+LANES_OPERATOR(operator-, a.v[k] - b.v[k])
+LANES_OPERATOR(operator*, a.v[k] * b.v[k])
+LANES_OPERATOR(operator/, a.v[k] / b.v[k])
+// Same operand order as minps and maxps : b when either is NaN
+LANES_OPERATOR(vmin, a.v[k] < b.v[k] ? a.v[k] : b.v[k])
+LANES_OPERATOR(vmax, a.v[k] > b.v[k] ? a.v[k] : b.v[k])
+LANES_COMPARISON(<)
+LANES_COMPARISON(<=)
+LANES_COMPARISON(>)
+
+#undef LANES_OPERATOR
+#undef LANES_COMPARISON
+
+template<int W>
+inline Lanes<W> select(LaneMask<W> m, Lanes<W> a, Lanes<W> b)
+{
+    Lanes<W> r;
+    for(int k = 0; k < W; k++)
+        r.v[k] = m.bits >> k & 1 ? a.v[k] : b.v[k];
+    return r;
+}
+
+#ifdef __SSE2__
+
+template<>
+struct LaneMask<4>
+{
+    __m128 m;
+    
+    LaneMask() { }
+    LaneMask(__m128 x) : m(x) { }
+    
+    static LaneMask first(int count)
+    {
+        return _mm_cmplt_ps(_mm_set_ps(3.f, 2.f, 1.f, 0.f), _mm_set1_ps(count));
+    }
+    uint32_t mask() const { return _mm_movemask_ps(m); }
+};
+
+inline LaneMask<4> operator&(LaneMask<4> a, LaneMask<4> b) { return _mm_and_ps(a.m, b.m); }
+inline LaneMask<4> operator|(LaneMask<4> a, LaneMask<4> b) { return _mm_or_ps(a.m, b.m); }
+inline LaneMask<4> andNot(LaneMask<4> a, LaneMask<4> b) { return _mm_andnot_ps(b.m, a.m); }
+
+template<>
+struct Lanes<4>
+{
+    static const int WIDTH = 4;
+    typedef LaneMask<4> Mask;
+    
+    __m128 v;
+    
+    Lanes() { }
+    Lanes(__m128 x) : v(x) { }
+    Lanes(float x) : v(_mm_set1_ps(x)) { }
+    
+    static Lanes load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline Lanes<4> operator+(Lanes<4> a, Lanes<4> b) { return _mm_add_ps(a.v, b.v); }
+inline Lanes<4> operator-(Lanes<4> a, Lanes<4> b) { return _mm_sub_ps(a.v, b.v); }
+inline Lanes<4> operator*(Lanes<4> a, Lanes<4> b) { return _mm_mul_ps(a.v, b.v); }
+inline Lanes<4> operator/(Lanes<4> a, Lanes<4> b) { return _mm_div_ps(a.v, b.v); }
+inline Lanes<4> vmin(Lanes<4> a, Lanes<4> b) { return _mm_min_ps(a.v, b.v); }
+inline Lanes<4> vmax(Lanes<4> a, Lanes<4> b) { return _mm_max_ps(a.v, b.v); }
+inline LaneMask<4> operator<(Lanes<4> a, Lanes<4> b) { return _mm_cmplt_ps(a.v, b.v); }
+inline LaneMask<4> operator<=(Lanes<4> a, Lanes<4> b) { return _mm_cmple_ps(a.v, b.v); }
+inline LaneMask<4> operator>(Lanes<4> a, Lanes<4> b) { return _mm_cmpgt_ps(a.v, b.v); }
+
+inline Lanes<4> select(LaneMask<4> m, Lanes<4> a, Lanes<4> b)
+{
+    return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v));
+}
+
+#endif
+
+#ifdef HAS_AVX2_LANES
+
+template<>
+struct LaneMask<8>
+{
+    __m256 m;
+    
+    AVX2_LANES LaneMask() { }
+    AVX2_LANES LaneMask(__m256 x) : m(x) { }
+    
+    AVX2_LANES static LaneMask first(int count)
+    {
+        return _mm256_cmp_ps(_mm256_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f), _mm256_set1_ps(count), _CMP_LT_OQ);
+    }
+    AVX2_LANES uint32_t mask() const { return _mm256_movemask_ps(m); }
+};
+
+AVX2_LANES inline LaneMask<8> operator&(LaneMask<8> a, LaneMask<8> b) { return _mm256_and_ps(a.m, b.m); }
+AVX2_LANES inline LaneMask<8> operator|(LaneMask<8> a, LaneMask<8> b) { return _mm256_or_ps(a.m, b.m); }
+AVX2_LANES inline LaneMask<8> andNot(LaneMask<8> a, LaneMask<8> b) { return _mm256_andnot_ps(b.m, a.m); }
+
+template<>
+struct Lanes<8>
+{
+    static const int WIDTH = 8;
+    typedef LaneMask<8> Mask;
+    
+    __m256 v;
+    
+    AVX2_LANES Lanes() { }
+    AVX2_LANES Lanes(__m256 x) : v(x) { }
+    AVX2_LANES Lanes(float x) : v(_mm256_set1_ps(x)) { }
+    
+    AVX2_LANES static Lanes load(const float *p) { return _mm256_loadu_ps(p); }
+    AVX2_LANES void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+AVX2_LANES inline Lanes<8> operator+(Lanes<8> a, Lanes<8> b) { return _mm256_add_ps(a.v, b.v); }
+AVX2_LANES inline Lanes<8> operator-(Lanes<8> a, Lanes<8> b) { return _mm256_sub_ps(a.v, b.v); }
+AVX2_LANES inline Lanes<8> operator*(Lanes<8> a, Lanes<8> b) { return _mm256_mul_ps(a.v, b.v); }
+AVX2_LANES inline Lanes<8> operator/(Lanes<8> a, Lanes<8> b) { return _mm256_div_ps(a.v, b.v); }
+AVX2_LANES inline Lanes<8> vmin(Lanes<8> a, Lanes<8> b) { return _mm256_min_ps(a.v, b.v); }
+AVX2_LANES inline Lanes<8> vmax(Lanes<8> a, Lanes<8> b) { return _mm256_max_ps(a.v, b.v); }
+AVX2_LANES inline LaneMask<8> operator<(Lanes<8> a, Lanes<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+AVX2_LANES inline LaneMask<8> operator<=(Lanes<8> a, Lanes<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+AVX2_LANES inline LaneMask<8> operator>(Lanes<8> a, Lanes<8> b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+
+AVX2_LANES inline Lanes<8> select(LaneMask<8> m, Lanes<8> a, Lanes<8> b)
+{
+    return _mm256_blendv_ps(b.v, a.v, m.m);
+}
+
+#endif
+
+}
+
+#endif
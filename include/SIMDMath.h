@@ -0,0 +1,112 @@
+#ifndef INC_SIMD_MATH
+#define INC_SIMD_MATH
+
+// Polynomial approximations of the transcendental functions used to map
+// directions to texture coordinates, 4 lanes at a time, and a 4 lanes float
+// type for kernels written once for scalars and vectors.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+namespace invLight
+{
+
+inline __m128 abs_ps(__m128 x)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.f), x);
+}
+
+inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/**
+ * 4 floats with the arithmetic operators, so that kernels templated on
+ * their scalar type run on one value or on 4 lanes at once.
+ */
+struct Float4
+{
+    __m128 v;
+    
+    Float4() { }
+    Float4(__m128 x) : v(x) { }
+    Float4(float x) : v(_mm_set1_ps(x)) { }
+};
+
+inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+
+/**
+ * atan2(y, x), with an absolute error below 1e-5 radians.
+ */
+inline __m128 atan2_ps(__m128 y, __m128 x)
+{
+    __m128 ax = abs_ps(x), ay = abs_ps(y),
+        mx = _mm_max_ps(ax, ay), mn = _mm_min_ps(ax, ay),
+        // Avoid 0 / 0 at the origin
+        a = _mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(1e-30f))),
+        s = _mm_mul_ps(a, a);
+    // Minimax polynomial for atan on [0, 1]
+    __m128 r = _mm_set1_ps(-0.01172120f);
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.05265332f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(-0.11643287f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.19354346f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(-0.33262347f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.99997726f));
+    r = _mm_mul_ps(r, a);
+    // Back to the right octant, then quadrant
+    r = select_ps(_mm_cmpgt_ps(ay, ax), _mm_sub_ps(_mm_set1_ps(1.57079637f), r), r);
+    r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(3.14159274f), r), r);
+    return _mm_or_ps(r, _mm_and_ps(y, _mm_set1_ps(-0.f)));
+}
+
+/**
+ * acos(x) for x in [-1, 1], with an absolute error below 1e-7 radians
+ * (Abramowitz and Stegun 4.4.46).
+ */
+inline __m128 acos_ps(__m128 x)
+{
+    __m128 ax = _mm_min_ps(abs_ps(x), _mm_set1_ps(1.f));
+    __m128 r = _mm_set1_ps(-0.0012624911f);
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(0.0066700901f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(-0.0170881256f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(0.0308918810f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(-0.0501743046f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(0.0889789874f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(-0.2145988016f));
+    r = _mm_add_ps(_mm_mul_ps(r, ax), _mm_set1_ps(1.5707963050f));
+    r = _mm_mul_ps(r, _mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.f), ax)));
+    // acos(-x) = pi - acos(x)
+    return select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(3.14159274f), r), r);
+}
+
+/**
+ * Unit directions of the octahedral coordinates (u, v) in [0, 1], see
+ * OctahedralImage.h.
+ */
+inline void octDecode_ps(__m128 u, __m128 v, __m128 &x, __m128 &y, __m128 &z)
+{
+    const __m128 one = _mm_set1_ps(1.f), sign = _mm_set1_ps(-0.f);
+    x = _mm_sub_ps(_mm_add_ps(u, u), one);
+    z = _mm_sub_ps(_mm_add_ps(v, v), one);
+    __m128 ax = abs_ps(x), az = abs_ps(z);
+    y = _mm_sub_ps(_mm_sub_ps(one, ax), az);
+    // Fold the corners back onto the lower hemisphere
+    __m128 lower = _mm_cmplt_ps(y, _mm_setzero_ps()),
+        fx = _mm_or_ps(_mm_sub_ps(one, az), _mm_and_ps(x, sign)),
+        fz = _mm_or_ps(_mm_sub_ps(one, ax), _mm_and_ps(z, sign));
+    x = select_ps(lower, fx, x);
+    z = select_ps(lower, fz, z);
+    __m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z))));
+    x = _mm_mul_ps(x, invLength);
+    y = _mm_mul_ps(y, invLength);
+    z = _mm_mul_ps(z, invLength);
+}
+
+}
+
+#endif
+
+#endif
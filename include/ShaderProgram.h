@@ -24,10 +24,13 @@ public:
     ShaderProgram(const char *vertexPath, const char *fragmentPath);
     ~ShaderProgram();
     void use();
+    void uniform1i(const string &name, int v);
     void uniform1f(const string &name, float v);
     void uniform2f(const string &name, float v1, float v2);
     void uniform3f(const string &name, float v1, float v2, float v3);
     void uniform4f(const string &name, float v1, float v2, float v3, float v4);
+    void uniform1fv(const string &name, GLuint count, const GLfloat *v);
+    void uniform3fv(const string &name, GLuint count, const GLfloat *v);
     void uniformMatrix4fv(const string &name, GLuint count, const GLfloat *v);
     void uniformMatrix3fv(const string &name, GLuint count, const GLfloat *v);
     void vertexAttribPointer(const string &name, GLuint size, GLenum type, GLsizei stride, const GLvoid *pointer);
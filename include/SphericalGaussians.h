@@ -0,0 +1,170 @@
+#ifndef INC_SPHERICAL_GAUSSIANS
+#define INC_SPHERICAL_GAUSSIANS
+
+#include <functional>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "EquirectImage.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Spherical Gaussian lobe G(w) = amplitude exp(sharpness (axis.w - 1)), a
+ * light whose size shrinks as its sharpness grows. A handful of them
+ * stands for a whole environment in 7 floats each, and both their
+ * integrals against the cosine lobe and against a GGX lobe have cheap
+ * closed forms (see modelFragment.glsl).
+ */
+struct SphericalGaussian
+{
+    Vector3f axis = Vector3f(0.f, 1.f, 0.f);
+    float sharpness = 1.f;
+    Vector3f amplitude = Vector3f::Zero();
+    
+    Vector3f eval(const Vector3f &dir) const;
+    /**
+     * Integral over the sphere.
+     */
+    Vector3f integral() const;
+    /**
+     * Irradiance towards the unit normal `n`, from the product integral
+     * with the cosine lobe approximated by a spherical Gaussian.
+     */
+    Vector3f irradiance(const Vector3f &n) const;
+};
+
+/**
+ * `count` black lobes with axes spread over the sphere by a Fibonacci
+ * lattice, and sharp enough to overlap their neighbors.
+ */
+vector<SphericalGaussian> spreadLobes(int count);
+
+/**
+ * Called with the lobes after each accepted Levenberg-Marquardt step, to
+ * show them before the fit ends. Returning false stops the fit there.
+ */
+typedef function<bool(const vector<SphericalGaussian>&)> SGProgress;
+
+struct SGFitOptions
+{
+    /**
+     * Weight of the prior against the constraints when fitting painted
+     * constraints, independent of how many there are.
+     */
+    float regularization = .05f;
+    // Levenberg-Marquardt steps, accepted or not, per fit. Fits from
+    // scratch take a few dozen, painted ones from the previous solution a
+    // few
+    int maxIterations = 100;
+    // Relative decrease of the cost under which an accepted step ends the
+    // fit
+    float tolerance = 1e-4f;
+};
+
+struct SGFitStats
+{
+    int iterations = 0;
+    // Weighted squared residuals at the end
+    double cost = 0.;
+    // In milliseconds
+    double time = 0.;
+};
+
+/**
+ * Fits `count` lobes to the radiance of `environment`, weighted by solid
+ * angle, by Levenberg-Marquardt from spreadLobes() with the amplitudes
+ * that fit best. Images wider than `maxWidth` are box-filtered down first.
+ */
+vector<SphericalGaussian> fitSphericalGaussians(const EquirectImage &environment, int count,
+    const SGFitOptions &options = SGFitOptions(), SGFitStats *stats = nullptr, int maxWidth = 64,
+    const SGProgress &progress = SGProgress());
+
+/**
+ * InverseLightingSolver's problem with spherical Gaussian lights instead
+ * of SH : painted vertices ask for a radiance, which a white Lambertian
+ * surface of normal n reflects under the lobes when
+ *
+ *     target = sum_k G_k.irradiance(n) / PI
+ *
+ * and the lobes' axes, sharpnesses and amplitudes minimize the weighted
+ * squared differences, plus lambda sum(w) times the squared distance of
+ * the parameters to the prior's. That is nonlinear in the axes and
+ * sharpnesses : each solve runs Levenberg-Marquardt from the previous
+ * solution, with analytic Jacobians whose normal equations are assembled
+ * in parallel over the constraints. There are only 7 parameters per lobe,
+ * whatever the number of constraints. Amplitudes are kept non-negative.
+ */
+class SGLightingSolver
+{
+public:
+    typedef vector<SphericalGaussian> Solution;
+    typedef SGProgress Progress;
+    
+    /**
+     * `normals` are the unit normals of the mesh's vertices.
+     */
+    SGLightingSolver(const vector<Vector3f> &normals, const SGFitOptions &options = SGFitOptions());
+    
+    const SGFitOptions& getOptions() const { return _options; }
+    void setOptions(const SGFitOptions &options) { _options = options; }
+    
+    /**
+     * Lobes the solution is pulled towards and starts from, typically
+     * fitted to the environment. Sets how many lobes are solved for.
+     */
+    void setPrior(const vector<SphericalGaussian> &lobes);
+    const vector<SphericalGaussian>& prior() const { return _prior; }
+    
+    /**
+     * Asks for vertex `vertex` to reflect the radiance `target`, painting
+     * over its previous constraint if any.
+     */
+    void addConstraint(int vertex, const Vector3f &target, float weight = 1.f);
+    void clearConstraints();
+    int constraintCount() const { return _constraints.size(); }
+    
+    /**
+     * Fits the lobes to the current constraints, the prior when there are
+     * none, reporting each step to `progress`. Returns lobes().
+     */
+    const vector<SphericalGaussian>& solve(const Progress &progress = Progress());
+    const vector<SphericalGaussian>& lobes() const { return _lobes; }
+    /**
+     * Radiance vertex `vertex` reflects under the solution.
+     */
+    Vector3f shading(int vertex) const;
+    
+    /**
+     * Duration of the last solve, in milliseconds.
+     */
+    double lastSolveTime() const { return _stats.time; }
+    /**
+     * Levenberg-Marquardt steps of the last solve.
+     */
+    int lastIterations() const { return _stats.iterations; }
+private:
+    struct Constraint
+    {
+        int vertex;
+        Vector3f target;
+        float weight;
+    };
+    
+    vector<Vector3f> _normals;
+    SGFitOptions _options;
+    vector<Constraint> _constraints;
+    // Index in _constraints of each vertex's constraint, -1 if none
+    vector<int> _constraintIndices;
+    vector<SphericalGaussian> _prior, _lobes;
+    SGFitStats _stats;
+};
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef INC_SPHERICAL_HARMONICS
+#define INC_SPHERICAL_HARMONICS
+
+#include <Eigen/Eigen>
+
+using namespace Eigen;
+
+namespace invLight
+{
+
+/**
+ * Real spherical harmonics up to band Order, (Order + 1)² coefficients per
+ * channel. The polar axis is +Y and the azimuth follows norm2equi() in
+ * commonFragment.glsl, so that phi = (u - 0.5) * 2 * PI and
+ * theta = v * PI for an equirectangular texel (u, v).
+ *
+ * The order is a compile-time constant : the basis is evaluated with the
+ * associated Legendre and azimuthal recurrences unrolled band by band,
+ * with constexpr normalization constants, and code using several orders
+ * instantiates each one instead of looping over a runtime band count.
+ * Orders 2 to 8 are instantiated in SphericalHarmonics.cpp.
+ */
+template<int Order>
+struct SH
+{
+    static_assert(Order >= 2 && Order <= 8, "SH is instantiated for orders 2 to 8");
+    
+    static const int BANDS = Order + 1, COEFFICIENTS = BANDS * BANDS;
+    
+    /**
+     * One column per color channel, coefficient l * (l + 1) + m holding
+     * band l and order m. Never aligned, so that any order can be a member
+     * of a heap-allocated struct.
+     */
+    typedef Matrix<float, COEFFICIENTS, 3, DontAlign> Coefficients;
+    
+    /**
+     * Evaluates the basis functions in the direction `dir` (unit length).
+     */
+    static void evalBasis(const Vector3f &dir, float *basis);
+    /**
+     * Same as above for 4 directions given as x, y and z arrays, with SSE
+     * when available : basis[4 * i + k] is function i in direction k.
+     */
+    static void evalBasis4(const float *x, const float *y, const float *z, float *basis);
+    
+    /**
+     * Projects an RGB float equirectangular image onto SH, weighting each
+     * row by the solid angle of its texels. Runs in parallel over rows.
+     */
+    static Coefficients projectEquirect(const float *pixels, int width, int height);
+    /**
+     * Projects the rectangle [x0, x0 + regionWidth) x [y0, y0 + regionHeight)
+     * of a width x height equirectangular image, given as its own
+     * regionWidth x regionHeight RGB pixels.
+     */
+    static Coefficients projectEquirectRegion(const float *pixels, int x0, int y0, int regionWidth, int regionHeight,
+        int width, int height);
+    /**
+     * Updates coefficients after the rectangle above changed from
+     * `oldPixels` to `newPixels` : projection is linear, so this adds the
+     * projection of their difference, at a cost proportional to the
+     * rectangle's area. With `irradiance` set, the difference is convolved
+     * with the cosine lobe first, to update coefficients that went through
+     * convolveCosine().
+     */
+    static void updateEquirect(Coefficients &sh, const float *oldPixels, const float *newPixels,
+        int x0, int y0, int regionWidth, int regionHeight, int width, int height, bool irradiance = false);
+    
+    /**
+     * Convolves radiance coefficients with the clamped cosine lobe, turning
+     * them into irradiance coefficients. Odd bands above 1 vanish.
+     */
+    static void convolveCosine(Coefficients &sh);
+    
+    /**
+     * Reconstructs the function described by `sh` in the direction `dir`.
+     */
+    static Vector3f eval(const Coefficients &sh, const Vector3f &dir);
+    /**
+     * Reconstructs `sh` into a RGB float equirectangular image of size
+     * width x height, 4 texels at a time.
+     */
+    static void renderEquirect(const Coefficients &sh, int width, int height, float *pixels);
+};
+
+/**
+ * Order of the environment's irradiance, which the shaders expect : the
+ * cosine lobe leaves almost nothing in higher bands.
+ */
+const int SH_ORDER = 2;
+const int SH_COEFFICIENTS = SH<SH_ORDER>::COEFFICIENTS;
+
+typedef SH<SH_ORDER>::Coefficients SHCoefficients;
+
+inline void evalSHBasis(const Vector3f &dir, float *basis)
+{
+    SH<SH_ORDER>::evalBasis(dir, basis);
+}
+
+inline SHCoefficients projectEquirectSH(const float *pixels, int width, int height)
+{
+    return SH<SH_ORDER>::projectEquirect(pixels, width, height);
+}
+
+inline SHCoefficients projectEquirectRegionSH(const float *pixels, int x0, int y0, int regionWidth, int regionHeight,
+    int width, int height)
+{
+    return SH<SH_ORDER>::projectEquirectRegion(pixels, x0, y0, regionWidth, regionHeight, width, height);
+}
+
+inline void updateEquirectSH(SHCoefficients &sh, const float *oldPixels, const float *newPixels,
+    int x0, int y0, int regionWidth, int regionHeight, int width, int height, bool irradiance = false)
+{
+    SH<SH_ORDER>::updateEquirect(sh, oldPixels, newPixels, x0, y0, regionWidth, regionHeight, width, height, irradiance);
+}
+
+inline void convolveSHCosine(SHCoefficients &sh)
+{
+    SH<SH_ORDER>::convolveCosine(sh);
+}
+
+inline Vector3f evalSH(const SHCoefficients &sh, const Vector3f &dir)
+{
+    return SH<SH_ORDER>::eval(sh, dir);
+}
+
+inline void renderEquirectSH(const SHCoefficients &sh, int width, int height, float *pixels)
+{
+    SH<SH_ORDER>::renderEquirect(sh, width, height, pixels);
+}
+
+}
+
+#endif
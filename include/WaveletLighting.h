@@ -0,0 +1,218 @@
+#ifndef INC_WAVELET_LIGHTING
+#define INC_WAVELET_LIGHTING
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <Eigen/Eigen>
+
+#include "CubeMapImage.h"
+#include "MeshGeometry.h"
+#include "PRTBaker.h"
+
+using namespace std;
+using namespace Eigen;
+
+namespace invLight
+{
+
+struct WaveletBakeParams
+{
+    // Side of the cube faces the lighting is sampled on, a power of two
+    int size = 32;
+    // Wavelet coefficients kept per vertex, the largest ones
+    int terms = 64;
+};
+
+/**
+ * All-frequency diffuse transfer, after Ng et al.'s "All-Frequency Shadows
+ * Using Non-linear Wavelet Lighting Approximation" : the environment is a
+ * size x size cube map, each vertex's transfer the cube map of what every
+ * texel contributes to the radiance it reflects,
+ *
+ *     T(w) = V(w) max(0, n.w) dw / PI
+ *
+ * which the orthonormal Haar transform of each face makes sparse. Only the
+ * largest few coefficients of each vertex are kept, which preserves hard
+ * shadows and sharp lights that SH rows blur, in a sparse matrix of one
+ * row per vertex and one column per wavelet coefficient.
+ *
+ * Coefficients are laid out like CubeMapImage's texels : face after face,
+ * each face holding its nonstandard 2D Haar decomposition, the average in
+ * texel (0, 0) and the details of level j in texels whose largest
+ * coordinate is in [2^j, 2^(j + 1)).
+ */
+class WaveletTransfer
+{
+public:
+    typedef SparseMatrix<float, RowMajor> TransferMatrix;
+    
+    WaveletTransfer() { }
+    WaveletTransfer(int size, const TransferMatrix &rows);
+    
+    int size() const { return _size; }
+    int vertexCount() const { return _rows.rows(); }
+    int coefficientCount() const { return 6 * _size * _size; }
+    bool empty() const { return _rows.rows() == 0; }
+    const TransferMatrix& rows() const { return _rows; }
+    
+    /**
+     * Memory held, against vertexCount() * coefficientCount() floats for
+     * the full matrix.
+     */
+    size_t bytes() const;
+    
+    /**
+     * Haar transform of each channel of each face of `image`, as many rows
+     * as coefficients, and back. The image must be size x size.
+     */
+    Matrix<float, Dynamic, 3> transform(const CubeMapImage &image) const;
+    CubeMapImage reconstruct(const Matrix<float, Dynamic, 3> &coefficients) const;
+    /**
+     * Projection onto SH_ORDER spherical harmonics, straight from the
+     * coefficients : the Haar basis is orthonormal, so row k holds the
+     * transform of Y_k weighted by each texel's solid angle, and
+     * shProjection() * coefficients is the SH of their radiance.
+     */
+    Matrix<float, SH_COEFFICIENTS, Dynamic> shProjection() const;
+private:
+    int _size = 0;
+    TransferMatrix _rows;
+};
+
+/**
+ * Bakes the wavelet transfer of every vertex of `geometry` : one ray
+ * towards the center of each texel above its horizon, then the Haar
+ * transform of the texels and the largest params.terms coefficients. Uses
+ * `prt` for shadows, bias and batching, its samples being the texels.
+ * Runs in parallel over vertices.
+ */
+WaveletTransfer bakeWaveletTransfer(const MeshGeometry &geometry, const Occluder &occluder,
+    const WaveletBakeParams &params = WaveletBakeParams(), const PRTBakeParams &prt = PRTBakeParams(),
+    PRTBakeStats *stats = nullptr);
+
+/**
+ * Writes a wavelet transfer, with its face size and nonzeros, and reads it
+ * back, returning false if the file is missing or invalid.
+ */
+void saveTransfer(const string &path, const WaveletTransfer &transfer);
+bool loadTransfer(const string &path, WaveletTransfer &transfer);
+
+struct WaveletLightingOptions
+{
+    /**
+     * Weight of the prior against the constraints, independent of how many
+     * there are. Coefficients of level j are scaled by 2^j inside the
+     * penalty's square, which weighs their squares by 4^j, so that the
+     * lighting only gets as sharp as the strokes ask.
+     */
+    float regularization = .001f;
+    // Conjugate gradient iterations per channel and solve
+    int maxIterations = 100;
+    // On the residual of the normal equations, relative to their right
+    // hand side
+    float tolerance = 1e-3f;
+};
+
+/**
+ * Same problem as InverseLightingSolver's, over the wavelet coefficients
+ * of a cube map rather than SH : painted vertices ask for a radiance, and
+ * the lighting L minimizes
+ *
+ *     |W^½ (T L - t)|² + lambda sum(w) |D (L - L0)|²
+ *
+ * with T the painted vertices' sparse rows and D diagonal, 2^j for the
+ * coefficients of level j. There are 6 size² unknowns per
+ * channel, 6144 at size 32, too many to factor their dense normal
+ * equations at every stroke. Instead, the constraints' rows and the
+ * penalty's diagonal are stacked into a sparse least squares system, which
+ * conjugate gradients on the normal equations (LSCG) solve without ever
+ * forming them, starting from the previous solution : a stroke moves it
+ * little, and each iteration costs a product with the painted rows'
+ * nonzeros. The three channels are solved in parallel.
+ */
+class WaveletLightingSolver
+{
+public:
+    typedef Matrix<float, Dynamic, 3> Coefficients;
+    typedef Coefficients Solution;
+    /**
+     * Called with the coefficients every few iterations, to show them
+     * before the solve ends. Returning false stops the solve there.
+     */
+    typedef function<bool(const Coefficients&)> Progress;
+    
+    WaveletLightingSolver(const WaveletTransfer &transfer, const WaveletLightingOptions &options = WaveletLightingOptions());
+    
+    const WaveletTransfer& transfer() const { return _transfer; }
+    const WaveletLightingOptions& getOptions() const { return _options; }
+    void setOptions(const WaveletLightingOptions &options) { _options = options; }
+    
+    /**
+     * Radiance the solution is pulled towards, black by default, resampled
+     * to the transfer's size.
+     */
+    void setPrior(const CubeMapImage &radiance);
+    
+    /**
+     * Asks for vertex `vertex` to reflect the radiance `target`, painting
+     * over its previous constraint if any.
+     */
+    void addConstraint(int vertex, const Vector3f &target, float weight = 1.f);
+    void clearConstraints();
+    int constraintCount() const { return _constraints.size(); }
+    
+    /**
+     * Solves for the lighting from the current constraints, the prior when
+     * there are none. With a `progress`, the channels stop every few
+     * iterations to report their current solution. Returns coefficients().
+     */
+    const Coefficients& solve(const Progress &progress = Progress());
+    const Coefficients& coefficients() const { return _coefficients; }
+    /**
+     * Solved lighting as a cube map.
+     */
+    CubeMapImage radiance() const;
+    /**
+     * Radiance vertex `vertex` reflects under the solution.
+     */
+    Vector3f shading(int vertex) const;
+    /**
+     * Same as above for every vertex, in parallel.
+     */
+    void shading(vector<Vector3f> &radiances) const;
+    
+    /**
+     * Duration of the last solve, in milliseconds.
+     */
+    double lastSolveTime() const { return _solveTime; }
+    /**
+     * Conjugate gradient iterations of the last solve, in its slowest
+     * channel.
+     */
+    int lastIterations() const { return _iterations; }
+private:
+    struct Constraint
+    {
+        int vertex;
+        Vector3f target;
+        float weight;
+    };
+    
+    WaveletTransfer _transfer;
+    WaveletLightingOptions _options;
+    vector<Constraint> _constraints;
+    // Index in _constraints of each vertex's constraint, -1 if none
+    vector<int> _constraintIndices;
+    // Diagonal of D, 2^j at level j : the penalty's rows are scaled by it,
+    // so the objective weighs each coefficient's squared change by 4^j
+    VectorXf _penalties;
+    Coefficients _prior, _coefficients;
+    double _solveTime = 0.;
+    int _iterations = 0;
+};
+
+}
+
+#endif
@@ -5,11 +5,14 @@
 #include <stdexcept>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include "glad/glad.h"
 
 void setwd(char **argv);
 std::string getFileContents(const char *path);
+// Sorted paths of the files in `directory` whose name ends with `extension`
+std::vector<std::string> listFiles(const char *directory, const char *extension);
 GLuint createShaderFromSource(GLenum type, const char *path);
 void printShaderLog(GLuint shader);
 
@@ -1,5 +1,9 @@
 const float PI = 3.14159265359;
 
+// Whether the environment maps use the octahedral layout rather than the
+// equirectangular one
+uniform bool uOctahedral;
+
 vec3 spherical2cartesian(float x, float y)
 {
     return vec3(cos(x) * sin(y), cos(y), sin(-x) * sin(y));
@@ -10,3 +14,59 @@ vec2 norm2equi(vec3 dir)
     vec2 uv = vec2(atan(-dir.z, dir.x) / (2. * PI) + 0.5, acos(dir.y) / PI);
     return uv;
 }
+
+// Octahedral projection of a unit direction, +Y at the center and -Y at
+// the corners (see OctahedralImage.h)
+vec2 norm2oct(vec3 dir)
+{
+    vec2 p = dir.xz / (abs(dir.x) + abs(dir.y) + abs(dir.z));
+    if(dir.y < 0.)
+        p = (1. - abs(p.yx)) * mix(vec2(-1.), vec2(1.), greaterThanEqual(p, vec2(0.)));
+    return p * .5 + .5;
+}
+
+vec3 oct2norm(vec2 uv)
+{
+    vec2 p = uv * 2. - 1.;
+    vec3 dir = vec3(p.x, 1. - abs(p.x) - abs(p.y), p.y);
+    if(dir.y < 0.)
+        dir.xz = (1. - abs(dir.zx)) * mix(vec2(-1.), vec2(1.), greaterThanEqual(dir.xz, vec2(0.)));
+    return normalize(dir);
+}
+
+// Texture coordinates of a direction in the environment maps
+vec2 norm2env(vec3 dir)
+{
+    return uOctahedral ? norm2oct(dir) : norm2equi(dir);
+}
+
+// Evaluates irradiance from its L2 spherical harmonics coefficients
+// (see SphericalHarmonics.h for the basis and frame conventions)
+vec3 irradianceSH(vec3 sh[9], vec3 dir)
+{
+    float x = dir.x, y = -dir.z, z = dir.y;
+    return sh[0] * 0.282095
+        + 0.488603 * (sh[1] * y + sh[2] * z + sh[3] * x)
+        + 1.092548 * (sh[4] * x * y + sh[5] * y * z + sh[7] * x * z)
+        + sh[6] * 0.315392 * (3. * z * z - 1.)
+        + sh[8] * 0.546274 * (x * x - y * y);
+}
+
+// Irradiance towards the unit normal n from a spherical Gaussian light, by
+// Stephen Hill's fit of its product integral with the clamped cosine (see
+// SphericalGaussians.cpp)
+vec3 irradianceSG(vec3 axis, float sharpness, vec3 amplitude, vec3 n)
+{
+    float muDotN = dot(axis, n),
+        eml = exp(-sharpness),
+        em2l = eml * eml,
+        rl = 1. / sharpness,
+        scale = 1. + 2. * em2l - rl,
+        bias = (eml - em2l) * rl - em2l,
+        x = sqrt(1. - scale),
+        x0 = .36 * muDotN,
+        x1 = x / (4. * .36),
+        s = x0 + x1,
+        y = abs(x0) <= x1 ? s * s / x : clamp(muDotN, 0., 1.);
+    return amplitude * (2. * PI * (1. - em2l) * rl * (scale * y + bias));
+}
@@ -7,6 +7,25 @@ uniform sampler2D uEmissiveMap;
 uniform sampler2D uOcclusionMap;
 
 uniform sampler2D uIrradianceMap;
+uniform vec3 uIrradianceSH[9];
+uniform sampler2D uSpecularMap;
+uniform sampler2D uBRDFMap;
+uniform float uSpecularLevels;
+
+// Directional lights standing for the environment, which replace the
+// specular map when uLightCount > 0
+const int MAX_LIGHTS = 32;
+uniform int uLightCount;
+uniform vec3 uLightDirections[MAX_LIGHTS];
+uniform vec3 uLightPowers[MAX_LIGHTS];
+
+// Spherical Gaussian lights standing for the whole environment, which
+// replace both uIrradianceSH and the specular map when uSGCount > 0
+const int MAX_SG = 32;
+uniform int uSGCount;
+uniform vec3 uSGAxes[MAX_SG];
+uniform float uSGSharpnesses[MAX_SG];
+uniform vec3 uSGAmplitudes[MAX_SG];
 
 const float PI = 3.14159265359;
 
@@ -18,7 +37,9 @@ out vec3 fragColor;
 
 const vec3 dielectricSpecular = vec3(.04), black = vec3(0.);
 
-vec2 norm2equi(vec3 dir);
+vec2 norm2env(vec3 dir);
+vec3 irradianceSH(vec3 sh[9], vec3 dir);
+vec3 irradianceSG(vec3 axis, float sharpness, vec3 amplitude, vec3 n);
 
 vec3 brdf(vec3 v, vec3 l, vec3 n, vec3 albedo, vec2 metalRough, vec3 cdiff, vec3 F0)
 {
@@ -44,6 +65,30 @@ vec3 brdf(vec3 v, vec3 l, vec3 n, vec3 albedo, vec2 metalRough, vec3 cdiff, vec3
     return (1. - F) * cdiff / PI + F * G * D / (4 * nl * nv);
 }
 
+// Specular reflection of a spherical Gaussian light, after Wang et al.'s
+// "All-Frequency Rendering of Dynamic, Spatially-Varying Reflectance" : the
+// GGX distribution is approximated by a lobe around n, warped around the
+// reflected direction, and integrated against the light in closed form. The
+// rest of the BRDF is evaluated at the warped lobe's axis.
+vec3 specularSG(vec3 axis, float sharpness, vec3 amplitude, vec3 v, vec3 n, vec2 metalRough, vec3 F0)
+{
+    float alpha = metalRough.g * metalRough.g,
+        m2 = max(alpha * alpha, 1e-4),
+        nv = max(1e-5, dot(n, v)),
+        warpedSharpness = 2. / m2 / (4. * nv);
+    vec3 l = reflect(-v, n);
+    float d = length(warpedSharpness * l + sharpness * axis);
+    vec3 lobe = 2. * PI / (PI * m2) * amplitude * exp(d - warpedSharpness - sharpness) * (1. - exp(-2. * d)) / d;
+    
+    vec3 h = normalize(v + l);
+    float nl = max(1e-5, dot(n, l)),
+        vh = max(1e-5, dot(v, h)),
+        k = (metalRough.g * metalRough.g + 1.) / 8.,
+        G = nv / (nv * (1. - k) + k) * nl / (nl * (1. - k) + k);
+    vec3 F = F0 + (1. - F0) * exp2((-5.55473 * vh - 6.98316) * vh);
+    return lobe * G * F / (4. * nl * nv) * nl;
+}
+
 vec3 fresnelSchlickRoughness(float cosTheta, vec3 F0, float roughness)
 {
     return F0 + (max(vec3(1. - roughness), F0) - F0) * exp2((-5.55473 * cosTheta - 6.98316) * cosTheta);
@@ -80,7 +125,35 @@ void main()
     n = cotangentFrame(n, vPos, vTexCoord) * (texture(uNormalMap, vTexCoord).xyz * 2. - 1.);
     n = normalize(n);
     
+    float occlusion = texture(uOcclusionMap, vTexCoord).r,
+        nv = max(0., -dot(n, v));
+    // Split-sum image-based specular
+    vec3 prefiltered = textureLod(uSpecularMap, norm2env(reflect(v, n)), metalRough.g * (uSpecularLevels - 1.)).rgb;
+    vec2 envBRDF = texture(uBRDFMap, vec2(nv, metalRough.g)).rg;
+    vec3 specular = prefiltered * (F0 * envBRDF.x + envBRDF.y);
+    if(uLightCount > 0)
+    {
+        // The lights' BRDF covers their diffuse part too ; uIrradianceSH
+        // then only holds what they miss
+        specular = vec3(0.);
+        for(int i = 0; i < uLightCount; i++)
+        {
+            vec3 l = uLightDirections[i];
+            specular += brdf(-v, l, n, albedo, metalRough, cdiff, F0) * uLightPowers[i] * max(0., dot(n, l));
+        }
+    }
+    vec3 irradiance = irradianceSH(uIrradianceSH, n);
+    if(uSGCount > 0)
+    {
+        irradiance = specular = vec3(0.);
+        for(int i = 0; i < uSGCount; i++)
+        {
+            irradiance += irradianceSG(uSGAxes[i], uSGSharpnesses[i], uSGAmplitudes[i], n);
+            specular += specularSG(uSGAxes[i], uSGSharpnesses[i], uSGAmplitudes[i], -v, n, metalRough, F0);
+        }
+    }
     fragColor = texture(uEmissiveMap, vTexCoord).rgb +
         20. * brdf(v, v, n, albedo, metalRough, cdiff, F0) * max(0., -dot(n, v)) / (1. + dot(vRay, vRay))
-        * texture(uOcclusionMap, vTexCoord).r;
+        * occlusion
+        + (cdiff / PI * irradiance + specular) * occlusion;
 }
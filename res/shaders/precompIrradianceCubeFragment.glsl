@@ -0,0 +1,39 @@
+#version 130
+
+uniform samplerCube uEnvironment;
+uniform float uLod;
+uniform bool uOctahedral;
+
+in vec2 vSpherical;
+in vec2 vuv;
+out vec4 fragColor;
+
+// Without poles or seams to make up for, a coarser step reading from a
+// matching mip level is enough
+const float PI = 3.14159265359, sampleDelta = 0.025;
+
+vec3 oct2norm(vec2 uv);
+vec3 spherical2cartesian(float x, float y);
+
+void main()
+{
+    vec3 irradiance = vec3(0.),
+        normal = uOctahedral ? oct2norm(vuv) : spherical2cartesian(vSpherical.x, vSpherical.y),
+        up = vec3(0., 1., 0.),
+        right = cross(up, normal);
+    up = cross(normal, right);
+    float nrSamples = 0.;
+    
+    for(float phi = 0.; phi < 2. * PI; phi += sampleDelta)
+    {
+        for(float theta = 0.; theta < PI / 2.; theta += sampleDelta)
+        {
+            vec3 tangent = spherical2cartesian(phi, theta),
+                sampleVec = tangent.x * up + tangent.y * normal + tangent.z * right;
+            irradiance += textureLod(uEnvironment, sampleVec, uLod).rgb * cos(theta) * sin(theta);
+            nrSamples += 1.;
+        }
+    }
+    
+    fragColor = vec4(irradiance * PI / nrSamples, 1.);
+}
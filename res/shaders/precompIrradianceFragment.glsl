@@ -1,6 +1,7 @@
 #version 130
 
 uniform sampler2D uEnvironment;
+uniform bool uOctahedral;
 
 in vec2 vSpherical;
 in vec2 vuv;
@@ -8,13 +9,14 @@ out vec4 fragColor;
 
 const float PI = 3.14159265359, sampleDelta = 0.01;
 
-vec2 norm2equi(vec3 dir);
+vec2 norm2env(vec3 dir);
+vec3 oct2norm(vec2 uv);
 vec3 spherical2cartesian(float x, float y);
 
 void main()
 {
     vec3 irradiance = vec3(0.),
-        normal = spherical2cartesian(vSpherical.x, vSpherical.y),
+        normal = uOctahedral ? oct2norm(vuv) : spherical2cartesian(vSpherical.x, vSpherical.y),
         up = vec3(0., 1., 0.),
         right = cross(up, normal);
     up = cross(normal, right);
@@ -26,7 +28,7 @@ void main()
         {
             vec3 tangent = spherical2cartesian(phi, theta),
                 sampleVec = tangent.x * up + tangent.y * normal + tangent.z * right;
-            irradiance += texture(uEnvironment, norm2equi(normalize(sampleVec))).rgb * cos(theta) * sin(theta);
+            irradiance += texture(uEnvironment, norm2env(normalize(sampleVec))).rgb * cos(theta) * sin(theta);
             nrSamples += 1.;
         }
     }
@@ -0,0 +1,11 @@
+#version 130
+
+uniform samplerCube uEnvironment;
+
+in vec3 vWorldPos;
+out vec4 fragColor;
+
+void main()
+{
+    fragColor = texture(uEnvironment, vWorldPos);
+}
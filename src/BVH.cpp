@@ -0,0 +1,553 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "Parallel.h"
+#include "SIMDLanes.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+// Past this depth nodes split at the object median, which bounds the
+// depth of degenerate inputs and thus the traversal stack
+static const int MAX_SAH_DEPTH = 48;
+static const int STACK_SIZE = 96;
+
+static float surfaceArea(const AlignedBox3f &box)
+{
+    if(box.isEmpty())
+        return 0.f;
+    Vector3f d = box.sizes();
+    return 2.f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+namespace
+{
+
+class Builder
+{
+public:
+    const BVHBuildParams &params;
+    vector<AlignedBox3f> boxes;
+    vector<Vector3f> centroids;
+    // Permuted in place : each subtree owns a contiguous range
+    vector<uint32_t> indices;
+    
+    Builder(const MeshGeometry &geometry, const BVHBuildParams &p) :
+        params(p), boxes(geometry.triangleCount()), centroids(geometry.triangleCount()), indices(geometry.triangleCount())
+    {
+        for(int i = 0; i < geometry.triangleCount(); i++)
+        {
+            AlignedBox3f box;
+            for(int k = 0; k < 3; k++)
+                box.extend(geometry.positions[geometry.indices[3 * i + k]]);
+            boxes[i] = box;
+            centroids[i] = box.center();
+            indices[i] = i;
+        }
+    }
+    
+    /**
+     * Appends the subtree of the triangles [begin, end) to `nodes`,
+     * depth-first, and returns its depth. Offsets to second children are
+     * relative, so subtrees built apart can be appended as they are.
+     */
+    int build(int begin, int end, int depth, vector<BVH::Node> &nodes)
+    {
+        AlignedBox3f box, centroidBox;
+        for(int i = begin; i < end; i++)
+        {
+            box.extend(boxes[indices[i]]);
+            centroidBox.extend(centroids[indices[i]]);
+        }
+        const int count = end - begin;
+        
+        BVH::Node node;
+        Map<Vector3f>(node.min) = box.min();
+        Map<Vector3f>(node.max) = box.max();
+        node.axis = 0;
+        
+        int mid = -1;
+        if(count > params.minLeafSize)
+            mid = split(begin, end, depth, box, centroidBox, node.axis);
+        if(mid < 0)
+        {
+            node.offset = begin;
+            node.count = count;
+            nodes.push_back(node);
+            return 1;
+        }
+        
+        node.count = 0;
+        int childDepth;
+        if(count > params.parallelThreshold)
+        {
+            vector<BVH::Node> children[2];
+            int depths[2];
+            parallelFor(0, 2, [&](int b, int e)
+            {
+                for(int i = b; i < e; i++)
+                    depths[i] = i == 0 ? build(begin, mid, depth + 1, children[0]) : build(mid, end, depth + 1, children[1]);
+            }, 1);
+            node.offset = 1 + children[0].size();
+            nodes.push_back(node);
+            nodes.insert(nodes.end(), children[0].begin(), children[0].end());
+            nodes.insert(nodes.end(), children[1].begin(), children[1].end());
+            childDepth = max(depths[0], depths[1]);
+        }
+        else
+        {
+            size_t index = nodes.size();
+            nodes.push_back(node);
+            childDepth = build(begin, mid, depth + 1, nodes);
+            nodes[index].offset = nodes.size() - index;
+            childDepth = max(childDepth, build(mid, end, depth + 1, nodes));
+        }
+        return childDepth + 1;
+    }
+    
+private:
+    /**
+     * Partitions [begin, end) along the cheapest binned split and returns
+     * where the second half starts, or -1 if a leaf is cheaper.
+     */
+    int split(int begin, int end, int depth, const AlignedBox3f &box, const AlignedBox3f &centroidBox, uint16_t &axis)
+    {
+        const int count = end - begin, bins = max(2, params.bins);
+        Vector3f extent = centroidBox.sizes();
+        extent.maxCoeff(&axis);
+        if(extent[axis] <= 0.f)
+        {
+            // Every centroid coincides : no plane separates them
+            if(count <= params.maxLeafSize)
+                return -1;
+            return begin + count / 2;
+        }
+        if(depth >= MAX_SAH_DEPTH)
+            return medianSplit(begin, end, axis);
+        
+        float bestCost = INFINITY;
+        int bestAxis = -1, bestBin = 0;
+        vector<AlignedBox3f> binBoxes(bins);
+        vector<int> binCounts(bins);
+        vector<float> rightAreas(bins);
+        vector<int> rightCounts(bins);
+        for(int a = 0; a < 3; a++)
+        {
+            if(extent[a] <= 0.f)
+                continue;
+            float scale = bins / extent[a], origin = centroidBox.min()[a];
+            fill(binBoxes.begin(), binBoxes.end(), AlignedBox3f());
+            fill(binCounts.begin(), binCounts.end(), 0);
+            for(int i = begin; i < end; i++)
+            {
+                uint32_t t = indices[i];
+                int b = min(bins - 1, (int)((centroids[t][a] - origin) * scale));
+                binBoxes[b].extend(boxes[t]);
+                binCounts[b]++;
+            }
+            // Sweep from the right, then from the left : the split after bin
+            // b leaves bins [0, b] on the left
+            AlignedBox3f right;
+            int rightCount = 0;
+            for(int b = bins - 1; b > 0; b--)
+            {
+                right.extend(binBoxes[b]);
+                rightCount += binCounts[b];
+                rightAreas[b] = surfaceArea(right);
+                rightCounts[b] = rightCount;
+            }
+            AlignedBox3f left;
+            int leftCount = 0;
+            for(int b = 0; b < bins - 1; b++)
+            {
+                left.extend(binBoxes[b]);
+                leftCount += binCounts[b];
+                if(leftCount == 0 || rightCounts[b + 1] == 0)
+                    continue;
+                float cost = surfaceArea(left) * leftCount + rightAreas[b + 1] * rightCounts[b + 1];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = b;
+                }
+            }
+        }
+        
+        float leafCost = params.intersectionCost * count;
+        bestCost = params.traversalCost + params.intersectionCost * bestCost / surfaceArea(box);
+        if(bestAxis < 0 || (bestCost >= leafCost && count <= params.maxLeafSize))
+            return bestAxis < 0 && count > params.maxLeafSize ? medianSplit(begin, end, axis) : -1;
+        
+        axis = bestAxis;
+        float scale = bins / extent[bestAxis], origin = centroidBox.min()[bestAxis];
+        uint32_t *mid = partition(&indices[begin], &indices[begin] + count, [&](uint32_t t)
+        {
+            return min(bins - 1, (int)((centroids[t][bestAxis] - origin) * scale)) <= bestBin;
+        });
+        return mid - &indices[0];
+    }
+    
+    int medianSplit(int begin, int end, int axis)
+    {
+        int mid = begin + (end - begin) / 2;
+        nth_element(&indices[begin], &indices[mid], &indices[0] + end, [&](uint32_t a, uint32_t b)
+        {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        return mid;
+    }
+};
+
+}
+
+BVH::BVH(const MeshGeometry &geometry, const BVHBuildParams &params)
+{
+    auto start = chrono::steady_clock::now();
+    if(geometry.triangleCount() > 0)
+    {
+        BVHBuildParams clamped = params;
+        // Leaf sizes must fit Node::count
+        clamped.maxLeafSize = max(1, min(params.maxLeafSize, 0xFFFF));
+        clamped.minLeafSize = max(1, min(params.minLeafSize, clamped.maxLeafSize));
+        Builder builder(geometry, clamped);
+        _depth = builder.build(0, geometry.triangleCount(), 0, _nodes);
+        if(_depth > STACK_SIZE)
+            fatal("BVH of depth " << _depth << " is too deep to traverse");
+        
+        _triangleIndices = move(builder.indices);
+        _triangles.resize(_triangleIndices.size());
+        for(unsigned int i = 0; i < _triangles.size(); i++)
+        {
+            const uint32_t *v = &geometry.indices[3 * _triangleIndices[i]];
+            Triangle &triangle = _triangles[i];
+            triangle.v0 = geometry.positions[v[0]];
+            triangle.e1 = geometry.positions[v[1]] - triangle.v0;
+            triangle.e2 = geometry.positions[v[2]] - triangle.v0;
+        }
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    _buildTime = elapsed.count();
+}
+
+// Slab test against the node's box, within (tMin, tMax)
+static inline bool intersectBox(const BVH::Node &node, const Vector3f &origin, const Vector3f &invDir, float tMin, float tMax)
+{
+    for(int a = 0; a < 3; a++)
+    {
+        float t0 = (node.min[a] - origin[a]) * invDir[a], t1 = (node.max[a] - origin[a]) * invDir[a];
+        if(invDir[a] < 0.f)
+            swap(t0, t1);
+        // Written so that NaNs, from a ray in the plane of a face, are ignored
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+    }
+    return tMin <= tMax;
+}
+
+template<bool AnyHit>
+bool BVH::traverse(const Ray &ray, Hit &hit) const
+{
+    if(_nodes.empty())
+        return false;
+    Vector3f invDir = ray.dir.cwiseInverse();
+    float tMax = ray.tMax;
+    bool found = false;
+    uint32_t stack[STACK_SIZE], index = 0;
+    int top = 0;
+    while(true)
+    {
+        const Node &node = _nodes[index];
+        if(intersectBox(node, ray.origin, invDir, ray.tMin, tMax))
+        {
+            if(!node.isLeaf())
+            {
+                // Nearest child first, the other one later
+                uint32_t first = index + 1, second = index + node.offset;
+                if(ray.dir[node.axis] < 0.f)
+                    swap(first, second);
+                stack[top++] = second;
+                index = first;
+                continue;
+            }
+            // Möller-Trumbore, both sides
+            for(uint32_t i = node.offset; i < node.offset + node.count; i++)
+            {
+                const Triangle &triangle = _triangles[i];
+                Vector3f p = ray.dir.cross(triangle.e2);
+                float det = triangle.e1.dot(p);
+                if(fabs(det) < 1e-12f)
+                    continue;
+                float invDet = 1.f / det;
+                Vector3f s = ray.origin - triangle.v0;
+                float u = s.dot(p) * invDet;
+                if(u < 0.f || u > 1.f)
+                    continue;
+                Vector3f q = s.cross(triangle.e1);
+                float v = ray.dir.dot(q) * invDet;
+                if(v < 0.f || u + v > 1.f)
+                    continue;
+                float t = triangle.e2.dot(q) * invDet;
+                if(t <= ray.tMin || t >= tMax)
+                    continue;
+                if(AnyHit)
+                    return true;
+                tMax = t;
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                hit.triangle = _triangleIndices[i];
+                found = true;
+            }
+        }
+        if(top == 0)
+            break;
+        index = stack[--top];
+    }
+    return found;
+}
+
+bool BVH::intersect(const Ray &ray, Hit &hit) const
+{
+    return traverse<false>(ray, hit);
+}
+
+bool BVH::occluded(const Ray &ray) const
+{
+    Hit hit;
+    return traverse<true>(ray, hit);
+}
+
+bool BVH::occluded(const Vector3f &origin, const Vector3f &dir, float tMax) const
+{
+    return occluded(Ray(origin, dir, tMax));
+}
+
+#ifdef HAS_AVX2_LANES
+static bool hasAVX2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+#endif
+
+int BVH::packetWidth()
+{
+#ifdef HAS_AVX2_LANES
+    if(hasAVX2())
+        return 8;
+#endif
+    return 4;
+}
+
+// Always inlined, for 8 lanes to be compiled for AVX2 within
+// traversePacket8()
+template<typename L, bool AnyHit>
+__attribute__((always_inline)) inline void BVH::traversePacket(const Ray *rays, const uint32_t *indices, int count, Hit *hits, bool *results) const
+{
+    typedef typename L::Mask Mask;
+    const int W = L::WIDTH;
+    // Lanes past `count` repeat the first ray and stay inactive
+    float o[3][W], d[3][W], invD[3][W], tMin[W], tMax[W];
+    for(int k = 0; k < W; k++)
+    {
+        const Ray &ray = rays[indices[k < count ? k : 0]];
+        for(int a = 0; a < 3; a++)
+        {
+            o[a][k] = ray.origin[a];
+            d[a][k] = ray.dir[a];
+            invD[a][k] = 1.f / ray.dir[a];
+        }
+        tMin[k] = ray.tMin;
+        tMax[k] = ray.tMax;
+    }
+    L ox = L::load(o[0]), oy = L::load(o[1]), oz = L::load(o[2]),
+        dx = L::load(d[0]), dy = L::load(d[1]), dz = L::load(d[2]),
+        ix = L::load(invD[0]), iy = L::load(invD[1]), iz = L::load(invD[2]),
+        near = L::load(tMin), far = L::load(tMax), bestU(0.f), bestV(0.f);
+    Mask active = Mask::first(count) & (near < far);
+    // Rays are clear until a hit is found, those with an empty interval
+    // included, which never become active
+    if(AnyHit)
+        for(int k = 0; k < count; k++)
+            results[indices[k]] = false;
+    int triangles[W];
+    for(int k = 0; k < W; k++)
+        triangles[k] = -1;
+    
+    uint32_t stack[STACK_SIZE], index = 0;
+    int top = 0;
+    while(active.mask())
+    {
+        const Node &node = _nodes[index];
+        L t0 = (L(node.min[0]) - ox) * ix, t1 = (L(node.max[0]) - ox) * ix,
+            enter = vmax(vmin(t0, t1), near), exit = vmin(vmax(t0, t1), far);
+        t0 = (L(node.min[1]) - oy) * iy;
+        t1 = (L(node.max[1]) - oy) * iy;
+        enter = vmax(vmin(t0, t1), enter);
+        exit = vmin(vmax(t0, t1), exit);
+        t0 = (L(node.min[2]) - oz) * iz;
+        t1 = (L(node.max[2]) - oz) * iz;
+        enter = vmax(vmin(t0, t1), enter);
+        exit = vmin(vmax(t0, t1), exit);
+        Mask visiting = active & (enter <= exit);
+        uint32_t lanes = visiting.mask();
+        if(lanes)
+        {
+            if(!node.isLeaf())
+            {
+                // Nearest child first for the first ray visiting, which is
+                // right for all of them when they share an octant
+                uint32_t first = index + 1, second = index + node.offset;
+                if(d[node.axis][__builtin_ctz(lanes)] < 0.f)
+                    swap(first, second);
+                stack[top++] = second;
+                index = first;
+                continue;
+            }
+            for(uint32_t i = node.offset; i < node.offset + node.count; i++)
+            {
+                // Möller-Trumbore, both sides, across the lanes
+                const Triangle &triangle = _triangles[i];
+                L e1x(triangle.e1[0]), e1y(triangle.e1[1]), e1z(triangle.e1[2]),
+                    e2x(triangle.e2[0]), e2y(triangle.e2[1]), e2z(triangle.e2[2]),
+                    px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x,
+                    det = e1x * px + e1y * py + e1z * pz, invDet = L(1.f) / det,
+                    sx = ox - L(triangle.v0[0]), sy = oy - L(triangle.v0[1]), sz = oz - L(triangle.v0[2]),
+                    u = (sx * px + sy * py + sz * pz) * invDet,
+                    qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x,
+                    v = (dx * qx + dy * qy + dz * qz) * invDet,
+                    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+                Mask hit = visiting & ((det > L(1e-12f)) | (det < L(-1e-12f)))
+                    & (L(0.f) <= u) & (u <= L(1.f)) & (L(0.f) <= v) & (u + v <= L(1.f)) & (near < t) & (t < far);
+                uint32_t hitLanes = hit.mask();
+                if(!hitLanes)
+                    continue;
+                if(AnyHit)
+                {
+                    for(uint32_t k = hitLanes; k; k &= k - 1)
+                        results[indices[__builtin_ctz(k)]] = true;
+                    active = andNot(active, hit);
+                    visiting = andNot(visiting, hit);
+                    if(!visiting.mask())
+                        break;
+                    continue;
+                }
+                far = select(hit, t, far);
+                bestU = select(hit, u, bestU);
+                bestV = select(hit, v, bestV);
+                for(uint32_t k = hitLanes; k; k &= k - 1)
+                    triangles[__builtin_ctz(k)] = _triangleIndices[i];
+            }
+        }
+        if(top == 0)
+            break;
+        index = stack[--top];
+    }
+    
+    if(AnyHit)
+        return;
+    float t[W], u[W], v[W];
+    far.store(t);
+    bestU.store(u);
+    bestV.store(v);
+    for(int k = 0; k < count; k++)
+    {
+        Hit &hit = hits[indices[k]];
+        hit = Hit();
+        if(triangles[k] >= 0)
+        {
+            hit.t = t[k];
+            hit.u = u[k];
+            hit.v = v[k];
+            hit.triangle = triangles[k];
+        }
+    }
+}
+
+#ifdef HAS_AVX2_LANES
+template<bool AnyHit>
+AVX2_LANES void BVH::traversePacket8(const Ray *rays, const uint32_t *indices, int count, Hit *hits, bool *results) const
+{
+    traversePacket<Lanes<8>, AnyHit>(rays, indices, count, hits, results);
+}
+#endif
+
+template<bool AnyHit>
+void BVH::traverseBatch(const Ray *rays, int count, RayQueryMode mode, Hit *hits, bool *results) const
+{
+    if(_nodes.empty() || mode == RayQueryMode::SINGLE)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(AnyHit)
+                results[i] = occluded(rays[i]);
+            else
+            {
+                hits[i] = Hit();
+                traverse<false>(rays[i], hits[i]);
+            }
+        }
+        return;
+    }
+    
+    const int W = packetWidth();
+    vector<uint32_t> indices(count);
+    // Packets of a stream never mix octants
+    int octantStarts[9] = { 0 };
+    if(mode == RayQueryMode::STREAM)
+    {
+        vector<uint8_t> octants(count);
+        for(int i = 0; i < count; i++)
+        {
+            const Vector3f &d = rays[i].dir;
+            octants[i] = (d[0] < 0.f) | (d[1] < 0.f) << 1 | (d[2] < 0.f) << 2;
+            octantStarts[octants[i] + 1]++;
+        }
+        for(int o = 0; o < 8; o++)
+            octantStarts[o + 1] += octantStarts[o];
+        int next[8];
+        copy(octantStarts, octantStarts + 8, next);
+        for(int i = 0; i < count; i++)
+            indices[next[octants[i]]++] = i;
+    }
+    else
+    {
+        for(int i = 0; i < count; i++)
+            indices[i] = i;
+        fill(octantStarts + 1, octantStarts + 9, count);
+    }
+    for(int o = 0; o < 8; o++)
+        for(int i = octantStarts[o]; i < octantStarts[o + 1]; i += W)
+        {
+            // A lone ray isn't worth a packet
+            int n = min(W, octantStarts[o + 1] - i);
+            if(n == 1)
+                traverseBatch<AnyHit>(rays + indices[i], 1, RayQueryMode::SINGLE, hits ? hits + indices[i] : nullptr,
+                    results ? results + indices[i] : nullptr);
+#ifdef HAS_AVX2_LANES
+            else if(W == 8)
+                traversePacket8<AnyHit>(rays, &indices[i], n, hits, results);
+#endif
+            else
+                traversePacket<Lanes<4>, AnyHit>(rays, &indices[i], n, hits, results);
+        }
+}
+
+void BVH::intersect(const Ray *rays, Hit *hits, int count, RayQueryMode mode) const
+{
+    traverseBatch<false>(rays, count, mode, hits, nullptr);
+}
+
+void BVH::occluded(const Ray *rays, bool *results, int count, RayQueryMode mode) const
+{
+    traverseBatch<true>(rays, count, mode, nullptr, results);
+}
+
+void BVH::occluded(const Ray *rays, bool *results, int count) const
+{
+    occluded(rays, results, count, RayQueryMode::STREAM);
+}
@@ -0,0 +1,271 @@
+#include "CompressedTransfer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+template<int Order>
+CompressedTransfer<Order>::CompressedTransfer(const TransferMatrix &transfer, const CPCAParams &params)
+{
+    const int n = transfer.rows();
+    if(n == 0)
+        return;
+    _basisSize = max(0, min(params.basisSize, (int)COEFFICIENTS));
+    const int clusters = max(1, min(params.clusters, n)), stride = _basisSize + 1;
+    _clusters.assign(n, 0);
+    _clusterRows = TransferMatrix::Zero(clusters * stride, (int)COEFFICIENTS);
+    
+    // k-means++ seeds : each one drawn with probability proportional to the
+    // squared distance to the nearest seed so far, which spreads them over
+    // the rows rather than over the mesh
+    mt19937 random(1);
+    vector<float> distances(n, numeric_limits<float>::infinity());
+    int seed = uniform_int_distribution<int>(0, n - 1)(random);
+    for(int c = 0; c < clusters; c++)
+    {
+        _clusterRows.row(c * stride) = transfer.row(seed);
+        if(c + 1 == clusters)
+            break;
+        parallelFor(0, n, [&](int begin, int end)
+        {
+            for(int v = begin; v < end; v++)
+                distances[v] = min(distances[v], (transfer.row(v) - transfer.row(seed)).squaredNorm());
+        });
+        double total = accumulate(distances.begin(), distances.end(), 0.);
+        if(total <= 0.)
+        {
+            seed = uniform_int_distribution<int>(0, n - 1)(random);
+            continue;
+        }
+        double x = uniform_real_distribution<double>(0., total)(random);
+        for(seed = 0; seed < n - 1 && (x -= distances[seed]) > 0.; seed++);
+    }
+    
+    // Without basis vectors yet, the first pass assigns each vertex to its
+    // nearest seed
+    vector<float> errors(n);
+    auto reassign = [&]()
+    {
+        atomic<int> moved(0);
+        parallelFor(0, n, [&](int begin, int end)
+        {
+            int changes = 0;
+            for(int v = begin; v < end; v++)
+            {
+                Row row = transfer.row(v);
+                int best = _clusters[v];
+                float bestError = error(row, best);
+                for(int c = 0; c < clusters; c++)
+                {
+                    float e = error(row, c);
+                    if(e < bestError)
+                    {
+                        best = c;
+                        bestError = e;
+                    }
+                }
+                changes += best != _clusters[v];
+                _clusters[v] = best;
+                errors[v] = bestError;
+            }
+            moved += changes;
+        });
+        return (int)moved;
+    };
+    reassign();
+    for(int i = 0; i < params.iterations; i++)
+    {
+        fit(transfer, errors);
+        if(reassign() == 0)
+            break;
+    }
+    fit(transfer, errors);
+    
+    _weights.resize(n, _basisSize);
+    parallelFor(0, n, [&](int begin, int end)
+    {
+        for(int v = begin; v < end; v++)
+        {
+            typename TransferMatrix::ConstRowsBlockXpr rows = clusterRows(_clusters[v]);
+            Row d = transfer.row(v) - rows.row(0);
+            for(int j = 0; j < _basisSize; j++)
+                _weights(v, j) = rows.row(j + 1).dot(d);
+        }
+    });
+}
+
+template<int Order>
+CompressedTransfer<Order>::CompressedTransfer(const vector<int> &clusters, const TransferMatrix &clusterRows,
+    const WeightMatrix &weights) :
+    _basisSize(weights.cols()),
+    _clusters(clusters),
+    _clusterRows(clusterRows),
+    _weights(weights)
+{
+    if(weights.rows() != (int)clusters.size() || clusterRows.rows() % (_basisSize + 1))
+        fatal("Expected " << clusters.size() << " rows of weights and " << _basisSize + 1 << " rows per cluster, got "
+            << weights.rows() << " and " << clusterRows.rows());
+    for(int c : clusters)
+        if(c < 0 || c >= clusterCount())
+            fatal("Cluster " << c << " is out of the " << clusterCount() << " clusters");
+}
+
+template<int Order>
+void CompressedTransfer<Order>::fit(const TransferMatrix &transfer, const vector<float> &errors)
+{
+    // Vertices sorted by cluster
+    const int n = transfer.rows(), clusters = clusterCount(), stride = _basisSize + 1;
+    vector<int> offsets(clusters + 1, 0), members(n);
+    for(int c : _clusters)
+        offsets[c + 1]++;
+    partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    vector<int> next(offsets.begin(), offsets.end() - 1);
+    for(int v = 0; v < n; v++)
+        members[next[_clusters[v]]++] = v;
+    
+    parallelFor(0, clusters, [&](int begin, int end)
+    {
+        for(int c = begin; c < end; c++)
+        {
+            int first = offsets[c], last = offsets[c + 1];
+            if(first == last)
+                continue;
+            Matrix<double, 1, COEFFICIENTS> mean = Matrix<double, 1, COEFFICIENTS>::Zero();
+            for(int i = first; i < last; i++)
+                mean += transfer.row(members[i]).template cast<double>();
+            mean /= last - first;
+            Matrix<double, COEFFICIENTS, COEFFICIENTS> covariance = Matrix<double, COEFFICIENTS, COEFFICIENTS>::Zero();
+            for(int i = first; i < last; i++)
+            {
+                Matrix<double, COEFFICIENTS, 1> d = (transfer.row(members[i]).template cast<double>() - mean).transpose();
+                covariance.template selfadjointView<Lower>().rankUpdate(d);
+            }
+            // Eigenvalues come in increasing order
+            SelfAdjointEigenSolver<Matrix<double, COEFFICIENTS, COEFFICIENTS> > eigen(covariance);
+            _clusterRows.row(c * stride) = mean.template cast<float>();
+            for(int j = 0; j < _basisSize; j++)
+                _clusterRows.row(c * stride + j + 1) = eigen.eigenvectors().col(COEFFICIENTS - 1 - j).transpose().template cast<float>();
+        }
+    });
+    
+    // Empty clusters restart on the worst reconstructed vertices, which the
+    // next pass moves to them
+    vector<int> empty;
+    for(int c = 0; c < clusters; c++)
+        if(offsets[c] == offsets[c + 1])
+            empty.push_back(c);
+    if(empty.empty())
+        return;
+    vector<int> worst(n);
+    iota(worst.begin(), worst.end(), 0);
+    partial_sort(worst.begin(), worst.begin() + empty.size(), worst.end(), [&](int a, int b) { return errors[a] > errors[b]; });
+    for(unsigned int i = 0; i < empty.size(); i++)
+    {
+        _clusterRows.middleRows(empty[i] * stride, stride).setZero();
+        _clusterRows.row(empty[i] * stride) = transfer.row(worst[i]);
+    }
+}
+
+template<int Order>
+float CompressedTransfer<Order>::error(const Row &row, int cluster) const
+{
+    typename TransferMatrix::ConstRowsBlockXpr rows = clusterRows(cluster);
+    Row d = row - rows.row(0);
+    float e = d.squaredNorm();
+    for(int j = 1; j <= _basisSize; j++)
+    {
+        float p = rows.row(j).dot(d);
+        e -= p * p;
+    }
+    return e;
+}
+
+template<int Order>
+Matrix<float, 1, Dynamic> CompressedTransfer<Order>::coordinates(int vertex) const
+{
+    Matrix<float, 1, Dynamic> x(_basisSize + 1);
+    x[0] = 1.f;
+    x.tail(_basisSize) = _weights.row(vertex);
+    return x;
+}
+
+template<int Order>
+typename CompressedTransfer<Order>::Row CompressedTransfer<Order>::row(int vertex) const
+{
+    return coordinates(vertex) * clusterRows(_clusters[vertex]);
+}
+
+template<int Order>
+typename CompressedTransfer<Order>::TransferMatrix CompressedTransfer<Order>::decompress() const
+{
+    TransferMatrix transfer(vertexCount(), (int)COEFFICIENTS);
+    parallelFor(0, vertexCount(), [&](int begin, int end)
+    {
+        for(int v = begin; v < end; v++)
+            transfer.row(v) = row(v);
+    });
+    return transfer;
+}
+
+template<int Order>
+void CompressedTransfer<Order>::shade(const Coefficients &radiance, vector<Vector3f> &radiances) const
+{
+    // What each cluster row reflects, blended below with each vertex's
+    // weights
+    Matrix<float, Dynamic, 3, RowMajor> projections = _clusterRows * radiance;
+    const int stride = _basisSize + 1;
+    radiances.resize(vertexCount());
+    parallelFor(0, vertexCount(), [&](int begin, int end)
+    {
+        for(int v = begin; v < end; v++)
+        {
+            int base = _clusters[v] * stride;
+            Vector3f r = projections.row(base).transpose();
+            for(int j = 0; j < _basisSize; j++)
+                r += _weights(v, j) * projections.row(base + j + 1).transpose();
+            radiances[v] = r;
+        }
+    });
+}
+
+template<int Order>
+float CompressedTransfer<Order>::relativeError(const TransferMatrix &transfer) const
+{
+    if(transfer.rows() != vertexCount())
+        fatal("Expected a transfer for " << vertexCount() << " vertices, got " << transfer.rows());
+    double difference = 0., total = 0.;
+    for(int v = 0; v < vertexCount(); v++)
+    {
+        difference += (transfer.row(v) - row(v)).squaredNorm();
+        total += transfer.row(v).squaredNorm();
+    }
+    return total > 0. ? sqrt(difference / total) : 0.f;
+}
+
+template<int Order>
+size_t CompressedTransfer<Order>::bytes() const
+{
+    return _clusters.size() * sizeof(int) + (_clusterRows.size() + _weights.size()) * sizeof(float);
+}
+
+namespace invLight
+{
+
+template class CompressedTransfer<2>;
+template class CompressedTransfer<3>;
+template class CompressedTransfer<4>;
+template class CompressedTransfer<5>;
+template class CompressedTransfer<6>;
+template class CompressedTransfer<7>;
+template class CompressedTransfer<8>;
+
+}
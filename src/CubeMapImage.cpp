@@ -0,0 +1,152 @@
+#include "CubeMapImage.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+
+using namespace invLight;
+using namespace std;
+
+// Face `dir` hits, and coordinates (sc, tc) in [-1, 1] on that face
+static int faceCoordinates(const Vector3f &dir, float &sc, float &tc)
+{
+    float ax = fabs(dir[0]), ay = fabs(dir[1]), az = fabs(dir[2]);
+    if(ax >= ay && ax >= az)
+    {
+        sc = (dir[0] > 0.f ? -dir[2] : dir[2]) / ax;
+        tc = -dir[1] / ax;
+        return dir[0] > 0.f ? 0 : 1;
+    }
+    if(ay >= az)
+    {
+        sc = dir[0] / ay;
+        tc = (dir[1] > 0.f ? dir[2] : -dir[2]) / ay;
+        return dir[1] > 0.f ? 2 : 3;
+    }
+    sc = (dir[2] > 0.f ? dir[0] : -dir[0]) / az;
+    tc = -dir[1] / az;
+    return dir[2] > 0.f ? 4 : 5;
+}
+
+// Inverse of faceCoordinates, up to normalization
+static Vector3f faceDirection(int face, float sc, float tc)
+{
+    switch(face)
+    {
+    case 0:
+        return Vector3f(1.f, -tc, -sc);
+    case 1:
+        return Vector3f(-1.f, -tc, sc);
+    case 2:
+        return Vector3f(sc, 1.f, tc);
+    case 3:
+        return Vector3f(sc, -1.f, -tc);
+    case 4:
+        return Vector3f(sc, -tc, 1.f);
+    default:
+        return Vector3f(-sc, -tc, -1.f);
+    }
+}
+
+CubeMapImage::CubeMapImage(int s) : size(s)
+{
+    for(int f = 0; f < 6; f++)
+        faces[f].resize(s * s * 3);
+}
+
+CubeMapImage CubeMapImage::fromEquirect(const EquirectImage &image, int size)
+{
+    CubeMapImage cube(size);
+    parallelFor(0, 6 * size, [&](int begin, int end)
+    {
+        float x[4], y[4], z[4], rgb[12];
+        for(int r = begin; r < end; r++)
+        {
+            int face = r / size, j = r % size;
+            float *out = cube.row(face, j);
+            for(int i = 0; i < size; i += 4)
+            {
+                // Lanes past the end of the row are computed and dropped
+                for(int k = 0; k < 4; k++)
+                {
+                    Vector3f d = cube.texelDirection(face, min(i + k, size - 1), j).normalized();
+                    x[k] = d[0];
+                    y[k] = d[1];
+                    z[k] = d[2];
+                }
+                image.sample4(x, y, z, rgb);
+                copy(rgb, rgb + 3 * min(4, size - i), out + 3 * i);
+            }
+        }
+    });
+    return cube;
+}
+
+Vector3f CubeMapImage::texelDirection(int face, int x, int y) const
+{
+    return faceDirection(face, 2.f * (x + .5f) / size - 1.f, 2.f * (y + .5f) / size - 1.f);
+}
+
+Vector3f CubeMapImage::sample(const Vector3f &dir) const
+{
+    float sc, tc;
+    int face = faceCoordinates(dir, sc, tc);
+    float px = max(0.f, min(size - 1.f, (sc + 1.f) * .5f * size - .5f)),
+        py = max(0.f, min(size - 1.f, (tc + 1.f) * .5f * size - .5f));
+    int x0 = px, y0 = py, x1 = min(x0 + 1, size - 1), y1 = min(y0 + 1, size - 1);
+    float fx = px - x0, fy = py - y0;
+    const float *p00 = row(face, y0) + 3 * x0, *p10 = row(face, y0) + 3 * x1,
+        *p01 = row(face, y1) + 3 * x0, *p11 = row(face, y1) + 3 * x1;
+    Vector3f c;
+    for(int i = 0; i < 3; i++)
+        c[i] = (p00[i] * (1.f - fx) + p10[i] * fx) * (1.f - fy) + (p01[i] * (1.f - fx) + p11[i] * fx) * fy;
+    return c;
+}
+
+float CubeMapImage::texelSolidAngle(const Vector3f &dir) const
+{
+    float sc, tc;
+    faceCoordinates(dir, sc, tc);
+    float d2 = 1.f + sc * sc + tc * tc;
+    return 4.f / (size * size * d2 * sqrt(d2));
+}
+
+CubeMapImage CubeMapImage::downsample() const
+{
+    CubeMapImage half(max(1, size / 2));
+    parallelFor(0, 6 * half.size, [&](int begin, int end)
+    {
+        for(int r = begin; r < end; r++)
+        {
+            int face = r / half.size, y = r % half.size;
+            const float *r0 = row(face, min(2 * y, size - 1)), *r1 = row(face, min(2 * y + 1, size - 1));
+            float *out = half.row(face, y);
+            for(int x = 0; x < half.size; x++)
+            {
+                int x0 = min(2 * x, size - 1), x1 = min(2 * x + 1, size - 1);
+                for(int c = 0; c < 3; c++)
+                    out[3 * x + c] = .25f * (r0[3 * x0 + c] + r0[3 * x1 + c] + r1[3 * x0 + c] + r1[3 * x1 + c]);
+            }
+        }
+    });
+    return half;
+}
+
+CubeMapPyramid::CubeMapPyramid(const CubeMapImage &image) : _base(image)
+{
+    _levels.resize(1);
+    while(level(levels() - 1).size > 1)
+        _levels.push_back(level(levels() - 1).downsample());
+}
+
+Vector3f CubeMapPyramid::sample(const Vector3f &dir, float lod) const
+{
+    lod = max(0.f, min(lod, levels() - 1.f));
+    int l0 = lod, l1 = min(l0 + 1, levels() - 1);
+    float t = lod - l0;
+    Vector3f c = level(l0).sample(dir);
+    if(t > 0.f)
+        c = c * (1.f - t) + level(l1).sample(dir) * t;
+    return c;
+}
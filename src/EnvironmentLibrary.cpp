@@ -0,0 +1,171 @@
+#include "EnvironmentLibrary.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+EnvironmentLibrary::EnvironmentLibrary(EnvironmentMap &map, const vector<string> &paths, const IBLBakeParams &params,
+    const string &cacheDirectory, const EnvironmentLibraryOptions &options) :
+    _map(map),
+    _params(params),
+    _cacheDirectory(cacheDirectory),
+    _options(options),
+    _entries(paths.size())
+{
+    for(unsigned int i = 0; i < paths.size(); i++)
+        _entries[i].path = paths[i];
+}
+
+bool EnvironmentLibrary::select(int index)
+{
+    if(index < 0 || index >= size())
+        fatal("No environment " << index << " in a library of " << size());
+    _selected = index;
+    _entries[index].lastUse = ++_clock;
+    if(index == _current)
+        return false;
+    if(_entries[index].set && _entries[index].set->uploaded())
+    {
+        switchTo(index);
+        return true;
+    }
+    return false;
+}
+
+void EnvironmentLibrary::switchTo(int index)
+{
+    auto start = chrono::steady_clock::now();
+    unique_ptr<EnvironmentSet> set = move(_entries[index].set);
+    _map.swap(*set);
+    // The set now holds what the map rendered : cache it under its own
+    // entry, or free it if it didn't come from the library
+    if(_current >= 0)
+    {
+        // Its float copy is cheap to rebuild, unlike the bake
+        set->image = EquirectImage();
+        _entries[_current].set = move(set);
+    }
+    _current = index;
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Switched to " << _entries[index].path << " in " << elapsed.count() << " ms");
+}
+
+bool EnvironmentLibrary::update()
+{
+    for(Entry &entry : _entries)
+        if(entry.loading.valid() && entry.loading.wait_for(chrono::seconds(0)) == future_status::ready)
+        {
+            try
+            {
+                entry.set = entry.loading.get();
+            }
+            catch(exception &e)
+            {
+                // Not retried, the current environment stays
+                trace("Couldn't load environment : " << e.what());
+                entry.failed = true;
+            }
+        }
+    
+    // The selected environment gets the upload budget first, then the
+    // closest neighbours
+    size_t budget = _map.getOptions().uploadBudget;
+    bool changed = false;
+    for(int distance = 0; _selected >= 0 && distance <= min(_options.prefetchRadius, size() / 2) && budget > 0; distance++)
+        for(int side = distance == 0 ? 1 : -1; side <= 1 && budget > 0; side += 2)
+        {
+            int index = ((_selected + side * distance) % size() + size()) % size();
+            EnvironmentSet *set = _entries[index].set.get();
+            if(!set || set->uploaded())
+                continue;
+            size_t before = set->deviceBytes;
+            _map.stage(*set, budget);
+            budget -= min(budget, set->deviceBytes - before);
+        }
+    if(_selected >= 0 && _selected != _current && _entries[_selected].set && _entries[_selected].set->uploaded())
+    {
+        switchTo(_selected);
+        changed = true;
+    }
+    
+    evict();
+    prefetch();
+    return changed;
+}
+
+bool EnvironmentLibrary::inPrefetchWindow(int index) const
+{
+    if(_selected < 0)
+        return false;
+    int distance = abs(index - _selected);
+    return min(distance, size() - distance) <= _options.prefetchRadius;
+}
+
+void EnvironmentLibrary::prefetch()
+{
+    if(_selected < 0)
+        return;
+    // Over budget, only the selected environment is still loaded : evict()
+    // keeps its neighbours, which may be what fills the budget, and the
+    // library would otherwise never switch
+    bool overBudget = deviceBytes() > _options.deviceBudget || hostBytes() > _options.hostBudget;
+    int loads = 0;
+    for(const Entry &entry : _entries)
+        loads += entry.loading.valid();
+    // Closest first, the selected environment itself at distance 0
+    for(int distance = 0; distance <= (overBudget ? 0 : min(_options.prefetchRadius, size() / 2)) && loads < _options.maxLoads;
+        distance++)
+        for(int side = distance == 0 ? 1 : -1; side <= 1 && loads < _options.maxLoads; side += 2)
+        {
+            int index = ((_selected + side * distance) % size() + size()) % size();
+            Entry &entry = _entries[index];
+            if(index == _current || entry.set || entry.loading.valid() || entry.failed)
+                continue;
+            trace("Prefetching " << entry.path << " ...");
+            entry.loading = async(launch::async, &EnvironmentMap::prepare, entry.path, _params, _cacheDirectory, _map.getOptions());
+            entry.lastUse = max(entry.lastUse, _clock);
+            loads++;
+        }
+}
+
+void EnvironmentLibrary::evict()
+{
+    while(deviceBytes() > _options.deviceBudget || hostBytes() > _options.hostBudget)
+    {
+        // The selected environment and its neighbours are kept even over
+        // budget, prefetch() then only loads the selected one
+        Entry *oldest = nullptr;
+        for(int i = 0; i < size(); i++)
+        {
+            Entry &entry = _entries[i];
+            if(entry.set && !inPrefetchWindow(i) && (!oldest || entry.lastUse < oldest->lastUse))
+                oldest = &entry;
+        }
+        if(!oldest)
+            return;
+        trace("Evicting " << oldest->path);
+        oldest->set.reset();
+    }
+}
+
+size_t EnvironmentLibrary::deviceBytes() const
+{
+    size_t bytes = 0;
+    for(const Entry &entry : _entries)
+        if(entry.set)
+            bytes += entry.set->deviceBytes;
+    return bytes;
+}
+
+size_t EnvironmentLibrary::hostBytes() const
+{
+    size_t bytes = 0;
+    for(const Entry &entry : _entries)
+        if(entry.set)
+            bytes += entry.set->hostBytes();
+    return bytes;
+}
@@ -1,45 +1,512 @@
 #include "EnvironmentMap.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
-#include "stb_image.h"
-
+#include "HDRImage.h"
+#include "IBLBaker.h"
+#include "IBLCache.h"
 #include "utils.h"
 
 using namespace std;
 using namespace invLight;
 
-EnvironmentMap::EnvironmentMap(const string &path) :
-    _skyboxProgram("shaders/quadVertex.glsl", "shaders/skyboxFragment.glsl"),
-    _skyboxContext(_skyboxProgram)
+// Staged uploads send textures in bands of about this many bytes, so that
+// none of their steps stalls the frame
+static const size_t UPLOAD_BAND_BYTES = 1 << 20;
+
+// Uploads one level of an RGB image to `target`, converting it to `format`
+// on the CPU first so that the driver only has to copy it. A null `pixels`
+// only allocates the level. Conversion stays on the calling thread, the GL
+// one, which mustn't pick up unrelated pool work. Returns the number of
+// bytes sent.
+static size_t texImage(GLenum target, int level, int width, int height, const void *pixels, PixelFormat pixelFormat, PixelFormat format)
 {
-    int width, height, bpp;
-    float *environmentMap = stbi_loadf(path.c_str(), &width, &height, &bpp, 3);
-    if(!environmentMap)
-        fatal("Couldn't load image " << path);
-    glGenTextures(1, &_map.id);
-    _skyboxProgram.registerTexture("uEnvironment", _map);
-    glBindTexture(GL_TEXTURE_2D, _map.id);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, width, height, 0, GL_RGB, GL_FLOAT, environmentMap);
+    vector<uint8_t> staging;
+    if(pixels && pixelFormat != format)
+    {
+        staging.resize((size_t)width * height * pixelSize(format));
+        convertPixels(pixels, pixelFormat, staging.data(), format, width * height);
+        pixels = staging.data();
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if(format == PIXEL_RGB9E5)
+        glTexImage2D(target, level, GL_RGB9_E5, width, height, 0, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, pixels);
+    else
+        glTexImage2D(target, level, GL_RGB16F, width, height, 0, GL_RGB, GL_HALF_FLOAT, pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return pixels ? (size_t)width * height * pixelSize(format) : 0;
+}
+
+// Replaces a rectangle of a level of `target`, the bound 2D texture or one
+// of the bound cube map's faces, converting like texImage(). Returns the
+// number of bytes sent.
+static size_t texSubImage(GLenum target, int level, int x, int y, int width, int height, const void *pixels,
+    PixelFormat pixelFormat, PixelFormat format)
+{
+    vector<uint8_t> staging((size_t)width * height * pixelSize(format));
+    convertPixels(pixels, pixelFormat, staging.data(), format, width * height);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(target, level, x, y, width, height, GL_RGB,
+        format == PIXEL_RGB9E5 ? GL_UNSIGNED_INT_5_9_9_9_REV : GL_HALF_FLOAT, staging.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return staging.size();
+}
+
+// Uploads one level of a float image with 2 or 3 channels to the bound 2D
+// texture, or only allocates it without `withPixels`. Returns the number
+// of bytes sent.
+static size_t texImageView(const ImageView &view, int level, PixelFormat format, bool withPixels = true)
+{
+    if(view.channels == 3)
+        return texImage(GL_TEXTURE_2D, level, view.width, view.height, withPixels ? view.data : nullptr, PIXEL_FLOAT, format);
+    if(!withPixels)
+    {
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RG16F, view.width, view.height, 0, GL_RG, GL_HALF_FLOAT, nullptr);
+        return 0;
+    }
+    vector<uint16_t> halves((size_t)view.width * view.height * 2);
+    floatToHalf(view.data, halves.data(), halves.size());
+    glTexImage2D(GL_TEXTURE_2D, level, GL_RG16F, view.width, view.height, 0, GL_RG, GL_HALF_FLOAT, halves.data());
+    return halves.size() * sizeof(uint16_t);
+}
+
+// Appends steps filling level `level` of `target`, `texture` itself or one
+// of its faces, whose storage is already allocated, from the width x height
+// `pixels` in bands of about UPLOAD_BAND_BYTES. `pixels` must outlive the
+// steps.
+static void addBandSteps(vector<function<size_t()>> &steps, const Texture &texture, GLenum target, int level,
+    int width, int height, const void *pixels, PixelFormat pixelFormat, PixelFormat format)
+{
+    int bandRows = max<size_t>(1, UPLOAD_BAND_BYTES / ((size_t)width * pixelSize(format)));
+    size_t rowBytes = (size_t)width * pixelSize(pixelFormat);
+    for(int y = 0; y < height; y += bandRows)
+    {
+        int rows = min(bandRows, height - y);
+        const uint8_t *band = (const uint8_t *)pixels + y * rowBytes;
+        steps.push_back([&texture, target, level, y, width, rows, band, pixelFormat, format]()
+        {
+            glBindTexture(texture.target, texture.id);
+            return texSubImage(target, level, 0, y, width, rows, band, pixelFormat, format);
+        });
+    }
+}
+
+static ImageView viewOf(const EquirectImage &image)
+{
+    ImageView view;
+    view.width = image.width;
+    view.height = image.height;
+    view.channels = 3;
+    view.data = image.pixels.data();
+    return view;
+}
+
+static ImageView viewOf(const OctahedralImage &image)
+{
+    ImageView view;
+    view.width = view.height = image.size;
+    view.channels = 3;
+    view.data = image.pixels.data();
+    return view;
+}
+
+// Resamples a baked equirect map to an octahedral one half as wide, which
+// keeps the specular chain halving from level to level
+static OctahedralImage toOctahedral(const ImageView &view)
+{
+    EquirectImage equirect(view.width, view.height);
+    copy(view.data, view.data + equirect.pixels.size(), equirect.pixels.begin());
+    return OctahedralImage::fromEquirect(equirect, max(1, view.width / 2));
+}
+
+// Keeps the resampled maps of an octahedral IBL set alive, along with the
+// set they come from for its BRDF table
+struct OctahedralIBLStorage
+{
+    shared_ptr<const IBLData> source;
+    OctahedralImage irradiance;
+    vector<OctahedralImage> specular;
+};
+
+static shared_ptr<IBLData> toOctahedral(const shared_ptr<const IBLData> &data)
+{
+    auto start = chrono::steady_clock::now();
+    shared_ptr<OctahedralIBLStorage> storage = make_shared<OctahedralIBLStorage>();
+    storage->source = data;
+    storage->irradiance = toOctahedral(data->irradiance);
+    for(const ImageView &level : data->specular)
+        storage->specular.push_back(toOctahedral(level));
+    
+    shared_ptr<IBLData> octahedral = make_shared<IBLData>();
+    octahedral->params = data->params;
+    octahedral->irradianceSH = data->irradianceSH;
+    octahedral->irradiance = viewOf(storage->irradiance);
+    octahedral->brdf = data->brdf;
+    for(const OctahedralImage &level : storage->specular)
+        octahedral->specular.push_back(viewOf(level));
+    octahedral->storage = storage;
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Resampled IBL set to octahedral maps in " << elapsed.count() << " ms");
+    return octahedral;
+}
+
+// Generates `texture` on first use and binds it
+static void bindTexture(Texture &texture, GLenum target = GL_TEXTURE_2D)
+{
+    texture.target = target;
+    if(!texture.id)
+        glGenTextures(1, &texture.id);
+    glBindTexture(target, texture.id);
+}
+
+static void setMapParameters()
+{
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+static void setCubeMapParameters(bool seamless)
+{
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    if(seamless)
+        glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+}
+
+// Equirects wrap around horizontally, octahedral maps don't wrap at all
+static GLint wrapS(bool octahedral)
+{
+    return octahedral ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+}
+
+// Without `withPixels`, only allocates the texture and sets its parameters
+static size_t uploadIrradiance(Texture &texture, const ImageView &view, PixelFormat format, bool octahedral,
+    bool withPixels = true)
+{
+    bindTexture(texture);
+    size_t bytes = texImageView(view, 0, format, withPixels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS(octahedral));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return bytes;
+}
+
+// Uploads one level of the specular chain, or only allocates it without
+// `withPixels`, and sets the sampling parameters along with the first one
+static size_t uploadSpecularLevel(Texture &texture, const vector<ImageView> &levels, int level, PixelFormat format, bool octahedral,
+    bool withPixels = true)
+{
+    bindTexture(texture);
+    if(level == 0)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS(octahedral));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    return texImageView(levels[level], level, format, withPixels);
+}
+
+static size_t uploadBRDF(Texture &texture, const ImageView &view, PixelFormat format)
+{
+    bindTexture(texture);
+    size_t bytes = texImageView(view, 0, format);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    stbi_image_free(environmentMap);
+    return bytes;
+}
+
+// Keep the file's RGBE when the texture is shared-exponent too, which
+// converts exactly ; otherwise decode straight to half floats
+static PixelFormat decodeFormat(const EnvironmentMapOptions &options)
+{
+    return options.textureFormat == PIXEL_RGB9E5 ? PIXEL_RGBE : PIXEL_HALF;
+}
+
+// Cube face size for an equirect `width` texels wide
+static int cubeMapSize(const EnvironmentMapOptions &options, int width)
+{
+    return options.cubeMapSize > 0 ? options.cubeMapSize : max(1, width / 4);
+}
+
+// Octahedral map size for an equirect `width` texels wide
+static int octahedralSize(const EnvironmentMapOptions &options, int width)
+{
+    return options.octahedralSize > 0 ? options.octahedralSize : max(1, width / 2);
+}
+
+static OctahedralImage toOctahedral(const EquirectImage &image, const EnvironmentMapOptions &options)
+{
+    int size = octahedralSize(options, image.width);
+    auto start = chrono::steady_clock::now();
+    OctahedralImage octahedral = OctahedralImage::fromEquirect(image, size);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Converted environment to a " << size << "x" << size << " octahedral map in " << elapsed.count() << " ms");
+    return octahedral;
+}
+
+static EquirectImage downsampleTo(const EquirectImage &image, int maxWidth)
+{
+    EquirectImage downsampled = image.width > maxWidth ? image.downsample() : image;
+    while(downsampled.width > maxWidth)
+        downsampled = downsampled.downsample();
+    return downsampled;
+}
+
+// Maps the IBL set of the HDR file at `path` from the cache, or bakes and
+// stores it. `image` is only called on a miss.
+static shared_ptr<IBLData> cachedIBL(const string &path, const IBLBakeParams &resolved, const string &cacheDirectory,
+    const function<const EquirectImage&()> &image, const CubeMapImage *cubeMap)
+{
+    IBLCache cache(cacheDirectory);
+    uint64_t key = IBLCache::key(path, resolved);
+    shared_ptr<IBLData> data = cache.load(key);
+    if(data)
+        trace("Mapped cached IBL set " << cache.pathFor(key));
+    else
+    {
+        data = bakeIBL(image(), resolved, cacheDirectory + "/brdfLUT.bin", cubeMap);
+        cache.store(key, *data);
+        trace("Baked IBL set into " << cache.pathFor(key));
+    }
+    return data;
+}
+
+EnvironmentSet::~EnvironmentSet()
+{
+    // Sets prepared on a worker thread have no textures yet, keep GL out of it
+    for(Texture *texture : { &map, &cubeMap, &irradianceMap, &specularMap, &brdfMap })
+        if(texture->id)
+            glDeleteTextures(1, &texture->id);
+}
+
+size_t EnvironmentSet::hostBytes() const
+{
+    auto cubeBytes = [](const CubeMapImage &cube)
+    {
+        size_t bytes = 0;
+        for(int face = 0; face < 6; face++)
+            bytes += cube.faces[face].size() * sizeof(float);
+        return bytes;
+    };
+    auto viewBytes = [](const ImageView &view) { return (size_t)view.width * view.height * view.channels * sizeof(float); };
+    size_t bytes = hdr.data.size() + (image.pixels.size() + fitImage.pixels.size() + octahedral.pixels.size()) * sizeof(float)
+        + cubeBytes(cubeImage);
+    for(const CubeMapImage &level : cubeLevels)
+        bytes += cubeBytes(level);
+    if(ibl)
+    {
+        bytes += viewBytes(ibl->irradiance) + viewBytes(ibl->brdf);
+        for(const ImageView &level : ibl->specular)
+            bytes += viewBytes(level);
+    }
+    return bytes;
+}
+
+EnvironmentMap::EnvironmentMap(const EnvironmentMapOptions &options) :
+    _options(options),
+    _skyboxProgram("shaders/quadVertex.glsl", options.cubeMap ? "shaders/skyboxCubeFragment.glsl" : "shaders/skyboxFragment.glsl"),
+    _skyboxContext(_skyboxProgram)
+{
+    // A small uniform grey, bright enough for the model to be seen, with
+    // maps that are trivially derived from it
+    EquirectImage grey(8, 4);
+    fill(grey.pixels.begin(), grey.pixels.end(), .25f);
+    _hdr = HDRImage(grey.width, grey.height, decodeFormat(_options));
+    convertPixels(grey.pixels.data(), PIXEL_FLOAT, _hdr.data.data(), _hdr.format, grey.width * grey.height);
+    createMaps();
+    precomputeIrradianceSH(grey.width, grey.height);
+    if(_options.octahedral)
+        uploadSpecular(vector<ImageView>(1, viewOf(toOctahedral(image(), _options))));
+    else
+        uploadSpecular(vector<ImageView>(1, viewOf(image())));
+    const float brdf[2] = { 1.f, 0.f };
+    ImageView brdfView;
+    brdfView.width = brdfView.height = 1;
+    brdfView.channels = 2;
+    brdfView.data = brdf;
+    uploadBRDF(_brdfMap, brdfView, _options.textureFormat);
+}
+
+EnvironmentMap::EnvironmentMap(const string &path, const EnvironmentMapOptions &options) :
+    _path(path),
+    _options(options),
+    _skyboxProgram("shaders/quadVertex.glsl", options.cubeMap ? "shaders/skyboxCubeFragment.glsl" : "shaders/skyboxFragment.glsl"),
+    _skyboxContext(_skyboxProgram)
+{
+    auto start = chrono::steady_clock::now();
+    _hdr = loadHDRImage(path, decodeFormat(_options));
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Decoded " << path << " (" << _hdr.width << "x" << _hdr.height << ") in " << elapsed.count() << " ms");
+    createMaps();
 }
 
 EnvironmentMap::~EnvironmentMap()
 {
     glDeleteTextures(1, &_map.id);
+    glDeleteTextures(1, &_cubeMap.id);
     glDeleteTextures(1, &_irradianceMap.id);
     glDeleteTextures(1, &_specularMap.id);
     glDeleteTextures(1, &_brdfMap.id);
 }
 
+void EnvironmentMap::createMaps()
+{
+    if(_options.textureFormat != PIXEL_HALF && _options.textureFormat != PIXEL_RGB9E5)
+        fatal("Unsupported environment texture format " << _options.textureFormat);
+    uploadMap();
+    
+    if(_options.cubeMap)
+    {
+        createCubeMap();
+        _skyboxProgram.registerTexture("uEnvironment", _cubeMap);
+    }
+    else
+        _skyboxProgram.registerTexture("uEnvironment", _map);
+}
+
+void EnvironmentMap::uploadMap()
+{
+    bindTexture(_map);
+    if(_options.octahedral)
+    {
+        OctahedralImage octahedral = toOctahedral(image(), _options);
+        texImage(GL_TEXTURE_2D, 0, octahedral.size, octahedral.size, octahedral.pixels.data(), PIXEL_FLOAT, _options.textureFormat);
+    }
+    else
+        texImage(GL_TEXTURE_2D, 0, _hdr.width, _hdr.height, _hdr.data.data(), _hdr.format, _options.textureFormat);
+    setMapParameters();
+}
+
+const EquirectImage& EnvironmentMap::image()
+{
+    // The float copy is only built once a CPU-side computation needs it,
+    // which a cache hit never does
+    if(_image.pixels.empty())
+        _image = _hdr.toEquirect();
+    return _image;
+}
+
+const EnvironmentSampler& EnvironmentMap::getSampler()
+{
+    if(!_sampler)
+    {
+        const EquirectImage &equirect = image();
+        auto start = chrono::steady_clock::now();
+        _sampler.reset(new EnvironmentSampler(equirect));
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        trace("Built environment sampling tables in " << elapsed.count() << " ms");
+    }
+    return *_sampler;
+}
+
+const LightSet& EnvironmentMap::extractLights(int count)
+{
+    if(_lightCount != count)
+    {
+        _lightCount = count;
+        const EquirectImage &equirect = image();
+        auto start = chrono::steady_clock::now();
+        _lights = invLight::extractLights(equirect, count);
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        trace("Extracted " << count << " lights in " << elapsed.count() << " ms");
+    }
+    return _lights;
+}
+
+void EnvironmentMap::uploadLights(ShaderProgram &program, int count)
+{
+    // Must match the array sizes in modelFragment.glsl
+    const int maxLights = 32;
+    count = min(count, maxLights);
+    program.uniform1i("uLightCount", count);
+    if(count <= 0)
+        return;
+    const LightSet &set = extractLights(count);
+    vector<float> directions, powers;
+    for(const DirectionalLight &light : set.lights)
+    {
+        Vector3f power = light.power();
+        directions.insert(directions.end(), light.direction.data(), light.direction.data() + 3);
+        powers.insert(powers.end(), power.data(), power.data() + 3);
+    }
+    program.uniform3fv("uLightDirections", set.lights.size(), directions.data());
+    program.uniform3fv("uLightPowers", set.lights.size(), powers.data());
+    Matrix<float, 3, SH_COEFFICIENTS> coeffs = set.residualSH.transpose();
+    program.uniform3fv("uIrradianceSH", SH_COEFFICIENTS, coeffs.data());
+}
+
+void EnvironmentMap::uploadSphericalGaussians(ShaderProgram &program, const vector<SphericalGaussian> &lobes)
+{
+    // Must match the array sizes in modelFragment.glsl
+    const int maxLobes = 32;
+    int count = min((int)lobes.size(), maxLobes);
+    program.uniform1i("uSGCount", count);
+    if(count <= 0)
+        return;
+    vector<float> axes, sharpnesses, amplitudes;
+    for(int i = 0; i < count; i++)
+    {
+        axes.insert(axes.end(), lobes[i].axis.data(), lobes[i].axis.data() + 3);
+        sharpnesses.push_back(lobes[i].sharpness);
+        amplitudes.insert(amplitudes.end(), lobes[i].amplitude.data(), lobes[i].amplitude.data() + 3);
+    }
+    program.uniform3fv("uSGAxes", count, axes.data());
+    program.uniform1fv("uSGSharpnesses", count, sharpnesses.data());
+    program.uniform3fv("uSGAmplitudes", count, amplitudes.data());
+}
+
+const EquirectImage& EnvironmentMap::fitImage()
+{
+    if(_fitImage.pixels.empty())
+        _fitImage = downsampleTo(image(), _options.fitImageWidth);
+    return _fitImage;
+}
+
+void EnvironmentMap::createCubeMap()
+{
+    int size = cubeMapSize(_options, _hdr.width);
+    const EquirectImage &equirect = image();
+    auto start = chrono::steady_clock::now();
+    _cubeImage = CubeMapImage::fromEquirect(equirect, size);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Converted environment to a " << size << "x" << size << " cube map in " << elapsed.count() << " ms");
+    
+    bindTexture(_cubeMap, GL_TEXTURE_CUBE_MAP);
+    // Mip levels let the precomputations take fewer, filtered samples. They
+    // are built on the CPU since GL_RGB9_E5 isn't renderable, which
+    // glGenerateMipmap requires.
+    CubeMapImage level = _cubeImage;
+    for(int i = 0; ; i++)
+    {
+        for(int face = 0; face < 6; face++)
+            texImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, i, level.size, level.size, level.faces[face].data(), PIXEL_FLOAT, _options.textureFormat);
+        if(level.size == 1)
+            break;
+        level = level.downsample();
+    }
+    setCubeMapParameters(_options.seamless);
+}
+
 void EnvironmentMap::precomputeIrradiance(int width, int height)
 {
-    ShaderProgram precompProgram("shaders/precompVertex.glsl", "shaders/precompIrradianceFragment.glsl");
-    precompProgram.registerTexture("uEnvironment", _map);
+    ShaderProgram precompProgram("shaders/precompVertex.glsl",
+        _options.cubeMap ? "shaders/precompIrradianceCubeFragment.glsl" : "shaders/precompIrradianceFragment.glsl");
+    precompProgram.registerTexture("uEnvironment", _options.cubeMap ? _cubeMap : _map);
     QuadRenderContext quadContext(precompProgram);
     
     glActiveTexture(GL_TEXTURE0);
@@ -68,6 +535,10 @@ void EnvironmentMap::precomputeIrradiance(int width, int height)
     if(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE)
     {
         precompProgram.use();
+        precompProgram.uniform1i("uOctahedral", _options.octahedral);
+        // Read from the cube level whose texels match the angular step of the shader
+        if(_options.cubeMap)
+            precompProgram.uniform1f("uLod", max(0., log2(0.025 * 2. * _cubeImage.size / M_PI)));
         quadContext.render();
     }
     else
@@ -79,9 +550,367 @@ void EnvironmentMap::precomputeIrradiance(int width, int height)
     glDeleteRenderbuffers(1, &rbo);
 }
 
+const SHCoefficients& EnvironmentMap::computeIrradianceSH()
+{
+    if(!_hasIrradianceSH)
+    {
+        auto start = chrono::steady_clock::now();
+        const EquirectImage &equirect = image();
+        _irradianceSH = projectEquirectSH(equirect.pixels.data(), equirect.width, equirect.height);
+        convolveSHCosine(_irradianceSH);
+        _hasIrradianceSH = true;
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        trace("Projected environment onto SH in " << elapsed.count() << " ms");
+    }
+    return _irradianceSH;
+}
+
+void EnvironmentMap::precomputeIrradianceSH(int width, int height)
+{
+    if(width <= 0)
+        width = _hdr.width;
+    if(height <= 0)
+        height = _hdr.height;
+    EquirectImage irradiance(width, height);
+    renderEquirectSH(computeIrradianceSH(), width, height, irradiance.pixels.data());
+    if(_options.octahedral)
+        uploadIrradiance(_irradianceMap, viewOf(toOctahedral(viewOf(irradiance))), _options.textureFormat, true);
+    else
+        uploadIrradiance(_irradianceMap, viewOf(irradiance), _options.textureFormat, false);
+}
+
+void EnvironmentMap::precomputeSpecular(int width, int height, int levels, int samples)
+{
+    IBLBakeParams params;
+    params.specularWidth = width;
+    params.specularHeight = height;
+    params.specularLevels = levels;
+    params.specularSamples = samples;
+    params = params.resolved(_hdr.width, _hdr.height);
+    
+    auto start = chrono::steady_clock::now();
+    vector<EquirectImage> chain = _options.cubeMap
+        ? bakeSpecular(_cubeImage, params.specularWidth, params.specularHeight, params.specularLevels, params.specularSamples)
+        : bakeSpecular(image(), params.specularWidth, params.specularHeight, params.specularLevels, params.specularSamples);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Prefiltered " << params.specularLevels << " specular levels in " << elapsed.count() << " ms");
+    
+    vector<OctahedralImage> octahedral;
+    vector<ImageView> views;
+    for(const EquirectImage &level : chain)
+        if(_options.octahedral)
+        {
+            octahedral.push_back(toOctahedral(viewOf(level)));
+            views.push_back(viewOf(octahedral.back()));
+        }
+        else
+            views.push_back(viewOf(level));
+    uploadSpecular(views);
+}
+
+void EnvironmentMap::precomputeBRDF(int size, int samples, const string &cachePath)
+{
+    vector<float> lut = loadOrBakeBRDFLUT(cachePath, size, samples);
+    ImageView view;
+    view.width = view.height = size;
+    view.channels = 2;
+    view.data = lut.data();
+    uploadBRDF(_brdfMap, view, _options.textureFormat);
+}
+
+void EnvironmentMap::precompute(const IBLBakeParams &params, const string &cacheDirectory)
+{
+    IBLBakeParams resolved = params.resolved(_hdr.width, _hdr.height);
+    // 0 without a cube map
+    resolved.cubeMapSize = _cubeImage.size;
+    
+    auto start = chrono::steady_clock::now();
+    shared_ptr<IBLData> data = cachedIBL(_path, resolved, cacheDirectory, [this]() -> const EquirectImage& { return image(); },
+        _options.cubeMap ? &_cubeImage : nullptr);
+    upload(*data);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("IBL set ready in " << elapsed.count() << " ms");
+}
+
+void EnvironmentMap::upload(const IBLData &data)
+{
+    _irradianceSH = data.irradianceSH;
+    _hasIrradianceSH = true;
+    // Baked sets are equirects, whether they come from the cache or not
+    shared_ptr<IBLData> octahedral;
+    if(_options.octahedral)
+        octahedral = toOctahedral(shared_ptr<const IBLData>(&data, [](const IBLData *) { }));
+    const IBLData &maps = octahedral ? *octahedral : data;
+    uploadIrradiance(_irradianceMap, maps.irradiance, _options.textureFormat, _options.octahedral);
+    uploadSpecular(maps.specular);
+    uploadBRDF(_brdfMap, maps.brdf, _options.textureFormat);
+}
+
+void EnvironmentMap::uploadSpecular(const vector<ImageView> &specularLevels)
+{
+    for(unsigned int i = 0; i < specularLevels.size(); i++)
+        uploadSpecularLevel(_specularMap, specularLevels, i, _options.textureFormat, _options.octahedral);
+    _specularLevels = specularLevels.size();
+}
+
+void EnvironmentMap::load(const string &path, const IBLBakeParams &params, const string &cacheDirectory)
+{
+    LoadRequest request;
+    request.path = path;
+    request.params = params;
+    request.cacheDirectory = cacheDirectory;
+    // Only one worker at a time : the latest request waits for the current
+    // one, whose result is then dropped
+    if(_loading.valid())
+    {
+        _nextLoad = request;
+        _hasNextLoad = true;
+    }
+    else
+        startLoad(request);
+}
+
+void EnvironmentMap::startLoad(const LoadRequest &request)
+{
+    trace("Loading " << request.path << " in the background ...");
+    _loading = async(launch::async, &EnvironmentMap::prepare, request.path, request.params, request.cacheDirectory, _options);
+}
+
+unique_ptr<EnvironmentSet> EnvironmentMap::prepare(const string &path, const IBLBakeParams &params, const string &cacheDirectory,
+    const EnvironmentMapOptions &options)
+{
+    auto start = chrono::steady_clock::now();
+    unique_ptr<EnvironmentSet> set(new EnvironmentSet);
+    EnvironmentSet &s = *set;
+    s.path = path;
+    s.hdr = loadHDRImage(path, decodeFormat(options));
+    auto image = [&s]() -> const EquirectImage&
+    {
+        if(s.image.pixels.empty())
+            s.image = s.hdr.toEquirect();
+        return s.image;
+    };
+    if(options.cubeMap)
+    {
+        s.cubeImage = CubeMapImage::fromEquirect(image(), cubeMapSize(options, s.hdr.width));
+        for(int size = s.cubeImage.size; size > 1; size = s.cubeLevels.back().size)
+            s.cubeLevels.push_back(s.cubeLevels.empty() ? s.cubeImage.downsample() : s.cubeLevels.back().downsample());
+    }
+    IBLBakeParams resolved = params.resolved(s.hdr.width, s.hdr.height);
+    resolved.cubeMapSize = s.cubeImage.size;
+    s.ibl = cachedIBL(path, resolved, cacheDirectory, image, options.cubeMap ? &s.cubeImage : nullptr);
+    if(options.octahedral)
+    {
+        s.octahedral = toOctahedral(image(), options);
+        s.ibl = toOctahedral(s.ibl);
+    }
+    // From a float expansion that isn't kept if a cache hit didn't need one
+    if(s.image.pixels.empty())
+        s.fitImage = downsampleTo(s.hdr.toEquirect(), options.fitImageWidth);
+    else
+        s.fitImage = downsampleTo(s.image, options.fitImageWidth);
+    s.irradianceSH = s.ibl->irradianceSH;
+    s.hasIrradianceSH = true;
+    s.specularLevels = s.ibl->specular.size();
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Prepared " << path << " in " << elapsed.count() << " ms");
+    return set;
+}
+
+void EnvironmentMap::prepareUploads(EnvironmentSet &set)
+{
+    PixelFormat format = _options.textureFormat;
+    
+    // Every texture is allocated now, then filled in bands of about
+    // UPLOAD_BAND_BYTES, cube faces and specular levels included, so that no
+    // single step stalls the frame. Only the small BRDF table goes up at
+    // once.
+    bool octahedral = _options.octahedral;
+    bindTexture(set.map);
+    if(octahedral)
+    {
+        texImage(GL_TEXTURE_2D, 0, set.octahedral.size, set.octahedral.size, nullptr, format, format);
+        addBandSteps(set.steps, set.map, GL_TEXTURE_2D, 0, set.octahedral.size, set.octahedral.size, set.octahedral.row(0),
+            PIXEL_FLOAT, format);
+    }
+    else
+    {
+        texImage(GL_TEXTURE_2D, 0, set.hdr.width, set.hdr.height, nullptr, format, format);
+        addBandSteps(set.steps, set.map, GL_TEXTURE_2D, 0, set.hdr.width, set.hdr.height, set.hdr.row(0), set.hdr.format, format);
+    }
+    setMapParameters();
+    
+    if(_options.cubeMap)
+    {
+        bindTexture(set.cubeMap, GL_TEXTURE_CUBE_MAP);
+        setCubeMapParameters(_options.seamless);
+        for(unsigned int level = 0; level <= set.cubeLevels.size(); level++)
+        {
+            const CubeMapImage &image = level == 0 ? set.cubeImage : set.cubeLevels[level - 1];
+            for(int face = 0; face < 6; face++)
+            {
+                GLenum target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + face;
+                texImage(target, level, image.size, image.size, nullptr, format, format);
+                addBandSteps(set.steps, set.cubeMap, target, level, image.size, image.size, image.faces[face].data(),
+                    PIXEL_FLOAT, format);
+            }
+        }
+    }
+    
+    const ImageView &irradiance = set.ibl->irradiance;
+    uploadIrradiance(set.irradianceMap, irradiance, format, octahedral, false);
+    addBandSteps(set.steps, set.irradianceMap, GL_TEXTURE_2D, 0, irradiance.width, irradiance.height, irradiance.data,
+        PIXEL_FLOAT, format);
+    for(unsigned int level = 0; level < set.ibl->specular.size(); level++)
+    {
+        const ImageView &specular = set.ibl->specular[level];
+        uploadSpecularLevel(set.specularMap, set.ibl->specular, level, format, octahedral, false);
+        addBandSteps(set.steps, set.specularMap, GL_TEXTURE_2D, level, specular.width, specular.height, specular.data,
+            PIXEL_FLOAT, format);
+    }
+    set.steps.push_back([&set, format]() { return uploadBRDF(set.brdfMap, set.ibl->brdf, format); });
+}
+
+bool EnvironmentMap::stage(EnvironmentSet &set, size_t budget)
+{
+    if(set.uploaded())
+        return true;
+    if(!set.map.id)
+        prepareUploads(set);
+    size_t sent = 0;
+    while(set.nextStep < set.steps.size() && sent < budget)
+        sent += set.steps[set.nextStep++]();
+    set.deviceBytes += sent;
+    if(set.nextStep < set.steps.size())
+        return false;
+    // Only the textures are needed from now on
+    set.steps.clear();
+    set.nextStep = 0;
+    set.cubeLevels.clear();
+    set.octahedral = OctahedralImage();
+    set.ibl.reset();
+    return true;
+}
+
+void EnvironmentMap::swap(EnvironmentSet &set)
+{
+    if(!set.uploaded())
+        fatal("Environment " << set.path << " isn't uploaded yet");
+    std::swap(_map, set.map);
+    std::swap(_cubeMap, set.cubeMap);
+    std::swap(_irradianceMap, set.irradianceMap);
+    std::swap(_specularMap, set.specularMap);
+    std::swap(_brdfMap, set.brdfMap);
+    std::swap(_deviceBytes, set.deviceBytes);
+    std::swap(_path, set.path);
+    std::swap(_hdr, set.hdr);
+    std::swap(_image, set.image);
+    std::swap(_fitImage, set.fitImage);
+    std::swap(_cubeImage, set.cubeImage);
+    std::swap(_irradianceSH, set.irradianceSH);
+    std::swap(_hasIrradianceSH, set.hasIrradianceSH);
+    std::swap(_specularLevels, set.specularLevels);
+    // Rebuilt from the new image on next use
+    _sampler.reset();
+    _lightCount = 0;
+    _skyboxProgram.registerTexture("uEnvironment", _options.cubeMap ? _cubeMap : _map);
+}
+
+bool EnvironmentMap::update()
+{
+    if(_loading.valid() && _loading.wait_for(chrono::seconds(0)) == future_status::ready)
+    {
+        unique_ptr<EnvironmentSet> set;
+        try
+        {
+            set = _loading.get();
+        }
+        catch(exception &e)
+        {
+            // Keep showing the current environment
+            trace("Couldn't load environment : " << e.what());
+        }
+        if(_hasNextLoad)
+        {
+            _hasNextLoad = false;
+            startLoad(_nextLoad);
+        }
+        else if(set)
+            // Replaces, and frees, any older environment still uploading
+            _pending = move(set);
+    }
+    if(!_pending || !stage(*_pending, _options.uploadBudget))
+        return false;
+    // The pending set ends up holding the previous textures, and frees
+    // them when it goes
+    swap(*_pending);
+    _pending.reset();
+    trace("Swapped in " << _path);
+    return true;
+}
+
+void EnvironmentMap::bindTextures(ShaderProgram &program)
+{
+    program.registerTexture("uIrradianceMap", _irradianceMap);
+    program.registerTexture("uSpecularMap", _specularMap);
+    program.registerTexture("uBRDFMap", _brdfMap);
+}
+
+void EnvironmentMap::updateRegion(int x, int y, int width, int height, const float *pixels)
+{
+    if(x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > _hdr.width || y + height > _hdr.height)
+        fatal("Region " << x << ", " << y << " " << width << "x" << height << " is out of the environment");
+    auto start = chrono::steady_clock::now();
+    // The float copy is edited in place, make sure it exists
+    image();
+    // The rectangle as it was, then as it is
+    vector<float> previous(3 * width * height);
+    for(int j = 0; j < height; j++)
+    {
+        float *row = _image.row(y + j) + 3 * x;
+        const float *next = pixels + 3 * j * width;
+        copy(row, row + 3 * width, &previous[3 * j * width]);
+        copy(next, next + 3 * width, row);
+        convertPixels(next, PIXEL_FLOAT, _hdr.row(y + j) + x * pixelSize(_hdr.format), _hdr.format, width);
+    }
+    if(_hasIrradianceSH)
+        updateEquirectSH(_irradianceSH, previous.data(), pixels, x, y, width, height, _hdr.width, _hdr.height, true);
+    
+    // An octahedral map scatters the rectangle, resample it all
+    if(_options.octahedral)
+        uploadMap();
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D, _map.id);
+        texSubImage(GL_TEXTURE_2D, 0, x, y, width, height, pixels, PIXEL_FLOAT, _options.textureFormat);
+    }
+    if(_irradianceMap.id)
+    {
+        int irradianceWidth, irradianceHeight;
+        glBindTexture(GL_TEXTURE_2D, _irradianceMap.id);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &irradianceWidth);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &irradianceHeight);
+        precomputeIrradianceSH(irradianceWidth, irradianceHeight);
+    }
+    // Everything else derived from the image is rebuilt on next use
+    _sampler.reset();
+    _lightCount = 0;
+    _fitImage = EquirectImage();
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    trace("Updated a " << width << "x" << height << " region in " << elapsed.count() << " ms");
+}
+
+void EnvironmentMap::uploadIrradianceSH(ShaderProgram &program, const string &name)
+{
+    // GLSL wants one vec3 per coefficient
+    Matrix<float, 3, SH_COEFFICIENTS> coeffs = computeIrradianceSH().transpose();
+    program.uniform3fv(name, SH_COEFFICIENTS, coeffs.data());
+}
+
 void EnvironmentMap::render(Camera3D &cam, Matrix4f &invProjMat)
 {
     _skyboxProgram.use();
+    _skyboxProgram.uniform1i("uOctahedral", _options.octahedral);
     _skyboxProgram.uniformMatrix4fv("uInvP", 1, invProjMat.data());
     _skyboxProgram.uniformMatrix4fv("uV", 1, cam.m_viewMatr.data());
     _skyboxContext.render();
@@ -0,0 +1,103 @@
+#include "EnvironmentSampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+
+using namespace invLight;
+using namespace std;
+
+static inline float luminance(const float *rgb)
+{
+    return .2126f * rgb[0] + .7152f * rgb[1] + .0722f * rgb[2];
+}
+
+EnvironmentSampler::EnvironmentSampler(const EquirectImage &image) :
+    _image(image),
+    _rows(image.height + 1),
+    _columns((image.width + 1) * image.height),
+    _density(image.width * image.height)
+{
+    const int width = image.width, height = image.height;
+    // Weights go to _density first, which is normalized once the total is known
+    vector<float> rowWeights(height);
+    parallelFor(0, height, [&](int begin, int end)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            float sinTheta = sin((y + .5f) * M_PI / height), *weights = &_density[y * width];
+            const float *row = image.row(y);
+            double sum = 0.;
+            for(int x = 0; x < width; x++)
+            {
+                weights[x] = max(0.f, luminance(row + 3 * x)) * sinTheta;
+                sum += weights[x];
+            }
+            rowWeights[y] = sum;
+            buildCDF(weights, width, &_columns[y * (width + 1)]);
+        }
+    });
+    buildCDF(rowWeights.data(), height, _rows.data());
+    
+    double total = 0.;
+    for(float w : rowWeights)
+        total += w;
+    // An all-black environment is sampled uniformly over the square
+    float scale = total > 0. ? width * height / total : 0.f;
+    for(float &d : _density)
+        d = total > 0. ? d * scale : 1.f;
+}
+
+void EnvironmentSampler::buildCDF(const float *weights, int count, float *cdf)
+{
+    double sum = 0.;
+    for(int i = 0; i < count; i++)
+        sum += weights[i];
+    double running = 0.;
+    cdf[0] = 0.f;
+    for(int i = 0; i < count; i++)
+    {
+        running += weights[i];
+        // Uniform when there's nothing to sample, that slot is never picked anyway
+        cdf[i + 1] = sum > 0. ? running / sum : (i + 1.) / count;
+    }
+    cdf[count] = 1.f;
+}
+
+int EnvironmentSampler::invertCDF(const float *cdf, int count, float u, float &fraction)
+{
+    // Last slot starting at or before u, which skips empty slots
+    int i = upper_bound(cdf, cdf + count + 1, u) - cdf - 1;
+    i = max(0, min(i, count - 1));
+    float width = cdf[i + 1] - cdf[i];
+    fraction = width > 0.f ? min((u - cdf[i]) / width, .99999994f) : .5f;
+    return i;
+}
+
+EnvironmentSample EnvironmentSampler::sample(const Vector2f &u) const
+{
+    const int width = _image.width, height = _image.height;
+    float fy, fx;
+    int y = invertCDF(_rows.data(), height, u[1], fy),
+        x = invertCDF(&_columns[y * (width + 1)], width, u[0], fx);
+    float phi = ((x + fx) / width - .5f) * 2.f * M_PI, theta = (y + fy) * M_PI / height,
+        sinTheta = sin(theta);
+    EnvironmentSample s;
+    s.direction = Vector3f(cos(phi) * sinTheta, cos(theta), -sin(phi) * sinTheta);
+    s.radiance = Map<const Vector3f>(_image.row(y) + 3 * x);
+    s.pdf = sinTheta > 0.f ? _density[y * width + x] / (2.f * M_PI * M_PI * sinTheta) : 0.f;
+    return s;
+}
+
+float EnvironmentSampler::pdf(const Vector3f &dir) const
+{
+    const int width = _image.width, height = _image.height;
+    float u = atan2(-dir[2], dir[0]) / (2.f * M_PI) + .5f,
+        theta = acos(max(-1.f, min(1.f, dir[1]))),
+        sinTheta = sin(theta);
+    if(sinTheta <= 0.f)
+        return 0.f;
+    int x = min((int)(u * width), width - 1), y = min((int)(theta / M_PI * height), height - 1);
+    return _density[y * width + x] / (2.f * M_PI * M_PI * sinTheta);
+}
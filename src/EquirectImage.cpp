@@ -0,0 +1,106 @@
+#include "EquirectImage.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+#include "SIMDMath.h"
+
+using namespace invLight;
+using namespace std;
+
+Vector3f EquirectImage::texelDirection(int x, int y) const
+{
+    float phi = ((x + .5f) / width - .5f) * 2.f * M_PI, theta = (y + .5f) * M_PI / height;
+    return Vector3f(cos(phi) * sin(theta), cos(theta), -sin(phi) * sin(theta));
+}
+
+// Bilinear tap at texel coordinates (px, py), wrapping around horizontally
+static inline void bilinear(const EquirectImage &image, float px, float py, float *rgb)
+{
+    const int width = image.width, height = image.height;
+    const vector<float> &pixels = image.pixels;
+    int x0 = floor(px), y0 = floor(py);
+    float fx = px - x0, fy = py - y0;
+    int x1 = x0 + 1, y1 = min(y0 + 1, height - 1);
+    x0 = (x0 + width) % width;
+    x1 = x1 % width;
+    y0 = max(y0, 0);
+    const float *p00 = &pixels[3 * (y0 * width + x0)], *p10 = &pixels[3 * (y0 * width + x1)],
+        *p01 = &pixels[3 * (y1 * width + x0)], *p11 = &pixels[3 * (y1 * width + x1)];
+    for(int i = 0; i < 3; i++)
+        rgb[i] = (p00[i] * (1.f - fx) + p10[i] * fx) * (1.f - fy) + (p01[i] * (1.f - fx) + p11[i] * fx) * fy;
+}
+
+Vector3f EquirectImage::sample(const Vector3f &dir) const
+{
+    float u = atan2(-dir[2], dir[0]) / (2.f * M_PI) + .5f,
+        v = acos(max(-1.f, min(1.f, dir[1]))) / M_PI;
+    Vector3f c;
+    bilinear(*this, u * width - .5f, v * height - .5f, c.data());
+    return c;
+}
+
+void EquirectImage::sample4(const float *x, const float *y, const float *z, float *rgb) const
+{
+    float px[4], py[4];
+#ifdef __SSE2__
+    __m128 u = _mm_add_ps(_mm_mul_ps(atan2_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(z)), _mm_loadu_ps(x)),
+            _mm_set1_ps(.5f / M_PI)), _mm_set1_ps(.5f)),
+        v = _mm_mul_ps(acos_ps(_mm_loadu_ps(y)), _mm_set1_ps(1.f / M_PI));
+    _mm_storeu_ps(px, _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(width)), _mm_set1_ps(.5f)));
+    _mm_storeu_ps(py, _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps(height)), _mm_set1_ps(.5f)));
+#else
+    for(int i = 0; i < 4; i++)
+    {
+        px[i] = (atan2(-z[i], x[i]) / (2.f * M_PI) + .5f) * width - .5f;
+        py[i] = acos(max(-1.f, min(1.f, y[i]))) / M_PI * height - .5f;
+    }
+#endif
+    for(int i = 0; i < 4; i++)
+        bilinear(*this, px[i], py[i], rgb + 3 * i);
+}
+
+float EquirectImage::texelSolidAngle(const Vector3f &dir) const
+{
+    // The equator's texel solid angle, shrinking with sin(theta) towards the poles
+    return 2.f * M_PI * M_PI / (width * height) * sqrt(max(1e-4f, 1.f - dir[1] * dir[1]));
+}
+
+EquirectImage EquirectImage::downsample() const
+{
+    EquirectImage half(max(1, width / 2), max(1, height / 2));
+    parallelFor(0, half.height, [&](int begin, int end)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            const float *r0 = row(min(2 * y, height - 1)), *r1 = row(min(2 * y + 1, height - 1));
+            float *out = half.row(y);
+            for(int x = 0; x < half.width; x++)
+            {
+                int x0 = min(2 * x, width - 1), x1 = min(2 * x + 1, width - 1);
+                for(int c = 0; c < 3; c++)
+                    out[3 * x + c] = .25f * (r0[3 * x0 + c] + r0[3 * x1 + c] + r1[3 * x0 + c] + r1[3 * x1 + c]);
+            }
+        }
+    });
+    return half;
+}
+
+EquirectPyramid::EquirectPyramid(const EquirectImage &image) : _base(image)
+{
+    _levels.resize(1);
+    while(level(levels() - 1).height > 1)
+        _levels.push_back(level(levels() - 1).downsample());
+}
+
+Vector3f EquirectPyramid::sample(const Vector3f &dir, float lod) const
+{
+    lod = max(0.f, min(lod, levels() - 1.f));
+    int l0 = lod, l1 = min(l0 + 1, levels() - 1);
+    float t = lod - l0;
+    Vector3f c = level(l0).sample(dir);
+    if(t > 0.f)
+        c = c * (1.f - t) + level(l1).sample(dir) * t;
+    return c;
+}
@@ -0,0 +1,182 @@
+#include "HDRImage.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "stb_image.h"
+
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+EquirectImage HDRImage::toEquirect() const
+{
+    EquirectImage image(width, height);
+    parallelFor(0, height, [&](int begin, int end)
+    {
+        for(int y = begin; y < end; y++)
+            convertPixels(row(y), format, image.row(y), PIXEL_FLOAT, width);
+    });
+    return image;
+}
+
+// Reads the text header up to the resolution line, returning the offset of
+// the first scanline or 0 if the file isn't in a layout we decode natively
+static size_t parseRadianceHeader(const MappedFile &file, int &width, int &height)
+{
+    const char *p = (const char *)file.data(), *end = p + file.size();
+    auto readLine = [&](string &line)
+    {
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if(!eol)
+            return false;
+        line.assign(p, eol);
+        p = eol + 1;
+        return true;
+    };
+    string line;
+    if(!readLine(line) || (line != "#?RADIANCE" && line != "#?RGBE"))
+        return 0;
+    bool rgbe = true;
+    while(readLine(line) && !line.empty())
+        if(line.compare(0, 7, "FORMAT=") == 0)
+            rgbe = line == "FORMAT=32-bit_rle_rgbe";
+    // Only the standard orientation, rows top to bottom
+    if(!rgbe || !readLine(line) || sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0)
+        return 0;
+    return p - (const char *)file.data();
+}
+
+// Offset past the scanline starting at `offset`, or 0 if it's truncated or
+// malformed. Like stb_image, scanlines without the RLE marker are read as flat.
+static size_t skipScanline(const MappedFile &file, size_t offset, int width)
+{
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    if(width < 8 || width > 0x7FFF || offset + 4 > size || data[offset] != 2 || data[offset + 1] != 2 || (data[offset + 2] & 0x80))
+    {
+        // Flat scanline
+        size_t next = offset + 4 * (size_t)width;
+        return next <= size ? next : 0;
+    }
+    if(((data[offset + 2] << 8) | data[offset + 3]) != width)
+        return 0;
+    offset += 4;
+    for(int c = 0; c < 4; c++)
+    {
+        for(int x = 0; x < width; )
+        {
+            if(offset >= size)
+                return 0;
+            int count = data[offset++];
+            if(count > 128)
+            {
+                count -= 128;
+                offset++;
+            }
+            else
+                offset += count;
+            if(count == 0)
+                return 0;
+            x += count;
+            if(x > width)
+                return 0;
+        }
+    }
+    return offset <= size ? offset : 0;
+}
+
+// Decodes the scanline at `offset`, already validated by skipScanline(),
+// into interleaved RGBE
+static void decodeScanline(const uint8_t *data, int width, uint8_t *rgbe)
+{
+    if(width < 8 || width > 0x7FFF || data[0] != 2 || data[1] != 2 || (data[2] & 0x80))
+    {
+        memcpy(rgbe, data, 4 * (size_t)width);
+        return;
+    }
+    data += 4;
+    // Each channel is run-length encoded separately
+    for(int c = 0; c < 4; c++)
+    {
+        for(int x = 0; x < width; )
+        {
+            int count = *data++;
+            if(count > 128)
+            {
+                count -= 128;
+                uint8_t value = *data++;
+                for(int i = 0; i < count; i++)
+                    rgbe[4 * (x + i) + c] = value;
+            }
+            else
+            {
+                for(int i = 0; i < count; i++)
+                    rgbe[4 * (x + i) + c] = data[i];
+                data += count;
+            }
+            x += count;
+        }
+    }
+}
+
+static bool loadRadiance(const string &path, PixelFormat format, HDRImage &image)
+{
+    MappedFile file(path);
+    if(!file.valid())
+        fatal("Couldn't map image " << path);
+    int width, height;
+    size_t offset = parseRadianceHeader(file, width, height);
+    if(!offset)
+        return false;
+    
+    // RLE scanlines have variable lengths, so finding where each one starts
+    // is the only sequential part
+    vector<size_t> offsets(height);
+    for(int y = 0; y < height; y++)
+    {
+        offsets[y] = offset;
+        offset = skipScanline(file, offset, width);
+        if(!offset)
+        {
+            trace("Falling back to stb_image for " << path << " : unsupported or truncated scanline " << y);
+            return false;
+        }
+    }
+    
+    image = HDRImage(width, height, format);
+    parallelFor(0, height, [&](int begin, int end)
+    {
+        vector<uint8_t> rgbe(format == PIXEL_RGBE ? 0 : 4 * width);
+        for(int y = begin; y < end; y++)
+        {
+            if(format == PIXEL_RGBE)
+                decodeScanline(file.data() + offsets[y], width, image.row(y));
+            else
+            {
+                decodeScanline(file.data() + offsets[y], width, rgbe.data());
+                convertPixels(rgbe.data(), PIXEL_RGBE, image.row(y), format, width);
+            }
+        }
+    });
+    return true;
+}
+
+HDRImage invLight::loadHDRImage(const string &path, PixelFormat format)
+{
+    HDRImage image;
+    if(loadRadiance(path, format, image))
+        return image;
+    
+    int width, height, bpp;
+    unique_ptr<float, void (*)(void *)> pixels(stbi_loadf(path.c_str(), &width, &height, &bpp, 3), stbi_image_free);
+    if(!pixels)
+        fatal("Couldn't load image " << path);
+    image = HDRImage(width, height, format);
+    convertPixels(pixels.get(), PIXEL_FLOAT, image.data.data(), format, width * height);
+    return image;
+}
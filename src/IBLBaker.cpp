@@ -0,0 +1,306 @@
+#include "IBLBaker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+struct SpecularSample
+{
+    Vector3f l;
+    float nl, lod;
+};
+
+static void tangentFrame(const Vector3f &n, Vector3f &t, Vector3f &b)
+{
+    Vector3f up = fabs(n[1]) < .999f ? Vector3f(0.f, 1.f, 0.f) : Vector3f(1.f, 0.f, 0.f);
+    t = up.cross(n).normalized();
+    b = n.cross(t);
+}
+
+Vector2f hammersley(unsigned int i, unsigned int n)
+{
+    // Van der Corput radical inverse in base 2
+    unsigned int bits = i;
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return Vector2f((float)i / n, bits * 2.3283064365386963e-10f);
+}
+
+Vector3f importanceSampleGGX(const Vector2f &xi, float roughness)
+{
+    float a = roughness * roughness,
+        phi = 2.f * M_PI * xi[0],
+        cosTheta = sqrt((1.f - xi[1]) / (1.f + (a * a - 1.f) * xi[1])),
+        sinTheta = sqrt(1.f - cosTheta * cosTheta);
+    return Vector3f(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+/**
+ * Shared by the equirect and cube map sources : `image` gives the solid
+ * angle of the source texels around each sample, and `mirrorLod` is the
+ * source level to read the roughness 0 level from.
+ */
+template<class Image, class Pyramid>
+static vector<EquirectImage> prefilterSpecular(const Image &image, const Pyramid &source, float mirrorLod,
+    int width, int height, int levels, int samples)
+{
+    vector<EquirectImage> chain;
+    // The first Hammersley point is the normal, which keeps every texel's
+    // weight positive as long as there is a sample
+    samples = max(1, samples);
+    
+    for(int level = 0; level < levels; level++)
+    {
+        EquirectImage out(max(1, width >> level), max(1, height >> level));
+        float roughness = levels > 1 ? (float)level / (levels - 1) : 0.f;
+        bool mirror = roughness == 0.f;
+        
+        // With n = v the sample set is the same for every texel up to a rotation
+        vector<SpecularSample> set;
+        if(mirror)
+        {
+            SpecularSample s = { Vector3f(0.f, 0.f, 1.f), 1.f, max(0.f, mirrorLod) };
+            set.push_back(s);
+        }
+        else
+        {
+            float a2 = pow(roughness, 4.f);
+            for(int i = 0; i < samples; i++)
+            {
+                Vector3f h = importanceSampleGGX(hammersley(i, samples), roughness),
+                    l = 2.f * h[2] * h - Vector3f(0.f, 0.f, 1.f);
+                if(l[2] <= 0.f)
+                    continue;
+                // pdf(l) = D * nh / (4 * vh), and nh = vh here
+                float d = h[2] * h[2] * (a2 - 1.f) + 1.f,
+                    pdf = a2 / (M_PI * d * d) / 4.f,
+                    sampleSolidAngle = 1.f / (samples * pdf);
+                // The texel footprint is divided out per direction in the loop below
+                SpecularSample s = { l, l[2], .5f * log2f(sampleSolidAngle) + 1.f };
+                set.push_back(s);
+            }
+        }
+        
+        parallelFor(0, out.height, [&](int begin, int end)
+        {
+            for(int y = begin; y < end; y++)
+            {
+                float *p = out.row(y);
+                for(int x = 0; x < out.width; x++)
+                {
+                    Vector3f n = out.texelDirection(x, y), t, b, color = Vector3f::Zero();
+                    tangentFrame(n, t, b);
+                    float weight = 0.f;
+                    for(const SpecularSample &s : set)
+                    {
+                        Vector3f l = t * s.l[0] + b * s.l[1] + n * s.l[2];
+                        float lod = mirror ? s.lod : s.lod - .5f * log2f(image.texelSolidAngle(l));
+                        color += source.sample(l, lod) * s.nl;
+                        weight += s.nl;
+                    }
+                    color /= weight;
+                    p[3 * x] = color[0];
+                    p[3 * x + 1] = color[1];
+                    p[3 * x + 2] = color[2];
+                }
+            }
+        });
+        chain.push_back(out);
+    }
+    return chain;
+}
+
+vector<EquirectImage> bakeSpecular(const EquirectImage &environment, int width, int height, int levels, int samples)
+{
+    EquirectPyramid source(environment);
+    return prefilterSpecular(environment, source, log2f((float)environment.width / width), width, height, levels, samples);
+}
+
+vector<EquirectImage> bakeSpecular(const CubeMapImage &environment, int width, int height, int levels, int samples)
+{
+    CubeMapPyramid source(environment);
+    // 4 faces span the equator
+    return prefilterSpecular(environment, source, log2f(4.f * environment.size / width), width, height, levels, samples);
+}
+
+Vector3f referenceIrradiance(const EnvironmentSampler &sampler, const Vector3f &normal, int samples)
+{
+    Vector3f sum = Vector3f::Zero();
+    for(int i = 0; i < samples; i++)
+    {
+        EnvironmentSample s = sampler.sample(hammersley(i, samples));
+        float nl = normal.dot(s.direction);
+        if(nl > 0.f && s.pdf > 0.f)
+            sum += s.radiance * (nl / s.pdf);
+    }
+    return sum / samples;
+}
+
+Vector3f referenceSpecular(const EnvironmentSampler &sampler, const Vector3f &r, float roughness, int samples)
+{
+    float a2 = max(1e-6f, roughness * roughness * roughness * roughness);
+    Vector3f sum = Vector3f::Zero();
+    float weights = 0.f;
+    for(int i = 0; i < samples; i++)
+    {
+        EnvironmentSample s = sampler.sample(hammersley(i, samples));
+        float nl = r.dot(s.direction);
+        if(nl <= 0.f || s.pdf <= 0.f)
+            continue;
+        // Same weighting as the prefilter, D(h) (n.l), up to a constant
+        float nh = r.dot((r + s.direction).normalized()), d = nh * nh * (a2 - 1.f) + 1.f,
+            w = a2 / (d * d) * nl / s.pdf;
+        sum += s.radiance * w;
+        weights += w;
+    }
+    return weights > 0.f ? Vector3f(sum / weights) : Vector3f::Zero();
+}
+
+vector<float> bakeBRDFLUT(int size, int samples)
+{
+    vector<float> lut(size * size * 2);
+    parallelFor(0, size, [&](int begin, int end)
+    {
+        for(int j = begin; j < end; j++)
+        {
+            float roughness = (j + .5f) / size,
+                // Same remapping as brdf() in modelFragment.glsl
+                k = (roughness * roughness + 1.f) / 8.f;
+            for(int i = 0; i < size; i++)
+            {
+                float nv = (i + .5f) / size, scale = 0.f, bias = 0.f;
+                Vector3f v(sqrt(1.f - nv * nv), 0.f, nv);
+                for(int s = 0; s < samples; s++)
+                {
+                    Vector3f h = importanceSampleGGX(hammersley(s, samples), roughness);
+                    float vh = v.dot(h);
+                    Vector3f l = 2.f * vh * h - v;
+                    float nl = l[2], nh = h[2];
+                    if(nl <= 0.f)
+                        continue;
+                    vh = max(vh, 1e-5f);
+                    // G * vh / (nh * nv) is the BRDF over the GGX pdf, once D cancels out
+                    float g = nv / (nv * (1.f - k) + k) * nl / (nl * (1.f - k) + k),
+                        gVis = g * vh / (nh * nv),
+                        fc = exp2f((-5.55473f * vh - 6.98316f) * vh);
+                    scale += (1.f - fc) * gVis;
+                    bias += fc * gVis;
+                }
+                lut[2 * (j * size + i)] = scale / samples;
+                lut[2 * (j * size + i) + 1] = bias / samples;
+            }
+        }
+    });
+    return lut;
+}
+
+vector<float> loadOrBakeBRDFLUT(const string &path, int size, int samples)
+{
+    const char magic[4] = { 'B', 'R', 'D', 'F' };
+    int32_t header[2] = { size, samples };
+    vector<float> lut(size * size * 2);
+    
+    ifstream ifs(path, ios_base::in | ios_base::binary);
+    if(ifs)
+    {
+        char fileMagic[4];
+        int32_t fileHeader[2];
+        ifs.read(fileMagic, sizeof(fileMagic));
+        ifs.read((char *)fileHeader, sizeof(fileHeader));
+        if(ifs && !memcmp(fileMagic, magic, sizeof(magic)) && !memcmp(fileHeader, header, sizeof(header)))
+        {
+            ifs.read((char *)lut.data(), lut.size() * sizeof(float));
+            if(ifs)
+                return lut;
+        }
+        trace("Ignoring stale BRDF table " << path);
+    }
+    
+    lut = bakeBRDFLUT(size, samples);
+    ofstream ofs(path, ios_base::out | ios_base::binary);
+    ofs.write(magic, sizeof(magic));
+    ofs.write((const char *)header, sizeof(header));
+    ofs.write((const char *)lut.data(), lut.size() * sizeof(float));
+    if(!ofs)
+        trace("Couldn't write BRDF table to " << path);
+    return lut;
+}
+
+IBLBakeParams IBLBakeParams::resolved(int environmentWidth, int environmentHeight) const
+{
+    IBLBakeParams p = *this;
+    if(p.irradianceWidth <= 0)
+        p.irradianceWidth = environmentWidth;
+    if(p.irradianceHeight <= 0)
+        p.irradianceHeight = environmentHeight;
+    if(p.specularWidth <= 0)
+        p.specularWidth = min(environmentWidth, 512);
+    if(p.specularHeight <= 0)
+        p.specularHeight = max(1, p.specularWidth / 2);
+    if(p.specularLevels <= 0)
+        p.specularLevels = max(1, (int)log2(p.specularWidth) - 2);
+    return p;
+}
+
+// Backing memory of freshly baked IBLData
+struct BakedIBLStorage
+{
+    vector<float> irradiance, brdf;
+    vector<EquirectImage> specular;
+};
+
+static ImageView makeView(int width, int height, int channels, const vector<float> &data)
+{
+    ImageView view;
+    view.width = width;
+    view.height = height;
+    view.channels = channels;
+    view.data = data.data();
+    return view;
+}
+
+shared_ptr<IBLData> bakeIBL(const EquirectImage &environment, const IBLBakeParams &params, const string &brdfCachePath,
+    const CubeMapImage *cubeMap)
+{
+    shared_ptr<IBLData> data = make_shared<IBLData>();
+    shared_ptr<BakedIBLStorage> storage = make_shared<BakedIBLStorage>();
+    const IBLBakeParams &p = data->params = params.resolved(environment.width, environment.height);
+    
+    data->irradianceSH = projectEquirectSH(environment.pixels.data(), environment.width, environment.height);
+    convolveSHCosine(data->irradianceSH);
+    storage->irradiance.resize(p.irradianceWidth * p.irradianceHeight * 3);
+    renderEquirectSH(data->irradianceSH, p.irradianceWidth, p.irradianceHeight, storage->irradiance.data());
+    data->irradiance = makeView(p.irradianceWidth, p.irradianceHeight, 3, storage->irradiance);
+    
+    if(p.cubeMapSize > 0)
+    {
+        CubeMapImage cube = cubeMap ? *cubeMap : CubeMapImage::fromEquirect(environment, p.cubeMapSize);
+        storage->specular = bakeSpecular(cube, p.specularWidth, p.specularHeight, p.specularLevels, p.specularSamples);
+    }
+    else
+        storage->specular = bakeSpecular(environment, p.specularWidth, p.specularHeight, p.specularLevels, p.specularSamples);
+    for(const EquirectImage &level : storage->specular)
+        data->specular.push_back(makeView(level.width, level.height, 3, level.pixels));
+    
+    storage->brdf = brdfCachePath.empty() ? bakeBRDFLUT(p.brdfSize, p.brdfSamples)
+        : loadOrBakeBRDFLUT(brdfCachePath, p.brdfSize, p.brdfSamples);
+    data->brdf = makeView(p.brdfSize, p.brdfSize, 2, storage->brdf);
+    
+    data->storage = storage;
+    return data;
+}
+
+}
@@ -0,0 +1,216 @@
+#include "IBLCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+static const char CACHE_MAGIC[4] = { 'I', 'B', 'L', 'C' };
+// Bump whenever the layout or the baking code changes
+static const uint32_t CACHE_VERSION = 2;
+static const uint64_t SECTION_ALIGNMENT = 64;
+
+enum
+{
+    SECTION_IRRADIANCE,
+    SECTION_SPECULAR,
+    SECTION_BRDF
+};
+
+struct CacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    IBLBakeParams params;
+    float irradianceSH[SH_COEFFICIENTS * 3];
+    uint32_t sections;
+};
+
+struct CacheSection
+{
+    uint32_t kind;
+    int32_t width, height, channels;
+    uint64_t offset, size;
+};
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t invLight::hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint64_t k1 = 0x9E3779B97F4A7C15ull, k2 = 0xC2B2AE3D27D4EB4Full;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = seed ^ (size * k1), w;
+    for(; size >= 8; p += 8, size -= 8)
+    {
+        memcpy(&w, p, 8);
+        h = rotl(h ^ (w * k1), 31) * k2;
+    }
+    if(size > 0)
+    {
+        w = 0;
+        memcpy(&w, p, size);
+        h = rotl(h ^ (w * k1), 31) * k2;
+    }
+    // Final avalanche, from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t invLight::hashFile(const string &path)
+{
+    MappedFile file(path);
+    if(!file.valid())
+        fatal("Couldn't map file " << path);
+    // Hash 1 MiB chunks independently, then hash the chunk hashes
+    const size_t chunkSize = 1 << 20;
+    int chunks = (file.size() + chunkSize - 1) / chunkSize;
+    vector<uint64_t> hashes(chunks);
+    parallelFor(0, chunks, [&](int begin, int end)
+    {
+        for(int i = begin; i < end; i++)
+            hashes[i] = hashBytes(file.data() + i * chunkSize, min(chunkSize, file.size() - i * chunkSize), i);
+    });
+    return hashBytes(hashes.data(), hashes.size() * sizeof(uint64_t), file.size());
+}
+
+IBLCache::IBLCache(const string &directory) : _directory(directory)
+{
+    struct stat st;
+    if(stat(directory.c_str(), &st) != 0 && mkdir(directory.c_str(), 0755) != 0)
+        trace("Couldn't create cache directory " << directory);
+}
+
+uint64_t IBLCache::key(const string &hdrPath, const IBLBakeParams &params)
+{
+    return hashBytes(&params, sizeof(params), hashFile(hdrPath) ^ CACHE_VERSION);
+}
+
+string IBLCache::pathFor(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.ibl", (unsigned long long)key);
+    return _directory + "/" + name;
+}
+
+shared_ptr<IBLData> IBLCache::load(uint64_t key) const
+{
+    string path = pathFor(key);
+    shared_ptr<MappedFile> file = make_shared<MappedFile>(path);
+    if(!file->valid())
+        return nullptr;
+    
+    CacheHeader header;
+    if(file->size() < sizeof(header))
+    {
+        trace("Ignoring truncated IBL cache entry " << path);
+        return nullptr;
+    }
+    memcpy(&header, file->data(), sizeof(header));
+    if(memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || header.version != CACHE_VERSION || header.key != key
+        || file->size() < sizeof(header) + header.sections * sizeof(CacheSection))
+    {
+        trace("Ignoring stale IBL cache entry " << path);
+        return nullptr;
+    }
+    
+    shared_ptr<IBLData> data = make_shared<IBLData>();
+    data->params = header.params;
+    memcpy(data->irradianceSH.data(), header.irradianceSH, sizeof(header.irradianceSH));
+    for(uint32_t i = 0; i < header.sections; i++)
+    {
+        CacheSection section;
+        memcpy(&section, file->data() + sizeof(header) + i * sizeof(section), sizeof(section));
+        if(section.offset + section.size > file->size()
+            || section.size != (uint64_t)section.width * section.height * section.channels * sizeof(float))
+        {
+            trace("Ignoring corrupted IBL cache entry " << path);
+            return nullptr;
+        }
+        ImageView view;
+        view.width = section.width;
+        view.height = section.height;
+        view.channels = section.channels;
+        view.data = (const float *)(file->data() + section.offset);
+        if(section.kind == SECTION_IRRADIANCE)
+            data->irradiance = view;
+        else if(section.kind == SECTION_SPECULAR)
+            data->specular.push_back(view);
+        else if(section.kind == SECTION_BRDF)
+            data->brdf = view;
+    }
+    data->storage = file;
+    return data;
+}
+
+void IBLCache::store(uint64_t key, const IBLData &data) const
+{
+    vector<CacheSection> sections;
+    vector<const float *> sources;
+    auto addSection = [&](uint32_t kind, const ImageView &view)
+    {
+        CacheSection section;
+        section.kind = kind;
+        section.width = view.width;
+        section.height = view.height;
+        section.channels = view.channels;
+        section.size = (uint64_t)view.width * view.height * view.channels * sizeof(float);
+        sections.push_back(section);
+        sources.push_back(view.data);
+    };
+    addSection(SECTION_IRRADIANCE, data.irradiance);
+    for(const ImageView &level : data.specular)
+        addSection(SECTION_SPECULAR, level);
+    addSection(SECTION_BRDF, data.brdf);
+    
+    auto align = [](uint64_t offset) { return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT; };
+    uint64_t offset = align(sizeof(CacheHeader) + sections.size() * sizeof(CacheSection));
+    for(CacheSection &section : sections)
+    {
+        section.offset = offset;
+        offset = align(offset + section.size);
+    }
+    
+    // Value-initialized, which zeroes the padding written to the file too
+    CacheHeader header = CacheHeader();
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.params = data.params;
+    memcpy(header.irradianceSH, data.irradianceSH.data(), sizeof(header.irradianceSH));
+    header.sections = sections.size();
+    
+    // Write to a temporary file first so that readers never map a partial entry
+    string path = pathFor(key), tmpPath = path + ".tmp";
+    ofstream ofs(tmpPath, ios_base::out | ios_base::binary | ios_base::trunc);
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)sections.data(), sections.size() * sizeof(CacheSection));
+    uint64_t position = sizeof(header) + sections.size() * sizeof(CacheSection);
+    const char padding[SECTION_ALIGNMENT] = { 0 };
+    for(unsigned int i = 0; i < sections.size(); i++)
+    {
+        ofs.write(padding, sections[i].offset - position);
+        ofs.write((const char *)sources[i], sections[i].size);
+        position = sections[i].offset + sections[i].size;
+    }
+    ofs.close();
+    if(!ofs || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        trace("Couldn't write IBL cache entry " << path);
+        remove(tmpPath.c_str());
+    }
+}
@@ -0,0 +1,54 @@
+#include "IlluminationBrush.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glad/glad.h>
+
+using namespace invLight;
+using namespace std;
+
+int IlluminationBrush::paint(float x, float y, const Matrix4f &viewProjection, const Vector3f &eye, int width, int height)
+{
+    _painted.clear();
+    // Window coordinates start from the bottom left corner
+    y = height - y;
+    int x0 = max(0, (int)floor(x - radius)), y0 = max(0, (int)floor(y - radius)),
+        x1 = min(width, (int)ceil(x + radius) + 1), y1 = min(height, (int)ceil(y + radius) + 1);
+    if(x0 >= x1 || y0 >= y1)
+        return 0;
+    
+    // Only the brush's footprint of the depth buffer
+    int w = x1 - x0;
+    _depths.resize(w * (y1 - y0));
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(x0, y0, w, y1 - y0, GL_DEPTH_COMPONENT, GL_FLOAT, _depths.data());
+    
+    Vector3f target = color * intensity;
+    for(int i = 0; i < _geometry.vertexCount(); i++)
+    {
+        const Vector3f &position = _geometry.positions[i];
+        if(_geometry.normals[i].dot(eye - position) <= 0.f)
+            continue;
+        Vector4f clip = viewProjection * position.homogeneous();
+        if(clip[3] <= 0.f)
+            continue;
+        Vector3f ndc = clip.head<3>() / clip[3];
+        float px = (ndc[0] * .5f + .5f) * width, py = (ndc[1] * .5f + .5f) * height,
+            dx = px - x, dy = py - y, d2 = (dx * dx + dy * dy) / (radius * radius);
+        int ix = px, iy = py;
+        if(d2 >= 1.f || ix < x0 || ix >= x1 || iy < y0 || iy >= y1)
+            continue;
+        // Vertices lie on the rasterized surface, up to the depth buffer's
+        // precision and to the interpolation across their neighbors
+        float depth = ndc[2] * .5f + .5f;
+        if(depth > _depths[(iy - y0) * w + ix - x0] + 1e-3f)
+            continue;
+        float falloff = 1.f - d2;
+        _solver.addConstraint(i, target, falloff * falloff);
+        _painted.push_back(make_pair(i, falloff * falloff));
+    }
+    if(!_painted.empty())
+        _solver.solve();
+    return _painted.size();
+}
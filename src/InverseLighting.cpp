@@ -0,0 +1,449 @@
+#include "InverseLighting.h"
+
+#include <chrono>
+#include <limits>
+
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+// The factor of the normal equations is recomputed once the total weight,
+// which scales the prior's penalty, changed by more than this ratio
+static const double REFACTOR_WEIGHT_RATIO = 1.25;
+// Conjugate gradient iterations making up for the difference meanwhile,
+// and the residual they stop at, relative to the right-hand side
+static const int MAX_CG_ITERATIONS = 16;
+static const double CG_TOLERANCE = 1e-9;
+// Directions the radiance is kept non-negative towards, per SH coefficient
+static const int DIRECTIONS_PER_COEFFICIENT = 4;
+// Directions the active set method may hold at zero radiance in turn, and
+// the slope below which it stops, relative to the largest at 0
+static const int MAX_NNLS_ITERATIONS = 1000;
+static const double NNLS_TOLERANCE = 1e-9;
+
+// Factor the cosine convolution applies to each coefficient
+template<int Order>
+static Matrix<float, SH<Order>::COEFFICIENTS, 1> cosineLobe()
+{
+    typename SH<Order>::Coefficients ones = SH<Order>::Coefficients::Ones();
+    SH<Order>::convolveCosine(ones);
+    return ones.col(0);
+}
+
+template<int Order>
+InverseLightingSolver<Order>::InverseLightingSolver(const vector<Vector3f> &normals, const InverseLightingOptions &options) :
+    _options(options),
+    _transfer(diffuseTransfer(normals)),
+    _constraintIndices(normals.size(), -1),
+    _gram(NormalMatrix::Zero()),
+    _moment(Matrix<double, COEFFICIENTS, 3>::Zero()),
+    _prior(Coefficients::Zero()),
+    _radiance(Coefficients::Zero())
+{
+    // Fibonacci lattice, spread evenly over the sphere
+    const int n = DIRECTIONS_PER_COEFFICIENT * COEFFICIENTS;
+    _directions.resize((int)COEFFICIENTS, n);
+    Matrix<float, COEFFICIENTS, 1> basis;
+    for(int i = 0; i < n; i++)
+    {
+        float y = 1.f - (2.f * i + 1.f) / n, r = sqrt(1.f - y * y), phi = i * M_PI * (3. - sqrt(5.));
+        Basis::evalBasis(Vector3f(r * cos(phi), y, r * sin(phi)), basis.data());
+        _directions.col(i) = basis.template cast<double>();
+    }
+}
+
+template<int Order>
+typename InverseLightingSolver<Order>::TransferMatrix InverseLightingSolver<Order>::diffuseTransfer(const vector<Vector3f> &normals)
+{
+    Matrix<float, COEFFICIENTS, 1> lobe = cosineLobe<Order>() / M_PI;
+    TransferMatrix transfer(normals.size(), (int)COEFFICIENTS);
+    for(unsigned int i = 0; i < normals.size(); i++)
+    {
+        Basis::evalBasis(normals[i], transfer.row(i).data());
+        transfer.row(i) = transfer.row(i).cwiseProduct(lobe.transpose());
+    }
+    return transfer;
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::setTransfer(const TransferMatrix &transfer)
+{
+    if(transfer.rows() != (int)_constraintIndices.size())
+        fatal("Expected a transfer for " << _constraintIndices.size() << " vertices, got " << transfer.rows());
+    _transfer = transfer;
+    _compressedTransfer = CompressedTransfer<Order>();
+    rebuild();
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::setTransfer(const CompressedTransfer<Order> &transfer)
+{
+    if(transfer.vertexCount() != (int)_constraintIndices.size())
+        fatal("Expected a transfer for " << _constraintIndices.size() << " vertices, got " << transfer.vertexCount());
+    _compressedTransfer = transfer;
+    _transfer.resize(0, (int)COEFFICIENTS);
+    rebuild();
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::setPrior(const Coefficients &radiance)
+{
+    _prior = radiance;
+    if(_constraints.empty())
+        solve();
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::setPriorIrradiance(const Coefficients &irradiance)
+{
+    Matrix<float, COEFFICIENTS, 1> lobe = cosineLobe<Order>();
+    Coefficients radiance;
+    for(int k = 0; k < COEFFICIENTS; k++)
+        radiance.row(k) = lobe[k] > 1e-6f ? Matrix<float, 1, 3>(irradiance.row(k) / lobe[k]) : Matrix<float, 1, 3>::Zero();
+    setPrior(radiance);
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::addConstraint(int vertex, const Vector3f &target, float weight)
+{
+    if(vertex < 0 || vertex >= (int)_constraintIndices.size())
+        fatal("Vertex " << vertex << " is out of the " << _constraintIndices.size() << " vertices");
+    if(weight <= 0.f)
+        return;
+    Constraint constraint = { vertex, target, weight };
+    int &index = _constraintIndices[vertex];
+    if(index < 0)
+    {
+        index = _constraints.size();
+        _constraints.push_back(constraint);
+    }
+    else
+    {
+        accumulate(_constraints[index], -1.);
+        _constraints[index] = constraint;
+    }
+    accumulate(constraint, 1.);
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::clearConstraints()
+{
+    for(const Constraint &constraint : _constraints)
+        _constraintIndices[constraint.vertex] = -1;
+    _constraints.clear();
+    _gram.setZero();
+    _moment.setZero();
+    _totalWeight = 0.;
+    _factored = false;
+    _multipliers.resize(0, 3);
+    solve();
+}
+
+template<int Order>
+typename InverseLightingSolver<Order>::Row InverseLightingSolver<Order>::row(int vertex) const
+{
+    if(!_compressedTransfer.empty())
+        return _compressedTransfer.row(vertex);
+    return _transfer.row(vertex);
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::accumulate(const Constraint &constraint, double sign)
+{
+    Matrix<double, COEFFICIENTS, 1> a = row(constraint.vertex).transpose().template cast<double>();
+    double weight = sign * constraint.weight;
+    _gram.template selfadjointView<Lower>().rankUpdate(a, weight);
+    _moment.noalias() += weight * a * constraint.target.transpose().template cast<double>();
+    _totalWeight += weight;
+    // An update can't fail, a downdate can lose definiteness to rounding
+    if(_factored)
+        _factored = _factorization.rankUpdate(a, weight).info() == Success;
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::rebuild()
+{
+    _gram.setZero();
+    _moment.setZero();
+    _totalWeight = 0.;
+    _factored = false;
+    for(const Constraint &constraint : _constraints)
+        _totalWeight += constraint.weight;
+    if(_constraints.empty())
+        return;
+    if(_compressedTransfer.empty())
+    {
+        // Rows and targets scaled by the square root of their weight, so
+        // that the normal equations are a single product
+        const int n = _constraints.size();
+        Matrix<float, Dynamic, COEFFICIENTS> rows(n, (int)COEFFICIENTS);
+        Matrix<float, Dynamic, 3> targets(n, 3);
+        for(int i = 0; i < n; i++)
+        {
+            const Constraint &constraint = _constraints[i];
+            float s = sqrt(constraint.weight);
+            rows.row(i) = s * _transfer.row(constraint.vertex);
+            targets.row(i) = s * constraint.target.transpose();
+        }
+        _gram = (rows.transpose() * rows).template cast<double>();
+        _moment = (rows.transpose() * targets).template cast<double>();
+        return;
+    }
+    // Gram matrix of the painted coordinates in each cluster, and their
+    // products with the targets, then mapped to coefficients once per
+    // painted cluster
+    const int stride = _compressedTransfer.basisSize() + 1, clusters = _compressedTransfer.clusterCount();
+    MatrixXd grams = MatrixXd::Zero(clusters * stride, stride), targets = MatrixXd::Zero(clusters * stride, 3);
+    vector<bool> painted(clusters, false);
+    // Sized at run time, without allocating
+    Matrix<double, Dynamic, 1, ColMajor, COEFFICIENTS + 1, 1> x(stride);
+    x[0] = 1.;
+    for(const Constraint &constraint : _constraints)
+    {
+        int c = _compressedTransfer.cluster(constraint.vertex);
+        x.tail(stride - 1) = _compressedTransfer.weights().row(constraint.vertex).transpose().template cast<double>();
+        grams.middleRows(c * stride, stride).template selfadjointView<Lower>().rankUpdate(x, constraint.weight);
+        targets.middleRows(c * stride, stride).noalias() += constraint.weight * x * constraint.target.transpose().template cast<double>();
+        painted[c] = true;
+    }
+    for(int c = 0; c < clusters; c++)
+        if(painted[c])
+        {
+            Matrix<double, Dynamic, COEFFICIENTS> rows = _compressedTransfer.clusterRows(c).template cast<double>();
+            _gram.noalias() += rows.transpose() * grams.middleRows(c * stride, stride).template selfadjointView<Lower>() * rows;
+            _moment.noalias() += rows.transpose() * targets.middleRows(c * stride, stride);
+        }
+}
+
+template<int Order>
+const typename InverseLightingSolver<Order>::Coefficients& InverseLightingSolver<Order>::solve()
+{
+    auto start = chrono::steady_clock::now();
+    if(_constraints.empty() && !_options.nonNegative)
+        _radiance = _prior;
+    else
+    {
+        // The prior's penalty, proportional to the total weight. Without
+        // constraints, only non-negative solves get here, which project the
+        // prior onto non-negative lighting
+        double weight = _constraints.empty() ? 1. : _totalWeight;
+        Matrix<double, COEFFICIENTS, 1> penalty;
+        for(int l = 0; l <= Order; l++)
+        {
+            double d = 1. + l * (l + 1.);
+            penalty.segment(l * l, 2 * l + 1).setConstant(_options.regularization * d * d);
+        }
+        NormalMatrix normal = _gram;
+        normal.diagonal() += weight * penalty;
+        Matrix<double, COEFFICIENTS, 3> rhs = _moment + weight * penalty.asDiagonal() * _prior.template cast<double>();
+        if(_options.nonNegative)
+        {
+            solveNonNegative(normal, rhs);
+            chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+            _solveTime = elapsed.count();
+            return _radiance;
+        }
+        
+        double ratio = _totalWeight / _factoredWeight;
+        if(!_factored || ratio > REFACTOR_WEIGHT_RATIO || ratio < 1. / REFACTOR_WEIGHT_RATIO)
+            factor(normal);
+        Matrix<double, COEFFICIENTS, 3> solution;
+        if(!_factored || !refine(normal, rhs, solution))
+        {
+            factor(normal);
+            if(_factored)
+                solution = _factorization.solve(rhs);
+            else
+                solution = normal.ldlt().solve(rhs);
+        }
+        _radiance = solution.template cast<float>();
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    _solveTime = elapsed.count();
+    return _radiance;
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::factor(const NormalMatrix &normal)
+{
+    _factorization.compute(normal);
+    _factored = _factorization.info() == Success;
+    _factoredWeight = _totalWeight;
+}
+
+template<int Order>
+bool InverseLightingSolver<Order>::refine(const NormalMatrix &normal, const Matrix<double, COEFFICIENTS, 3> &rhs,
+    Matrix<double, COEFFICIENTS, 3> &solution) const
+{
+    solution = _factorization.solve(rhs);
+    if(_totalWeight == _factoredWeight)
+        return true;
+    // Conjugate gradients on each channel, preconditioned by the factor of
+    // the matrix they differ from by a diagonal
+    for(int j = 0; j < 3; j++)
+    {
+        typedef Matrix<double, COEFFICIENTS, 1> Vector;
+        Vector r = rhs.col(j) - normal.template selfadjointView<Lower>() * solution.col(j), z = _factorization.solve(r), p = z;
+        double rz = r.dot(z), tolerance = CG_TOLERANCE * CG_TOLERANCE * rhs.col(j).squaredNorm();
+        int i = 0;
+        for(; i < MAX_CG_ITERATIONS && r.squaredNorm() > tolerance; i++)
+        {
+            Vector q = normal.template selfadjointView<Lower>() * p;
+            double alpha = rz / p.dot(q);
+            solution.col(j) += alpha * p;
+            r -= alpha * q;
+            z = _factorization.solve(r);
+            double next = r.dot(z);
+            p = z + next / rz * p;
+            rz = next;
+        }
+        if(i == MAX_CG_ITERATIONS)
+            return false;
+    }
+    return true;
+}
+
+template<int Order>
+typename InverseLightingSolver<Order>::Coefficients InverseLightingSolver<Order>::irradiance() const
+{
+    Coefficients irradiance = _radiance;
+    Basis::convolveCosine(irradiance);
+    return irradiance;
+}
+
+template<int Order>
+Vector3f InverseLightingSolver<Order>::shading(int vertex) const
+{
+    if(!_compressedTransfer.empty())
+        return (_compressedTransfer.row(vertex) * _radiance).transpose();
+    return (_transfer.row(vertex) * _radiance).transpose();
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::shading(vector<Vector3f> &radiances) const
+{
+    if(!_compressedTransfer.empty())
+    {
+        _compressedTransfer.shade(_radiance, radiances);
+        return;
+    }
+    Matrix<float, Dynamic, 3, RowMajor> shaded = _transfer * _radiance;
+    radiances.resize(shaded.rows());
+    for(int i = 0; i < shaded.rows(); i++)
+        radiances[i] = shaded.row(i).transpose();
+}
+
+template<int Order>
+void InverseLightingSolver<Order>::solveNonNegative(const NormalMatrix &normal, const Matrix<double, COEFFICIENTS, 3> &rhs)
+{
+    // With N = R R^T and Y the basis towards each direction, minimizing
+    // 1/2 L^T N L - b^T L under Y^T L >= 0 is the dual problem of finding
+    // the multipliers m >= 0 minimizing |R^-1 (b + Y m)|², then
+    // L = R^-T R^-1 (b + Y m) : a non-negative least squares problem with
+    // as many rows as coefficients
+    LLT<NormalMatrix> factorization(normal);
+    if(factorization.info() != Success)
+    {
+        _radiance = _prior;
+        _iterations = 0;
+        return;
+    }
+    const int n = _directions.cols();
+    Matrix<double, COEFFICIENTS, Dynamic> system = -factorization.matrixL().solve(_directions);
+    Matrix<double, COEFFICIENTS, 3> targets = factorization.matrixL().solve(rhs);
+    if(_multipliers.rows() != n)
+        _multipliers = Matrix<double, Dynamic, 3>::Zero(n, 3);
+    
+    // Lawson and Hanson's active set method on each channel, from the
+    // directions the last solve held at zero rather than from none
+    _iterations = 0;
+    Matrix<double, COEFFICIENTS, Dynamic> columns;
+    vector<int> passive;
+    // Variables that left the passive set as soon as they entered it, which
+    // degenerate directions can do forever : they aren't added again until
+    // the residual drops
+    vector<bool> rejected;
+    Matrix<double, COEFFICIENTS, 3> residuals;
+    for(int j = 0; j < 3; j++)
+    {
+        VectorXd x = _multipliers.col(j);
+        Matrix<double, COEFFICIENTS, 1> f = targets.col(j), residual;
+        double tolerance = NNLS_TOLERANCE * (system.transpose() * f).cwiseAbs().maxCoeff(),
+            previous = numeric_limits<double>::infinity();
+        rejected.assign(n, false);
+        int added = -1;
+        for(int outer = 0; outer < MAX_NNLS_ITERATIONS; outer++)
+        {
+            // Least squares over the passive set, stepping back towards the
+            // last feasible point while that turns a passive variable negative
+            while(true)
+            {
+                passive.clear();
+                for(int i = 0; i < n; i++)
+                    if(x[i] > 0.)
+                        passive.push_back(i);
+                if(passive.empty())
+                    break;
+                columns.resize((int)COEFFICIENTS, passive.size());
+                for(unsigned int k = 0; k < passive.size(); k++)
+                    columns.col(k) = system.col(passive[k]);
+                VectorXd z = columns.colPivHouseholderQr().solve(f);
+                _iterations++;
+                double alpha = 1.;
+                int blocking = -1;
+                for(unsigned int k = 0; k < passive.size(); k++)
+                    if(z[k] <= 0.)
+                    {
+                        double a = x[passive[k]] / (x[passive[k]] - z[k]);
+                        if(a < alpha)
+                        {
+                            alpha = a;
+                            blocking = passive[k];
+                        }
+                    }
+                for(unsigned int k = 0; k < passive.size(); k++)
+                    x[passive[k]] += alpha * (z[k] - x[passive[k]]);
+                if(blocking < 0)
+                    break;
+                x[blocking] = 0.;
+            }
+            residual = f - system * x;
+            double norm = residual.squaredNorm();
+            if(norm < previous)
+                fill(rejected.begin(), rejected.end(), false);
+            else if(added >= 0 && x[added] <= 0.)
+                rejected[added] = true;
+            previous = min(previous, norm);
+            // Into the passive set goes the active variable the objective
+            // decreases fastest along, if any : the direction the radiance
+            // is the most negative towards
+            VectorXd w = system.transpose() * residual;
+            int best = -1;
+            for(int i = 0; i < n; i++)
+                if(x[i] <= 0. && !rejected[i] && w[i] > tolerance && (best < 0 || w[i] > w[best]))
+                    best = i;
+            if(best < 0)
+                break;
+            // Barely positive, for the least squares to include it
+            x[best] = numeric_limits<double>::min();
+            added = best;
+        }
+        _multipliers.col(j) = x;
+        residuals.col(j) = f - system * x;
+    }
+    _radiance = factorization.matrixU().solve(residuals).template cast<float>();
+}
+
+namespace invLight
+{
+
+template class InverseLightingSolver<2>;
+template class InverseLightingSolver<3>;
+template class InverseLightingSolver<4>;
+template class InverseLightingSolver<5>;
+template class InverseLightingSolver<6>;
+template class InverseLightingSolver<7>;
+template class InverseLightingSolver<8>;
+
+}
@@ -0,0 +1,33 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace invLight;
+using namespace std;
+
+MappedFile::MappedFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED)
+        {
+            _data = p;
+            _size = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if(_data)
+        munmap(_data, _size);
+}
@@ -0,0 +1,218 @@
+#include "MedianCut.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+#include "Parallel.h"
+
+using namespace invLight;
+using namespace std;
+
+namespace
+{
+
+enum
+{
+    // RGB and luminance weighted by solid angle, then the luminance
+    // weighted by the texel's coordinates for centroids
+    SAT_R,
+    SAT_G,
+    SAT_B,
+    SAT_LUMINANCE,
+    SAT_X,
+    SAT_Y,
+    SAT_CHANNELS
+};
+
+/**
+ * Summed-area tables of all channels, interleaved. Entry (x, y) holds the
+ * sums over [0, x) x [0, y).
+ */
+class SummedAreaTable
+{
+public:
+    SummedAreaTable(const EquirectImage &image) :
+        _width(image.width),
+        _data((size_t)(image.width + 1) * (image.height + 1) * SAT_CHANNELS, 0.)
+    {
+        const int width = image.width, height = image.height;
+        // Prefix sums along rows, then down columns
+        parallelFor(0, height, [&](int begin, int end)
+        {
+            for(int y = begin; y < end; y++)
+            {
+                float solidAngle = 2.f * M_PI / width * (cos(y * M_PI / height) - cos((y + 1) * M_PI / height));
+                const float *rgb = image.row(y);
+                double *out = entry(0, y + 1);
+                for(int x = 0; x < width; x++, rgb += 3, out += SAT_CHANNELS)
+                {
+                    float luminance = max(0.f, .2126f * rgb[0] + .7152f * rgb[1] + .0722f * rgb[2]) * solidAngle;
+                    double texel[SAT_CHANNELS] = { rgb[0] * solidAngle, rgb[1] * solidAngle, rgb[2] * solidAngle,
+                        luminance, luminance * (x + .5), luminance * (y + .5) };
+                    for(int c = 0; c < SAT_CHANNELS; c++)
+                        out[SAT_CHANNELS + c] = out[c] + texel[c];
+                }
+            }
+        });
+        parallelFor(0, (width + 1) * SAT_CHANNELS, [&](int begin, int end)
+        {
+            for(int y = 1; y <= height; y++)
+            {
+                double *above = entry(0, y - 1), *row = entry(0, y);
+                for(int i = begin; i < end; i++)
+                    row[i] += above[i];
+            }
+        });
+    }
+    
+    double sum(int channel, int x0, int y0, int x1, int y1) const
+    {
+        return entry(x1, y1)[channel] - entry(x0, y1)[channel] - entry(x1, y0)[channel] + entry(x0, y0)[channel];
+    }
+private:
+    double *entry(int x, int y) { return &_data[((size_t)y * (_width + 1) + x) * SAT_CHANNELS]; }
+    const double *entry(int x, int y) const { return &_data[((size_t)y * (_width + 1) + x) * SAT_CHANNELS]; }
+    
+    int _width;
+    vector<double> _data;
+};
+
+struct Region
+{
+    // Texels [x0, x1) x [y0, y1)
+    int x0, y0, x1, y1;
+    double energy;
+    
+    bool operator<(const Region &other) const { return energy < other.energy; }
+};
+
+}
+
+// Splits `region` in two of equal energy along its longest angular side,
+// returning false if it's a single texel
+static bool split(const SummedAreaTable &sat, int width, int height, const Region &region, Region &a, Region &b)
+{
+    int w = region.x1 - region.x0, h = region.y1 - region.y0;
+    if(w == 1 && h == 1)
+        return false;
+    // Longitude spans shrink by sin(theta) away from the equator
+    float sinTheta = sin((region.y0 + region.y1) * .5f * M_PI / height);
+    bool alongX = h == 1 || (w > 1 && w * 2.f / width * sinTheta > h * 1.f / height);
+    int lo = alongX ? region.x0 + 1 : region.y0 + 1, hi = alongX ? region.x1 - 1 : region.y1 - 1;
+    auto firstPart = [&](int cut)
+    {
+        return alongX ? sat.sum(SAT_LUMINANCE, region.x0, region.y0, cut, region.y1)
+            : sat.sum(SAT_LUMINANCE, region.x0, region.y0, region.x1, cut);
+    };
+    // Smallest cut leaving at least half of the energy on the first side
+    double half = region.energy * .5;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(firstPart(mid) < half)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int cut = lo;
+    if(cut > (alongX ? region.x0 + 1 : region.y0 + 1) && half - firstPart(cut - 1) < firstPart(cut) - half)
+        cut--;
+    
+    a = b = region;
+    if(alongX)
+        a.x1 = b.x0 = cut;
+    else
+        a.y1 = b.y0 = cut;
+    a.energy = firstPart(cut);
+    b.energy = region.energy - a.energy;
+    return true;
+}
+
+// Box filter by `factor` in each dimension, in one pass over the source
+static EquirectImage reduce(const EquirectImage &image, int factor)
+{
+    EquirectImage reduced(max(1, image.width / factor), max(1, image.height / factor));
+    float scale = 1.f / (factor * factor);
+    parallelFor(0, reduced.height, [&](int begin, int end)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            float *out = reduced.row(y);
+            fill(out, out + 3 * reduced.width, 0.f);
+            for(int j = 0; j < factor; j++)
+            {
+                // reduced.width * factor never exceeds the source's width
+                const float *in = image.row(min(y * factor + j, image.height - 1));
+                for(int x = 0; x < reduced.width; x++)
+                    for(int i = 0; i < factor; i++, in += 3)
+                        for(int c = 0; c < 3; c++)
+                            out[3 * x + c] += in[c];
+            }
+            for(int x = 0; x < 3 * reduced.width; x++)
+                out[x] *= scale;
+        }
+    });
+    return reduced;
+}
+
+LightSet invLight::extractLights(const EquirectImage &environment, int count, int maxWidth)
+{
+    EquirectImage reduced;
+    const EquirectImage *image = &environment;
+    if(environment.width > maxWidth)
+    {
+        reduced = reduce(environment, (environment.width + maxWidth - 1) / maxWidth);
+        image = &reduced;
+    }
+    const int width = image->width, height = image->height;
+    SummedAreaTable sat(*image);
+    
+    priority_queue<Region> pending;
+    vector<Region> regions;
+    Region whole = { 0, 0, width, height, sat.sum(SAT_LUMINANCE, 0, 0, width, height) };
+    pending.push(whole);
+    while(!pending.empty() && (int)(pending.size() + regions.size()) < count)
+    {
+        Region region = pending.top(), a, b;
+        pending.pop();
+        if(split(sat, width, height, region, a, b))
+        {
+            pending.push(a);
+            pending.push(b);
+        }
+        else
+            regions.push_back(region);
+    }
+    for(; !pending.empty(); pending.pop())
+        regions.push_back(pending.top());
+    
+    LightSet set;
+    set.residualSH = projectEquirectSH(image->pixels.data(), width, height);
+    for(const Region &r : regions)
+    {
+        // Energy centroid, or the middle of a black region
+        double px = (r.x0 + r.x1) * .5, py = (r.y0 + r.y1) * .5;
+        if(r.energy > 0.)
+        {
+            px = sat.sum(SAT_X, r.x0, r.y0, r.x1, r.y1) / r.energy;
+            py = sat.sum(SAT_Y, r.x0, r.y0, r.x1, r.y1) / r.energy;
+        }
+        float phi = (px / width - .5) * 2. * M_PI, theta = py / height * M_PI;
+        DirectionalLight light;
+        light.direction = Vector3f(cos(phi) * sin(theta), cos(theta), -sin(phi) * sin(theta));
+        light.solidAngle = 2. * M_PI * (r.x1 - r.x0) / width * (cos(r.y0 * M_PI / height) - cos(r.y1 * M_PI / height));
+        Vector3f power(sat.sum(SAT_R, r.x0, r.y0, r.x1, r.y1), sat.sum(SAT_G, r.x0, r.y0, r.x1, r.y1),
+            sat.sum(SAT_B, r.x0, r.y0, r.x1, r.y1));
+        light.radiance = power / light.solidAngle;
+        set.lights.push_back(light);
+        
+        // A light's projection is its power times the basis in its direction
+        float basis[SH_COEFFICIENTS];
+        evalSHBasis(light.direction, basis);
+        for(int i = 0; i < SH_COEFFICIENTS; i++)
+            set.residualSH.row(i) -= basis[i] * power.transpose();
+    }
+    convolveSHCosine(set.residualSH);
+    return set;
+}
@@ -0,0 +1,80 @@
+#include "MeshGeometry.h"
+
+#include <cstring>
+
+#include "tiny_gltf.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+using namespace tinygltf;
+
+// Reads `accessor` as `components` floats per element, whatever its stride
+static void readFloats(const Model &model, const Accessor &accessor, int components, float *out)
+{
+    if(accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT || GetTypeSizeInBytes(accessor.type) != components)
+        fatal("Expected an accessor of " << components << " floats");
+    const BufferView &bufferView = model.bufferViews[accessor.bufferView];
+    const unsigned char *data = &model.buffers[bufferView.buffer].data[bufferView.byteOffset + accessor.byteOffset];
+    int stride = accessor.ByteStride(bufferView);
+    for(size_t i = 0; i < accessor.count; i++)
+        memcpy(out + i * components, data + i * stride, components * sizeof(float));
+}
+
+MeshGeometry MeshGeometry::fromGLTF(const Model &model)
+{
+    // Same primitive as ModelRenderContext::armForRendering()
+    const Scene &scene = model.scenes[model.defaultScene < 0 ? 0 : model.defaultScene];
+    const Primitive &primitive = model.meshes[model.nodes[scene.nodes[0]].mesh].primitives[0];
+    if((primitive.mode > -1 && primitive.mode != TINYGLTF_MODE_TRIANGLES) || primitive.indices < 0)
+        fatal("Only indexed triangles are supported");
+    auto position = primitive.attributes.find("POSITION"), normal = primitive.attributes.find("NORMAL");
+    if(position == primitive.attributes.end() || normal == primitive.attributes.end())
+        fatal("The primitive has no positions or no normals");
+    
+    MeshGeometry geometry;
+    const Accessor &positions = model.accessors[position->second], &normals = model.accessors[normal->second];
+    if(normals.count != positions.count)
+        fatal(positions.count << " positions for " << normals.count << " normals");
+    geometry.positions.resize(positions.count);
+    geometry.normals.resize(normals.count);
+    readFloats(model, positions, 3, geometry.positions[0].data());
+    readFloats(model, normals, 3, geometry.normals[0].data());
+    for(Vector3f &n : geometry.normals)
+        n.normalize();
+    
+    const Accessor &indices = model.accessors[primitive.indices];
+    const BufferView &bufferView = model.bufferViews[indices.bufferView];
+    const unsigned char *data = &model.buffers[bufferView.buffer].data[bufferView.byteOffset + indices.byteOffset];
+    int stride = indices.ByteStride(bufferView);
+    geometry.indices.resize(indices.count);
+    for(size_t i = 0; i < indices.count; i++)
+    {
+        const unsigned char *index = data + i * stride;
+        switch(indices.componentType)
+        {
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+            geometry.indices[i] = *index;
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+            geometry.indices[i] = *(const uint16_t *)index;
+            break;
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+            geometry.indices[i] = *(const uint32_t *)index;
+            break;
+        default:
+            fatal("Invalid index component type " << indices.componentType);
+        }
+        if(geometry.indices[i] >= positions.count)
+            fatal("Index " << geometry.indices[i] << " is out of the " << positions.count << " vertices");
+    }
+    return geometry;
+}
+
+AlignedBox3f MeshGeometry::bounds() const
+{
+    AlignedBox3f box;
+    for(const Vector3f &p : positions)
+        box.extend(p);
+    return box;
+}
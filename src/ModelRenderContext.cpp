@@ -175,16 +175,23 @@ void ModelRenderContext::armForRendering()
     }
 }
 
+MeshGeometry ModelRenderContext::geometry() const
+{
+    return MeshGeometry::fromGLTF(*this);
+}
+
 void ModelRenderContext::render()
 {
+    // Texture units below that are taken by the textures registered on the program
+    unsigned int firstUnit = _program.getTexturesAmount();
     for(unsigned int i = 0; i < _activeTextures.size(); i++)
     {
         if(_textureLocations[i] > -1)
         {
             int j = _activeTextures[i];
-            glActiveTexture(GL_TEXTURE0 + i);
+            glActiveTexture(GL_TEXTURE0 + firstUnit + i);
             glBindTexture(GL_TEXTURE_2D, _textureIds[j]);
-            glUniform1i(_textureLocations[i], i);
+            glUniform1i(_textureLocations[i], firstUnit + i);
         }
     }
     glBindBuffer(GL_ARRAY_BUFFER, _vbos[VERTEX_ARRAY_BUFFER]);
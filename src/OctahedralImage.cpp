@@ -0,0 +1,96 @@
+#include "OctahedralImage.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+#include "SIMDMath.h"
+
+using namespace invLight;
+using namespace std;
+
+static inline float signNotZero(float x)
+{
+    return x < 0.f ? -1.f : 1.f;
+}
+
+Vector2f OctahedralImage::encode(const Vector3f &dir)
+{
+    float l1 = fabs(dir[0]) + fabs(dir[1]) + fabs(dir[2]);
+    float x = dir[0] / l1, z = dir[2] / l1;
+    if(dir[1] < 0.f)
+    {
+        float fx = (1.f - fabs(z)) * signNotZero(x), fz = (1.f - fabs(x)) * signNotZero(z);
+        x = fx;
+        z = fz;
+    }
+    return Vector2f(x * .5f + .5f, z * .5f + .5f);
+}
+
+Vector3f OctahedralImage::decode(const Vector2f &uv)
+{
+    float x = uv[0] * 2.f - 1.f, z = uv[1] * 2.f - 1.f, y = 1.f - fabs(x) - fabs(z);
+    if(y < 0.f)
+    {
+        float fx = (1.f - fabs(z)) * signNotZero(x), fz = (1.f - fabs(x)) * signNotZero(z);
+        x = fx;
+        z = fz;
+    }
+    return Vector3f(x, y, z).normalized();
+}
+
+OctahedralImage OctahedralImage::fromEquirect(const EquirectImage &image, int size)
+{
+    OctahedralImage octahedral(size);
+    parallelFor(0, size, [&](int begin, int end)
+    {
+        float x[4], y[4], z[4], rgb[12];
+        for(int j = begin; j < end; j++)
+        {
+            float *out = octahedral.row(j);
+            for(int i = 0; i < size; i += 4)
+            {
+                // Lanes past the end of the row are computed and dropped
+#ifdef __SSE2__
+                __m128 u = _mm_div_ps(_mm_add_ps(_mm_set_ps(i + 3, i + 2, i + 1, i), _mm_set1_ps(.5f)), _mm_set1_ps(size)),
+                    v = _mm_set1_ps((j + .5f) / size), dx, dy, dz;
+                octDecode_ps(u, v, dx, dy, dz);
+                _mm_storeu_ps(x, dx);
+                _mm_storeu_ps(y, dy);
+                _mm_storeu_ps(z, dz);
+#else
+                for(int k = 0; k < 4; k++)
+                {
+                    Vector3f d = octahedral.texelDirection(i + k, j);
+                    x[k] = d[0];
+                    y[k] = d[1];
+                    z[k] = d[2];
+                }
+#endif
+                image.sample4(x, y, z, rgb);
+                copy(rgb, rgb + 3 * min(4, size - i), out + 3 * i);
+            }
+        }
+    });
+    return octahedral;
+}
+
+Vector3f OctahedralImage::texelDirection(int x, int y) const
+{
+    return decode(Vector2f((x + .5f) / size, (y + .5f) / size));
+}
+
+Vector3f OctahedralImage::sample(const Vector3f &dir) const
+{
+    Vector2f uv = encode(dir);
+    float px = max(0.f, min(size - 1.f, uv[0] * size - .5f)),
+        py = max(0.f, min(size - 1.f, uv[1] * size - .5f));
+    int x0 = px, y0 = py, x1 = min(x0 + 1, size - 1), y1 = min(y0 + 1, size - 1);
+    float fx = px - x0, fy = py - y0;
+    const float *p00 = row(y0) + 3 * x0, *p10 = row(y0) + 3 * x1,
+        *p01 = row(y1) + 3 * x0, *p11 = row(y1) + 3 * x1;
+    Vector3f c;
+    for(int i = 0; i < 3; i++)
+        c[i] = (p00[i] * (1.f - fx) + p10[i] * fx) * (1.f - fy) + (p01[i] * (1.f - fx) + p11[i] * fx) * fy;
+    return c;
+}
@@ -0,0 +1,282 @@
+#include "PRTBaker.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+static const char TRANSFER_MAGIC[4] = { 'P', 'R', 'T', 'T' };
+static const uint32_t TRANSFER_VERSION = 1;
+
+struct TransferHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t order, vertices;
+};
+
+static const char COMPRESSED_TRANSFER_MAGIC[4] = { 'P', 'R', 'T', 'C' };
+static const uint32_t COMPRESSED_TRANSFER_VERSION = 1;
+
+struct CompressedTransferHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t order, vertices, clusters, basisSize;
+};
+
+void Occluder::occluded(const Ray *rays, bool *results, int count) const
+{
+    for(int i = 0; i < count; i++)
+        results[i] = occluded(rays[i].origin, rays[i].dir, rays[i].tMax);
+}
+
+BruteForceOccluder::BruteForceOccluder(const MeshGeometry &geometry)
+{
+    int n = geometry.triangleCount();
+    _v0.resize(n);
+    _e1.resize(n);
+    _e2.resize(n);
+    for(int i = 0; i < n; i++)
+    {
+        const Vector3f &a = geometry.positions[geometry.indices[3 * i]];
+        _v0[i] = a;
+        _e1[i] = geometry.positions[geometry.indices[3 * i + 1]] - a;
+        _e2[i] = geometry.positions[geometry.indices[3 * i + 2]] - a;
+    }
+}
+
+bool BruteForceOccluder::occluded(const Vector3f &origin, const Vector3f &dir, float tMax) const
+{
+    // Möller-Trumbore, both sides
+    for(unsigned int i = 0; i < _v0.size(); i++)
+    {
+        Vector3f p = dir.cross(_e2[i]);
+        float det = _e1[i].dot(p);
+        if(fabs(det) < 1e-12f)
+            continue;
+        float invDet = 1.f / det;
+        Vector3f s = origin - _v0[i];
+        float u = s.dot(p) * invDet;
+        if(u < 0.f || u > 1.f)
+            continue;
+        Vector3f q = s.cross(_e1[i]);
+        float v = dir.dot(q) * invDet;
+        if(v < 0.f || u + v > 1.f)
+            continue;
+        float t = _e2[i].dot(q) * invDet;
+        if(t > 0.f && t < tMax)
+            return true;
+    }
+    return false;
+}
+
+// Shirley and Chiu's concentric mapping of the square to the disk, lifted
+// to the hemisphere : cosine-weighted directions around +Z
+static Vector3f cosineSampleHemisphere(float u, float v)
+{
+    float a = 2.f * u - 1.f, b = 2.f * v - 1.f, r, phi;
+    if(a == 0.f && b == 0.f)
+        return Vector3f(0.f, 0.f, 1.f);
+    if(fabs(a) > fabs(b))
+    {
+        r = a;
+        phi = M_PI / 4. * b / a;
+    }
+    else
+    {
+        r = b;
+        phi = M_PI / 2. - M_PI / 4. * a / b;
+    }
+    float x = r * cos(phi), y = r * sin(phi);
+    return Vector3f(x, y, sqrt(max(0.f, 1.f - x * x - y * y)));
+}
+
+// Orthonormal basis around the unit vector n, from Duff et al. 2017
+static void tangentFrame(const Vector3f &n, Vector3f &t, Vector3f &b)
+{
+    float sign = copysign(1.f, n[2]), a = -1.f / (sign + n[2]), c = n[0] * n[1] * a;
+    t = Vector3f(1.f + sign * n[0] * n[0] * a, sign * c, -sign * n[0]);
+    b = Vector3f(c, sign + n[1] * n[1] * a, -n[1]);
+}
+
+template<int Order>
+typename InverseLightingSolver<Order>::TransferMatrix invLight::bakeTransfer(const MeshGeometry &geometry,
+    const Occluder &occluder, const PRTBakeParams &params, PRTBakeStats *stats)
+{
+    const int COEFFICIENTS = SH<Order>::COEFFICIENTS, side = max(1, params.samplesPerSide), samples = side * side;
+    auto start = chrono::steady_clock::now();
+    typename InverseLightingSolver<Order>::TransferMatrix transfer(geometry.vertexCount(), COEFFICIENTS);
+    float bias = params.bias * geometry.bounds().diagonal().norm();
+    atomic<uint64_t> rays(0);
+    parallelFor(0, geometry.vertexCount(), [&](int begin, int end)
+    {
+        float basis[COEFFICIENTS];
+        vector<Ray> vertexRays(samples);
+        unique_ptr<bool[]> hidden(new bool[samples]());
+        uint64_t cast = 0;
+        for(int i = begin; i < end; i++)
+        {
+            const Vector3f &n = geometry.normals[i];
+            Vector3f origin = geometry.positions[i] + bias * n, t, b;
+            tangentFrame(n, t, b);
+            mt19937 random(i);
+            uniform_real_distribution<float> jitter(0.f, 1.f);
+            for(int y = 0; y < side; y++)
+                for(int x = 0; x < side; x++)
+                {
+                    Vector3f local = cosineSampleHemisphere((x + jitter(random)) / side, (y + jitter(random)) / side);
+                    vertexRays[y * side + x] = Ray(origin, local[0] * t + local[1] * b + local[2] * n);
+                }
+            if(params.shadowed)
+            {
+                if(params.batchRays)
+                    occluder.occluded(vertexRays.data(), hidden.get(), samples);
+                else
+                    for(int s = 0; s < samples; s++)
+                        hidden[s] = occluder.occluded(origin, vertexRays[s].dir, INFINITY);
+                cast += samples;
+            }
+            Matrix<float, 1, Dynamic> sum = Matrix<float, 1, Dynamic>::Zero(COEFFICIENTS);
+            for(int s = 0; s < samples; s++)
+                if(!hidden[s])
+                {
+                    SH<Order>::evalBasis(vertexRays[s].dir, basis);
+                    sum += Map<Matrix<float, 1, Dynamic>>(basis, COEFFICIENTS);
+                }
+            transfer.row(i) = sum / samples;
+        }
+        rays += cast;
+    });
+    if(stats)
+    {
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        stats->rays = rays;
+        stats->time = elapsed.count();
+    }
+    return transfer;
+}
+
+template<int Order>
+void invLight::saveTransfer(const string &path, const typename InverseLightingSolver<Order>::TransferMatrix &transfer)
+{
+    ofstream file(path, ios::binary);
+    if(!file)
+        fatal("Couldn't open " << path << " for writing");
+    TransferHeader header;
+    memcpy(header.magic, TRANSFER_MAGIC, sizeof(TRANSFER_MAGIC));
+    header.version = TRANSFER_VERSION;
+    header.order = Order;
+    header.vertices = transfer.rows();
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)transfer.data(), transfer.size() * sizeof(float));
+    if(!file)
+        fatal("Couldn't write " << path);
+}
+
+template<int Order>
+bool invLight::loadTransfer(const string &path, typename InverseLightingSolver<Order>::TransferMatrix &transfer)
+{
+    ifstream file(path, ios::binary);
+    if(!file)
+        return false;
+    TransferHeader header;
+    if(!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, TRANSFER_MAGIC, sizeof(TRANSFER_MAGIC))
+        || header.version != TRANSFER_VERSION || header.order != Order || header.vertices < 0)
+    {
+        trace("Ignoring transfer " << path << ", invalid or not of order " << Order);
+        return false;
+    }
+    transfer.resize(header.vertices, (int)SH<Order>::COEFFICIENTS);
+    if(!file.read((char *)transfer.data(), transfer.size() * sizeof(float)))
+    {
+        trace("Ignoring truncated transfer " << path);
+        return false;
+    }
+    return true;
+}
+
+template<int Order>
+void invLight::saveTransfer(const string &path, const CompressedTransfer<Order> &transfer)
+{
+    ofstream file(path, ios::binary);
+    if(!file)
+        fatal("Couldn't open " << path << " for writing");
+    CompressedTransferHeader header;
+    memcpy(header.magic, COMPRESSED_TRANSFER_MAGIC, sizeof(COMPRESSED_TRANSFER_MAGIC));
+    header.version = COMPRESSED_TRANSFER_VERSION;
+    header.order = Order;
+    header.vertices = transfer.vertexCount();
+    header.clusters = transfer.clusterCount();
+    header.basisSize = transfer.basisSize();
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)transfer.clusters().data(), transfer.vertexCount() * sizeof(int32_t));
+    file.write((const char *)transfer.clusterRows().data(), transfer.clusterRows().size() * sizeof(float));
+    file.write((const char *)transfer.weights().data(), transfer.weights().size() * sizeof(float));
+    if(!file)
+        fatal("Couldn't write " << path);
+}
+
+template<int Order>
+bool invLight::loadTransfer(const string &path, CompressedTransfer<Order> &transfer)
+{
+    ifstream file(path, ios::binary);
+    if(!file)
+        return false;
+    CompressedTransferHeader header;
+    if(!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, COMPRESSED_TRANSFER_MAGIC, sizeof(COMPRESSED_TRANSFER_MAGIC))
+        || header.version != COMPRESSED_TRANSFER_VERSION || header.order != Order || header.vertices < 0
+        || header.clusters < 1 || header.basisSize < 0 || header.basisSize > SH<Order>::COEFFICIENTS)
+    {
+        trace("Ignoring compressed transfer " << path << ", invalid or not of order " << Order);
+        return false;
+    }
+    vector<int> clusters(header.vertices);
+    typename CompressedTransfer<Order>::TransferMatrix clusterRows(header.clusters * (header.basisSize + 1), (int)SH<Order>::COEFFICIENTS);
+    typename CompressedTransfer<Order>::WeightMatrix weights(header.vertices, header.basisSize);
+    if(!file.read((char *)clusters.data(), clusters.size() * sizeof(int32_t))
+        || !file.read((char *)clusterRows.data(), clusterRows.size() * sizeof(float))
+        || !file.read((char *)weights.data(), weights.size() * sizeof(float)))
+    {
+        trace("Ignoring truncated compressed transfer " << path);
+        return false;
+    }
+    for(int c : clusters)
+        if(c < 0 || c >= header.clusters)
+        {
+            trace("Ignoring compressed transfer " << path << ", vertex in cluster " << c << " of " << header.clusters);
+            return false;
+        }
+    transfer = CompressedTransfer<Order>(clusters, clusterRows, weights);
+    return true;
+}
+
+namespace invLight
+{
+
+#define INSTANTIATE_PRT(ORDER) \
+    template InverseLightingSolver<ORDER>::TransferMatrix bakeTransfer<ORDER>(const MeshGeometry &, const Occluder &, \
+        const PRTBakeParams &, PRTBakeStats *); \
+    template void saveTransfer<ORDER>(const string &, const InverseLightingSolver<ORDER>::TransferMatrix &); \
+    template bool loadTransfer<ORDER>(const string &, InverseLightingSolver<ORDER>::TransferMatrix &); \
+    template void saveTransfer<ORDER>(const string &, const CompressedTransfer<ORDER> &); \
+    template bool loadTransfer<ORDER>(const string &, CompressedTransfer<ORDER> &);
+
+INSTANTIATE_PRT(2)
+INSTANTIATE_PRT(3)
+INSTANTIATE_PRT(4)
+INSTANTIATE_PRT(5)
+INSTANTIATE_PRT(6)
+INSTANTIATE_PRT(7)
+INSTANTIATE_PRT(8)
+
+}
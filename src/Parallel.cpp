@@ -0,0 +1,210 @@
+#include "Parallel.h"
+
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+namespace invLight
+{
+
+static unsigned int workerCountOverride = 0;
+
+// Pool the current thread works for, if any, and its queue in that pool
+static thread_local ThreadPool *currentPool = nullptr;
+static thread_local unsigned int currentQueue = 0;
+
+unsigned int workerCount()
+{
+    if(workerCountOverride > 0)
+        return workerCountOverride;
+    unsigned int n = thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+void setWorkerCount(unsigned int count)
+{
+    workerCountOverride = count;
+}
+
+ThreadPool& ThreadPool::shared()
+{
+    static ThreadPool pool(workerCount() - 1);
+    return pool;
+}
+
+ThreadPool::ThreadPool(unsigned int threads) :
+    _queued(0)
+{
+    for(unsigned int i = 0; i <= threads; i++)
+        _queues.emplace_back(new Queue);
+    for(unsigned int i = 0; i < threads; i++)
+        _threads.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    // Workers only stop once the queues are empty
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for(thread &t : _threads)
+        t.join();
+}
+
+unsigned int ThreadPool::queueIndex() const
+{
+    return currentPool == this ? currentQueue : _threads.size();
+}
+
+void ThreadPool::submit(function<void()> task)
+{
+    Queue &queue = *_queues[queueIndex()];
+    {
+        lock_guard<mutex> lock(queue.lock);
+        queue.tasks.push_back(move(task));
+    }
+    {
+        // Under the lock so that a thread about to sleep can't miss it
+        lock_guard<mutex> lock(_mutex);
+        _queued++;
+    }
+    _wake.notify_one();
+}
+
+bool ThreadPool::pop(unsigned int index, function<void()> &task)
+{
+    if(_queued == 0)
+        return false;
+    // Newest of our own tasks, its data is the most likely to be in cache
+    {
+        Queue &queue = *_queues[index];
+        lock_guard<mutex> lock(queue.lock);
+        if(!queue.tasks.empty())
+        {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+            _queued--;
+            return true;
+        }
+    }
+    // Oldest task of another queue, likely the largest piece of work left
+    for(unsigned int i = 1; i < _queues.size(); i++)
+    {
+        Queue &queue = *_queues[(index + i) % _queues.size()];
+        lock_guard<mutex> lock(queue.lock);
+        if(!queue.tasks.empty())
+        {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+            _queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::work(unsigned int index)
+{
+    currentPool = this;
+    currentQueue = index;
+    function<void()> task;
+    for(;;)
+    {
+        if(pop(index, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+        unique_lock<mutex> lock(_mutex);
+        if(_stop && _queued == 0)
+            return;
+        _wake.wait(lock, [this]() { return _stop || _queued > 0; });
+    }
+}
+
+void ThreadPool::runUntil(const function<bool()> &done)
+{
+    unsigned int index = queueIndex();
+    function<void()> task;
+    while(!done())
+    {
+        if(pop(index, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+        unique_lock<mutex> lock(_mutex);
+        _wake.wait(lock, [&]() { return _queued > 0 || done(); });
+    }
+}
+
+void ThreadPool::notify()
+{
+    // Taking the lock orders this with the check of a thread about to sleep
+    {
+        lock_guard<mutex> lock(_mutex);
+    }
+    _wake.notify_all();
+}
+
+void parallelFor(int begin, int end, const function<void(int, int)> &f, int grain)
+{
+    if(end <= begin)
+        return;
+    ThreadPool &pool = ThreadPool::shared();
+    int count = end - begin, threads = pool.size() + 1;
+    // A few chunks per thread keeps the load balanced without much overhead
+    if(grain <= 0)
+        grain = max(1, count / (threads * 4));
+    int chunks = (count + grain - 1) / grain;
+    threads = min(threads, chunks);
+    if(threads <= 1)
+    {
+        f(begin, end);
+        return;
+    }
+    
+    // Helpers may only start once the loop is over, when they find nothing
+    // left to do : the state they share outlives the call
+    struct State
+    {
+        atomic<int> next, done;
+        mutex lock;
+        exception_ptr error;
+    };
+    shared_ptr<State> state = make_shared<State>();
+    state->next = begin;
+    state->done = 0;
+    auto worker = [state, &f, &pool, end, grain, chunks]()
+    {
+        int b;
+        while((b = state->next.fetch_add(grain)) < end)
+        {
+            try
+            {
+                f(b, min(b + grain, end));
+            }
+            catch(...)
+            {
+                lock_guard<mutex> lock(state->lock);
+                if(!state->error)
+                    state->error = current_exception();
+            }
+            if(++state->done == chunks)
+                pool.notify();
+        }
+    };
+    for(int i = 1; i < threads; i++)
+        pool.submit(worker);
+    worker();
+    pool.runUntil([&]() { return state->done == chunks; });
+    if(state->error)
+        rethrow_exception(state->error);
+}
+
+}
@@ -0,0 +1,325 @@
+#include "PixelFormats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAS_F16C_KERNELS
+#endif
+
+using namespace std;
+
+namespace invLight
+{
+
+int pixelSize(PixelFormat format)
+{
+    switch(format)
+    {
+    case PIXEL_RGBE:
+    case PIXEL_RGB9E5:
+        return 4;
+    case PIXEL_HALF:
+        return 6;
+    default:
+        return 12;
+    }
+}
+
+// Bit tricks from Fabian Giesen's half conversion routines
+uint16_t floatToHalf(float f)
+{
+    const uint32_t infinity = 255 << 23, halfMax = (127 + 16) << 23, denormMagicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+    uint16_t h;
+    if(u >= halfMax)
+        h = u > infinity ? 0x7E00 : 0x7C00;
+    else if(u < (113 << 23))
+    {
+        // Denormal : let the FPU round the mantissa into place
+        float denormMagic, v;
+        memcpy(&denormMagic, &denormMagicBits, 4);
+        memcpy(&v, &u, 4);
+        v += denormMagic;
+        memcpy(&u, &v, 4);
+        h = u - denormMagicBits;
+    }
+    else
+    {
+        uint32_t mantissaOdd = (u >> 13) & 1;
+        u += ((15 - 127) << 23) + 0xFFF + mantissaOdd;
+        h = u >> 13;
+    }
+    return h | (sign >> 16);
+}
+
+float halfToFloat(uint16_t h)
+{
+    const uint32_t shiftedExponent = 0x7C00 << 13, magicBits = 113 << 23;
+    uint32_t u = (h & 0x7FFF) << 13, exponent = shiftedExponent & u;
+    u += (127 - 15) << 23;
+    float f;
+    if(exponent == shiftedExponent)
+        u += (128 - 16) << 23;
+    else if(exponent == 0)
+    {
+        // Denormal : renormalize through the FPU
+        float magic;
+        memcpy(&magic, &magicBits, 4);
+        u += 1 << 23;
+        memcpy(&f, &u, 4);
+        f -= magic;
+        memcpy(&u, &f, 4);
+    }
+    u |= (uint32_t)(h & 0x8000) << 16;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+#ifdef HAS_F16C_KERNELS
+// Compiled for F16C whatever the build flags, and only called once the CPU
+// is known to support it
+__attribute__((target("f16c"))) static void floatToHalfF16C(const float *src, uint16_t *dst, size_t count)
+{
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i lo = _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT),
+            hi = _mm_cvtps_ph(_mm_loadu_ps(src + i + 4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(lo, hi));
+    }
+    for(; i < count; i++)
+        dst[i] = floatToHalf(src[i]);
+}
+
+__attribute__((target("f16c"))) static void halfToFloatF16C(const uint16_t *src, float *dst, size_t count)
+{
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_ps(dst + i, _mm_cvtph_ps(h));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(h, h)));
+    }
+    for(; i < count; i++)
+        dst[i] = halfToFloat(src[i]);
+}
+
+static bool hasF16C()
+{
+    static const bool supported = __builtin_cpu_supports("f16c");
+    return supported;
+}
+#endif
+
+void floatToHalf(const float *src, uint16_t *dst, size_t count)
+{
+#ifdef HAS_F16C_KERNELS
+    if(hasF16C())
+    {
+        floatToHalfF16C(src, dst, count);
+        return;
+    }
+#endif
+    for(size_t i = 0; i < count; i++)
+        dst[i] = floatToHalf(src[i]);
+}
+
+void halfToFloat(const uint16_t *src, float *dst, size_t count)
+{
+#ifdef HAS_F16C_KERNELS
+    if(hasF16C())
+    {
+        halfToFloatF16C(src, dst, count);
+        return;
+    }
+#endif
+    for(size_t i = 0; i < count; i++)
+        dst[i] = halfToFloat(src[i]);
+}
+
+// 2^(e - 136) for every exponent byte, 0 standing for black
+struct RGBEScales
+{
+    float scale[256];
+    RGBEScales()
+    {
+        scale[0] = 0.f;
+        for(int e = 1; e < 256; e++)
+            scale[e] = ldexp(1.f, e - (128 + 8));
+    }
+};
+static const RGBEScales rgbeScales;
+
+void rgbeToFloat(const uint8_t *rgbe, float *rgb)
+{
+    float scale = rgbeScales.scale[rgbe[3]];
+    rgb[0] = rgbe[0] * scale;
+    rgb[1] = rgbe[1] * scale;
+    rgb[2] = rgbe[2] * scale;
+}
+
+void floatToRGBE(const float *rgb, uint8_t *rgbe)
+{
+    float m = max(rgb[0], max(rgb[1], rgb[2]));
+    if(m < 1e-32f)
+    {
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int e;
+    float scale = frexp(m, &e) * 256.f / m;
+    for(int i = 0; i < 3; i++)
+        rgbe[i] = max(0.f, rgb[i]) * scale;
+    rgbe[3] = e + 128;
+}
+
+uint32_t floatToRGB9E5(const float *rgb)
+{
+    // Largest representable value, 511 / 512 * 2^16
+    const float sharedExpMax = 65408.f;
+    float c[3];
+    for(int i = 0; i < 3; i++)
+        c[i] = max(0.f, min(sharedExpMax, rgb[i]));
+    float maxc = max(c[0], max(c[1], c[2]));
+    // frexp gives maxc = f * 2^e with f in [.5, 1), so floor(log2(maxc)) = e - 1
+    int e;
+    frexp(maxc, &e);
+    int exponent = maxc > 0.f ? max(-16, e - 1) + 16 : 0;
+    float scale = ldexp(1.f, 24 - exponent);
+    if((int)(maxc * scale + .5f) == 512)
+    {
+        exponent++;
+        scale *= .5f;
+    }
+    uint32_t packed = (uint32_t)exponent << 27;
+    for(int i = 0; i < 3; i++)
+        packed |= (uint32_t)min(511, (int)(c[i] * scale + .5f)) << (9 * i);
+    return packed;
+}
+
+void rgb9e5ToFloat(uint32_t packed, float *rgb)
+{
+    float scale = ldexp(1.f, (int)(packed >> 27) - 24);
+    for(int i = 0; i < 3; i++)
+        rgb[i] = ((packed >> (9 * i)) & 0x1FF) * scale;
+}
+
+uint32_t rgbeToRGB9E5(const uint8_t *rgbe)
+{
+    // m * 2^(E - 136) = 2m * 2^((E - 113) - 24) : the 8-bit mantissas fit in
+    // 9 bits and only the exponent needs rebiasing
+    int exponent = rgbe[3] - 113, shift = 0;
+    if(rgbe[3] == 0)
+        return 0;
+    if(exponent > 31)
+    {
+        float rgb[3];
+        rgbeToFloat(rgbe, rgb);
+        return floatToRGB9E5(rgb);
+    }
+    if(exponent < 0)
+    {
+        shift = -exponent;
+        exponent = 0;
+        if(shift > 9)
+            return 0;
+    }
+    uint32_t packed = (uint32_t)exponent << 27;
+    for(int i = 0; i < 3; i++)
+    {
+        uint32_t m = (uint32_t)rgbe[i] << 1;
+        if(shift)
+            m = (m + (1u << (shift - 1))) >> shift;
+        packed |= m << (9 * i);
+    }
+    return packed;
+}
+
+// Decodes `count` pixels to floats
+static void toFloat(const uint8_t *src, PixelFormat format, float *rgb, int count)
+{
+    switch(format)
+    {
+    case PIXEL_RGBE:
+        for(int i = 0; i < count; i++)
+            rgbeToFloat(src + 4 * i, rgb + 3 * i);
+        break;
+    case PIXEL_HALF:
+        halfToFloat((const uint16_t *)src, rgb, 3 * count);
+        break;
+    case PIXEL_RGB9E5:
+        for(int i = 0; i < count; i++)
+        {
+            uint32_t packed;
+            memcpy(&packed, src + 4 * i, 4);
+            rgb9e5ToFloat(packed, rgb + 3 * i);
+        }
+        break;
+    default:
+        memcpy(rgb, src, 12 * (size_t)count);
+    }
+}
+
+// Encodes `count` float pixels
+static void fromFloat(const float *rgb, uint8_t *dst, PixelFormat format, int count)
+{
+    switch(format)
+    {
+    case PIXEL_RGBE:
+        for(int i = 0; i < count; i++)
+            floatToRGBE(rgb + 3 * i, dst + 4 * i);
+        break;
+    case PIXEL_HALF:
+        floatToHalf(rgb, (uint16_t *)dst, 3 * count);
+        break;
+    case PIXEL_RGB9E5:
+        for(int i = 0; i < count; i++)
+        {
+            uint32_t packed = floatToRGB9E5(rgb + 3 * i);
+            memcpy(dst + 4 * i, &packed, 4);
+        }
+        break;
+    default:
+        memcpy(dst, rgb, 12 * (size_t)count);
+    }
+}
+
+void convertPixels(const void *src, PixelFormat srcFormat, void *dst, PixelFormat dstFormat, int count)
+{
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    if(srcFormat == dstFormat)
+        memcpy(d, s, (size_t)count * pixelSize(srcFormat));
+    else if(srcFormat == PIXEL_RGBE && dstFormat == PIXEL_RGB9E5)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            uint32_t packed = rgbeToRGB9E5(s + 4 * i);
+            memcpy(d + 4 * i, &packed, 4);
+        }
+    }
+    else if(srcFormat == PIXEL_FLOAT)
+        fromFloat((const float *)s, d, dstFormat, count);
+    else if(dstFormat == PIXEL_FLOAT)
+        toFloat(s, srcFormat, (float *)d, count);
+    else
+    {
+        // Through floats, a block at a time so that it stays in cache
+        const int block = 256;
+        float rgb[3 * block];
+        for(int i = 0; i < count; i += block)
+        {
+            int n = min(block, count - i);
+            toFloat(s + (size_t)i * pixelSize(srcFormat), srcFormat, rgb, n);
+            fromFloat(rgb, d + (size_t)i * pixelSize(dstFormat), dstFormat, n);
+        }
+    }
+}
+
+}
@@ -58,6 +58,11 @@ void ShaderProgram::use()
     }
 }
 
+void ShaderProgram::uniform1i(const string &name, int v)
+{
+    glUniform1i(ensureUniform(name), v);
+}
+
 void ShaderProgram::uniform1f(const string &name, float v)
 {
     glUniform1f(ensureUniform(name), v);
@@ -78,6 +83,16 @@ void ShaderProgram::uniform4f(const string &name, float v1, float v2, float v3,
     glUniform4f(ensureUniform(name), v1, v2, v3, v4);
 }
 
+void ShaderProgram::uniform1fv(const string &name, GLuint count, const GLfloat *v)
+{
+    glUniform1fv(ensureUniform(name), count, v);
+}
+
+void ShaderProgram::uniform3fv(const string &name, GLuint count, const GLfloat *v)
+{
+    glUniform3fv(ensureUniform(name), count, v);
+}
+
 void ShaderProgram::uniformMatrix4fv(const string &name, GLuint count, const GLfloat *v)
 {
     glUniformMatrix4fv(ensureUniform(name), count, GL_FALSE, v);
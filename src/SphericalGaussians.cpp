@@ -0,0 +1,402 @@
+#include "SphericalGaussians.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+// Constants of Hill's fit of a lobe's irradiance, see IrradianceKernel
+static const double IRRADIANCE_C0 = .36, IRRADIANCE_C1 = 1. / (4. * IRRADIANCE_C0);
+// Range the fits keep the sharpnesses in, from a lobe covering most of the
+// sphere to one about 2 degrees wide
+static const double MIN_SHARPNESS = .1, MAX_SHARPNESS = 2048.;
+// Axis, log of the sharpness and amplitude of each lobe
+static const int LOBE_PARAMETERS = 7;
+// Samples whose Jacobian rows are added to the normal equations at once
+static const int SAMPLE_BLOCK = 32;
+// Levenberg-Marquardt damping, relative to the diagonal of the normal
+// equations, to start from and past which a fit gives up
+static const double INITIAL_DAMPING = 1e-3, MAX_DAMPING = 1e10;
+
+// Unit-amplitude lobe towards direction `dir`, and its derivatives along
+// the axis and the sharpness
+struct RadianceKernel
+{
+    static double eval(const Vector3d &axis, double sharpness, const Vector3d &dir, Vector3d &dAxis, double &dSharpness)
+    {
+        double c = axis.dot(dir), f = exp(sharpness * (c - 1.));
+        dAxis = sharpness * f * dir;
+        dSharpness = (c - 1.) * f;
+        return f;
+    }
+};
+
+// Radiance a white Lambertian surface of unit normal `n` reflects under a
+// unit-amplitude lobe, its irradiance over PI, and its derivatives.
+// Irradiance is the lobe's integral times Stephen Hill's fit of its
+// normalized product integral with the clamped cosine, which is within a
+// few percent where approximating the cosine by a lobe is off by tens.
+// modelFragment.glsl evaluates the same.
+struct IrradianceKernel
+{
+    static double eval(const Vector3d &axis, double sharpness, const Vector3d &n, Vector3d &dAxis, double &dSharpness)
+    {
+        const double l = sharpness, m = axis.dot(n), eml = exp(-l), em2l = eml * eml, rl = 1. / l;
+        double scale = 1. + 2. * em2l - rl, bias = (eml - em2l) * rl - em2l,
+            dScale = -4. * em2l + rl * rl, dBias = (2. * em2l - eml) * rl - (eml - em2l) * rl * rl + 2. * em2l,
+            x = sqrt(1. - scale), dx = -.5 * dScale / x,
+            x0 = IRRADIANCE_C0 * m, x1 = IRRADIANCE_C1 * x, y, dyDm, dyDl;
+        if(fabs(x0) <= x1)
+        {
+            double s = x0 + x1;
+            y = s * s / x;
+            dyDm = 2. * s * IRRADIANCE_C0 / x;
+            dyDl = (2. * s * IRRADIANCE_C1 * x - s * s) / (x * x) * dx;
+        }
+        else
+        {
+            y = max(0., min(m, 1.));
+            dyDm = m > 0. && m < 1. ? 1. : 0.;
+            dyDl = 0.;
+        }
+        double normalized = scale * y + bias, integral = 2. * (1. - em2l) * rl,
+            dIntegral = -2. * (1. - em2l) * rl * rl + 4. * em2l * rl;
+        dAxis = integral * scale * dyDm * n;
+        dSharpness = (dScale * y + scale * dyDl + dBias) * integral + normalized * dIntegral;
+        return normalized * integral;
+    }
+};
+
+Vector3f SphericalGaussian::eval(const Vector3f &dir) const
+{
+    return amplitude * exp(sharpness * (axis.dot(dir) - 1.f));
+}
+
+Vector3f SphericalGaussian::integral() const
+{
+    return amplitude * (2. * M_PI / sharpness * (1. - exp(-2. * sharpness)));
+}
+
+Vector3f SphericalGaussian::irradiance(const Vector3f &n) const
+{
+    Vector3d dAxis;
+    double dSharpness;
+    return amplitude * (M_PI * IrradianceKernel::eval(axis.cast<double>(), sharpness, n.cast<double>(), dAxis, dSharpness));
+}
+
+vector<SphericalGaussian> invLight::spreadLobes(int count)
+{
+    // Each lobe covers about 4 PI / count steradians, which it falls to
+    // exp(-1) at the edge of for a sharpness of count / 2 : half of that
+    // overlaps the neighbors
+    vector<SphericalGaussian> lobes(max(0, count));
+    for(int i = 0; i < count; i++)
+    {
+        float y = 1.f - (2.f * i + 1.f) / count, r = sqrt(1.f - y * y), phi = i * M_PI * (3. - sqrt(5.));
+        lobes[i].axis = Vector3f(r * cos(phi), y, r * sin(phi));
+        lobes[i].sharpness = max(1.f, .25f * count);
+    }
+    return lobes;
+}
+
+namespace
+{
+
+// Weighted least squares fit of lobes to the samples (point, target,
+// weight), Kernel giving what a unit-amplitude lobe contributes to a point,
+// plus priorWeight times the squared distance to the parameters `prior`
+// when given
+template<class Kernel>
+class LobeFit
+{
+public:
+    LobeFit(const vector<Vector3f> &points, const vector<Vector3f> &targets, const vector<float> &weights,
+        const VectorXd *prior = nullptr, double priorWeight = 0.) :
+        _points(points), _targets(targets), _weights(weights), _prior(prior), _priorWeight(priorWeight) { }
+    
+    static VectorXd pack(const vector<SphericalGaussian> &lobes)
+    {
+        VectorXd p(LOBE_PARAMETERS * lobes.size());
+        for(unsigned int k = 0; k < lobes.size(); k++)
+        {
+            p.segment<3>(LOBE_PARAMETERS * k) = lobes[k].axis.normalized().cast<double>();
+            p[LOBE_PARAMETERS * k + 3] = log(max(MIN_SHARPNESS, min((double)lobes[k].sharpness, MAX_SHARPNESS)));
+            p.segment<3>(LOBE_PARAMETERS * k + 4) = lobes[k].amplitude.cast<double>();
+        }
+        return p;
+    }
+    
+    static vector<SphericalGaussian> unpack(const VectorXd &p)
+    {
+        vector<SphericalGaussian> lobes(p.size() / LOBE_PARAMETERS);
+        for(unsigned int k = 0; k < lobes.size(); k++)
+        {
+            lobes[k].axis = p.segment<3>(LOBE_PARAMETERS * k).cast<float>();
+            lobes[k].sharpness = exp(p[LOBE_PARAMETERS * k + 3]);
+            lobes[k].amplitude = p.segment<3>(LOBE_PARAMETERS * k + 4).cast<float>();
+        }
+        return lobes;
+    }
+    
+    // Back into the parameters' domain : unit axes, sharpnesses within
+    // range and non-negative amplitudes
+    static void project(VectorXd &p)
+    {
+        for(int k = 0; k < p.size() / LOBE_PARAMETERS; k++)
+        {
+            double norm = p.segment<3>(LOBE_PARAMETERS * k).norm();
+            if(norm > 0.)
+                p.segment<3>(LOBE_PARAMETERS * k) /= norm;
+            else
+                p.segment<3>(LOBE_PARAMETERS * k) = Vector3d(0., 1., 0.);
+            p[LOBE_PARAMETERS * k + 3] = max(log(MIN_SHARPNESS), min(p[LOBE_PARAMETERS * k + 3], log(MAX_SHARPNESS)));
+            p.segment<3>(LOBE_PARAMETERS * k + 4) = p.segment<3>(LOBE_PARAMETERS * k + 4).cwiseMax(0.);
+        }
+    }
+    
+    double cost(const VectorXd &p) const
+    {
+        double total = 0.;
+        mutex lock;
+        parallelFor(0, _points.size(), [&](int begin, int end)
+        {
+            double sum = 0.;
+            Vector3d dAxis;
+            double dSharpness;
+            for(int i = begin; i < end; i++)
+            {
+                Vector3d prediction = Vector3d::Zero(), point = _points[i].cast<double>();
+                for(int k = 0; k < p.size() / LOBE_PARAMETERS; k++)
+                    prediction += Kernel::eval(p.segment<3>(LOBE_PARAMETERS * k), exp(p[LOBE_PARAMETERS * k + 3]), point,
+                        dAxis, dSharpness) * p.segment<3>(LOBE_PARAMETERS * k + 4);
+                sum += _weights[i] * (prediction - _targets[i].cast<double>()).squaredNorm();
+            }
+            lock_guard<mutex> guard(lock);
+            total += sum;
+        }, SAMPLE_BLOCK);
+        if(_prior)
+            total += _priorWeight * (p - *_prior).squaredNorm();
+        return total;
+    }
+    
+    // Gauss-Newton normal equations J^T J and J^T r at `p`, J^T J in its
+    // lower triangle, accumulated by blocks of samples on each thread and
+    // summed at the end
+    void normalEquations(const VectorXd &p, MatrixXd &jtj, VectorXd &jtr) const
+    {
+        const int lobes = p.size() / LOBE_PARAMETERS, m = p.size();
+        jtj = MatrixXd::Zero(m, m);
+        jtr = VectorXd::Zero(m);
+        mutex lock;
+        parallelFor(0, _points.size(), [&](int begin, int end)
+        {
+            MatrixXd localJtj = MatrixXd::Zero(m, m), jacobian(3 * SAMPLE_BLOCK, m);
+            VectorXd localJtr = VectorXd::Zero(m), residuals(3 * SAMPLE_BLOCK);
+            Vector3d dAxis;
+            double dSharpness;
+            for(int first = begin; first < end; first += SAMPLE_BLOCK)
+            {
+                int count = min(SAMPLE_BLOCK, end - first);
+                jacobian.setZero();
+                for(int s = 0; s < count; s++)
+                {
+                    int i = first + s;
+                    double scale = sqrt(_weights[i]);
+                    Vector3d prediction = Vector3d::Zero(), point = _points[i].cast<double>();
+                    for(int k = 0; k < lobes; k++)
+                    {
+                        const int o = LOBE_PARAMETERS * k;
+                        Vector3d axis = p.segment<3>(o), amplitude = p.segment<3>(o + 4);
+                        double sharpness = exp(p[o + 3]), f = Kernel::eval(axis, sharpness, point, dAxis, dSharpness);
+                        prediction += f * amplitude;
+                        // Axes stay unit : only the tangent part of the
+                        // gradient moves them
+                        Vector3d tangent = dAxis - axis.dot(dAxis) * axis;
+                        for(int c = 0; c < 3; c++)
+                        {
+                            int row = 3 * s + c;
+                            jacobian.block<1, 3>(row, o) = scale * amplitude[c] * tangent.transpose();
+                            jacobian(row, o + 3) = scale * amplitude[c] * dSharpness * sharpness;
+                            jacobian(row, o + 4 + c) = scale * f;
+                        }
+                    }
+                    residuals.segment<3>(3 * s) = scale * (prediction - _targets[i].cast<double>());
+                }
+                localJtj.selfadjointView<Lower>().rankUpdate(jacobian.topRows(3 * count).transpose());
+                localJtr.noalias() += jacobian.topRows(3 * count).transpose() * residuals.head(3 * count);
+            }
+            lock_guard<mutex> guard(lock);
+            jtj.triangularView<Lower>() += localJtj;
+            jtr += localJtr;
+        }, 4 * SAMPLE_BLOCK);
+        if(_prior)
+        {
+            jtj.diagonal().array() += _priorWeight;
+            jtr += _priorWeight * (p - *_prior);
+        }
+    }
+    
+    // Levenberg-Marquardt with Marquardt's scaling of the damping by the
+    // diagonal, projecting each step back into the domain
+    SGFitStats run(vector<SphericalGaussian> &lobes, const SGFitOptions &options, const SGProgress &progress) const
+    {
+        SGFitStats stats;
+        auto start = chrono::steady_clock::now();
+        VectorXd p = pack(lobes);
+        MatrixXd jtj;
+        VectorXd jtr;
+        double cost = this->cost(p), damping = INITIAL_DAMPING;
+        normalEquations(p, jtj, jtr);
+        while(stats.iterations < options.maxIterations && damping < MAX_DAMPING)
+        {
+            stats.iterations++;
+            MatrixXd system = jtj;
+            system.diagonal() += damping * jtj.diagonal().cwiseMax(1e-12);
+            VectorXd q = p - system.selfadjointView<Lower>().ldlt().solve(jtr);
+            project(q);
+            double next = this->cost(q);
+            if(!(next < cost))
+            {
+                damping *= 4.;
+                continue;
+            }
+            bool converged = cost - next <= options.tolerance * cost;
+            p = q;
+            cost = next;
+            damping = max(damping / 3., 1e-12);
+            if(converged || (progress && !progress(unpack(p))))
+                break;
+            normalEquations(p, jtj, jtr);
+        }
+        lobes = unpack(p);
+        stats.cost = cost;
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        stats.time = elapsed.count();
+        return stats;
+    }
+private:
+    const vector<Vector3f> &_points, &_targets;
+    const vector<float> &_weights;
+    const VectorXd *_prior;
+    double _priorWeight;
+};
+
+}
+
+vector<SphericalGaussian> invLight::fitSphericalGaussians(const EquirectImage &environment, int count,
+    const SGFitOptions &options, SGFitStats *stats, int maxWidth, const SGProgress &progress)
+{
+    EquirectImage reduced;
+    const EquirectImage *image = &environment;
+    while(image->width > maxWidth)
+    {
+        reduced = image->downsample();
+        image = &reduced;
+    }
+    const int n = image->width * image->height;
+    vector<Vector3f> directions(n), radiances(n);
+    vector<float> solidAngles(n);
+    for(int y = 0; y < image->height; y++)
+        for(int x = 0; x < image->width; x++)
+        {
+            int i = y * image->width + x;
+            directions[i] = image->texelDirection(x, y);
+            radiances[i] = Map<const Vector3f>(image->row(y) + 3 * x);
+            solidAngles[i] = image->texelSolidAngle(directions[i]);
+        }
+    
+    // The amplitudes are linear : start from the ones that fit the spread
+    // lobes best
+    vector<SphericalGaussian> lobes = spreadLobes(count);
+    MatrixXd design(n, count);
+    for(int i = 0; i < n; i++)
+        for(int k = 0; k < count; k++)
+            design(i, k) = sqrt(solidAngles[i]) * exp(lobes[k].sharpness * (lobes[k].axis.dot(directions[i]) - 1.f));
+    MatrixXd rhs(n, 3);
+    for(int i = 0; i < n; i++)
+        rhs.row(i) = sqrt(solidAngles[i]) * radiances[i].cast<double>().transpose();
+    MatrixXd gram = design.transpose() * design;
+    gram.diagonal().array() += 1e-6 * gram.diagonal().mean();
+    MatrixXd amplitudes = gram.ldlt().solve(design.transpose() * rhs);
+    for(int k = 0; k < count; k++)
+        lobes[k].amplitude = amplitudes.row(k).transpose().cwiseMax(0.).cast<float>();
+    
+    SGFitStats fitStats = LobeFit<RadianceKernel>(directions, radiances, solidAngles).run(lobes, options, progress);
+    if(stats)
+        *stats = fitStats;
+    return lobes;
+}
+
+SGLightingSolver::SGLightingSolver(const vector<Vector3f> &normals, const SGFitOptions &options) :
+    _normals(normals),
+    _options(options),
+    _constraintIndices(normals.size(), -1)
+{
+}
+
+void SGLightingSolver::setPrior(const vector<SphericalGaussian> &lobes)
+{
+    _prior = lobes;
+    if(_constraints.empty() || _lobes.size() != lobes.size())
+        _lobes = lobes;
+}
+
+void SGLightingSolver::addConstraint(int vertex, const Vector3f &target, float weight)
+{
+    if(vertex < 0 || vertex >= (int)_normals.size())
+        fatal("Vertex " << vertex << " is out of the " << _normals.size() << " vertices");
+    Constraint constraint = { vertex, target, weight };
+    int &index = _constraintIndices[vertex];
+    if(index < 0)
+    {
+        index = _constraints.size();
+        _constraints.push_back(constraint);
+    }
+    else
+        _constraints[index] = constraint;
+}
+
+void SGLightingSolver::clearConstraints()
+{
+    for(const Constraint &constraint : _constraints)
+        _constraintIndices[constraint.vertex] = -1;
+    _constraints.clear();
+}
+
+const vector<SphericalGaussian>& SGLightingSolver::solve(const Progress &progress)
+{
+    if(_constraints.empty() || _prior.empty())
+    {
+        _lobes = _prior;
+        _stats = SGFitStats();
+        return _lobes;
+    }
+    vector<Vector3f> normals, targets;
+    vector<float> weights;
+    double totalWeight = 0.;
+    for(const Constraint &constraint : _constraints)
+    {
+        normals.push_back(_normals[constraint.vertex]);
+        targets.push_back(constraint.target);
+        weights.push_back(constraint.weight);
+        totalWeight += constraint.weight;
+    }
+    VectorXd prior = LobeFit<IrradianceKernel>::pack(_prior);
+    _stats = LobeFit<IrradianceKernel>(normals, targets, weights, &prior, _options.regularization * totalWeight)
+        .run(_lobes, _options, progress);
+    return _lobes;
+}
+
+Vector3f SGLightingSolver::shading(int vertex) const
+{
+    Vector3f radiance = Vector3f::Zero();
+    for(const SphericalGaussian &lobe : _lobes)
+        radiance += lobe.irradiance(_normals[vertex]);
+    return radiance / M_PI;
+}
@@ -0,0 +1,353 @@
+#include "SphericalHarmonics.h"
+
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+#include "Parallel.h"
+#include "SIMDMath.h"
+
+using namespace std;
+
+namespace invLight
+{
+
+// Compile-time pieces of the normalization constants
+
+static constexpr double productRange(int from, int to)
+{
+    return from > to ? 1. : from * productRange(from + 1, to);
+}
+
+static constexpr double doubleFactorial(int n)
+{
+    return n <= 1 ? 1. : n * doubleFactorial(n - 2);
+}
+
+// Converges from above, well within the iterations for the small values
+// the constants need
+static constexpr double newtonSqrt(double x, double current, int iterations)
+{
+    return iterations == 0 ? current : newtonSqrt(x, .5 * (current + x / current), iterations - 1);
+}
+
+static constexpr double constSqrt(double x)
+{
+    return x <= 0. ? 0. : newtonSqrt(x, x > 1. ? x : 1., 64);
+}
+
+/**
+ * Normalization of the real basis function of band l and order ±m, the
+ * sqrt(2) of non-zonal functions included.
+ */
+static constexpr double shNormalization(int l, int m)
+{
+    return (m == 0 ? 1. : constSqrt(2.)) * constSqrt((2 * l + 1) / (4. * M_PI) / productRange(l - m + 1, l + m));
+}
+
+/**
+ * Factor the clamped cosine lobe applies to band l (Ramamoorthi and
+ * Hanrahan, "An Efficient Representation for Irradiance Environment Maps").
+ */
+static constexpr double cosineLobe(int l)
+{
+    return l == 0 ? M_PI : l == 1 ? 2. * M_PI / 3. : l % 2 ? 0.
+        : 2. * M_PI * ((l / 2) % 2 ? 1. : -1.) / ((l + 2) * (l - 1)) * productRange(l / 2 + 1, l) / productRange(1, l / 2) / (1 << l);
+}
+
+// The basis is written in the Z-up frame of the usual formulas, as
+// P_l^m(z) / sin^m(theta), a polynomial in z, times sin^m(theta) cos(m phi)
+// or sin^m(theta) sin(m phi), polynomials in x and y. All three follow
+// recurrences whose coefficients only depend on l and m, which templates
+// unroll so that they are folded with the normalization. Functions are
+// defined without the Condon-Shortley phase.
+
+/**
+ * Bands L to Order of the functions of order ±M, given P_{L-1}^M and
+ * P_{L-2}^M divided by sin^M, and the azimuthal factors of order M.
+ */
+template<int Order, int M, int L, typename T, bool = (L <= Order)>
+struct SHBands
+{
+    static constexpr double K = shNormalization(L, M);
+    
+    static inline void eval(T z, T p1, T p2, T cm, T sm, T *basis)
+    {
+        T p = T((2. * L - 1.) / (L - M)) * z * p1 - T((L + M - 1.) / (L - M)) * p2;
+        store(p, cm, sm, basis);
+        SHBands<Order, M, L + 1, T>::eval(z, p, p1, cm, sm, basis);
+    }
+    
+    static inline void store(T p, T cm, T sm, T *basis)
+    {
+        T k = T(K) * p;
+        basis[L * (L + 1) + M] = k * cm;
+        if(M > 0)
+            basis[L * (L + 1) - M] = k * sm;
+    }
+};
+
+template<int Order, int M, int L, typename T>
+struct SHBands<Order, M, L, T, false>
+{
+    static inline void eval(T, T, T, T, T, T *) { }
+};
+
+/**
+ * Functions of orders ±M to ±Order, given the azimuthal factors of order M.
+ */
+template<int Order, int M, typename T, bool = (M <= Order)>
+struct SHOrders
+{
+    static constexpr double PMM = doubleFactorial(2 * M - 1);
+    
+    static inline void eval(T x, T y, T z, T cm, T sm, T *basis)
+    {
+        T pmm = T(PMM);
+        SHBands<Order, M, M, T>::store(pmm, cm, sm, basis);
+        SHBands<Order, M, M + 1, T>::eval(z, pmm, T(0.), cm, sm, basis);
+        SHOrders<Order, M + 1, T>::eval(x, y, z, x * cm - y * sm, x * sm + y * cm, basis);
+    }
+};
+
+template<int Order, int M, typename T>
+struct SHOrders<Order, M, T, false>
+{
+    static inline void eval(T, T, T, T, T, T *) { }
+};
+
+/**
+ * Basis in the direction (x, y, z) of our Y-up frame.
+ */
+template<int Order, typename T>
+static inline void evalBasisKernel(T x, T y, T z, T *basis)
+{
+    // Remap to the Z-up frame
+    SHOrders<Order, 0, T>::eval(x, T(0.) - z, y, T(1.), T(0.), basis);
+}
+
+/**
+ * Sums the RGB pixels of a row weighted by each azimuthal term : 1, then
+ * cos(k phi) and sin(k phi) for k = 1 to (TERMS - 1) / 2. `trig` holds the
+ * non-constant terms for every column, one table after the other.
+ */
+template<int TERMS>
+static void rowFourierSums(const float *row, int width, const float *trig, float sums[TERMS][3])
+{
+    int x = 0;
+    for(int t = 0; t < TERMS; t++)
+        sums[t][0] = sums[t][1] = sums[t][2] = 0.f;
+#ifdef __SSE2__
+    // 4 pixels span 3 registers : [r0 g0 b0 r1] [g1 b1 r2 g2] [b2 r3 g3 b3].
+    // Terms are shuffled to that layout and lanes are regrouped at the end.
+    __m128 acc[TERMS][3];
+    for(int t = 0; t < TERMS; t++)
+        acc[t][0] = acc[t][1] = acc[t][2] = _mm_setzero_ps();
+    for(; x + 4 <= width; x += 4)
+    {
+        const float *p = row + 3 * x;
+        __m128 v0 = _mm_loadu_ps(p), v1 = _mm_loadu_ps(p + 4), v2 = _mm_loadu_ps(p + 8);
+        acc[0][0] = _mm_add_ps(acc[0][0], v0);
+        acc[0][1] = _mm_add_ps(acc[0][1], v1);
+        acc[0][2] = _mm_add_ps(acc[0][2], v2);
+        for(int t = 1; t < TERMS; t++)
+        {
+            __m128 f = _mm_loadu_ps(trig + (t - 1) * width + x);
+            acc[t][0] = _mm_add_ps(acc[t][0], _mm_mul_ps(v0, _mm_shuffle_ps(f, f, _MM_SHUFFLE(1, 0, 0, 0))));
+            acc[t][1] = _mm_add_ps(acc[t][1], _mm_mul_ps(v1, _mm_shuffle_ps(f, f, _MM_SHUFFLE(2, 2, 1, 1))));
+            acc[t][2] = _mm_add_ps(acc[t][2], _mm_mul_ps(v2, _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 2))));
+        }
+    }
+    for(int t = 0; t < TERMS; t++)
+    {
+        float lanes[12];
+        _mm_storeu_ps(lanes, acc[t][0]);
+        _mm_storeu_ps(lanes + 4, acc[t][1]);
+        _mm_storeu_ps(lanes + 8, acc[t][2]);
+        for(int i = 0; i < 12; i++)
+            sums[t][i % 3] += lanes[i];
+    }
+#endif
+    for(; x < width; x++)
+    {
+        const float *p = row + 3 * x;
+        for(int c = 0; c < 3; c++)
+        {
+            sums[0][c] += p[c];
+            for(int t = 1; t < TERMS; t++)
+                sums[t][c] += p[c] * trig[(t - 1) * width + x];
+        }
+    }
+}
+
+template<int Order>
+void SH<Order>::evalBasis(const Vector3f &dir, float *basis)
+{
+    evalBasisKernel<Order, float>(dir[0], dir[1], dir[2], basis);
+}
+
+template<int Order>
+void SH<Order>::evalBasis4(const float *x, const float *y, const float *z, float *basis)
+{
+#ifdef __SSE2__
+    Float4 b[COEFFICIENTS];
+    evalBasisKernel<Order, Float4>(_mm_loadu_ps(x), _mm_loadu_ps(y), _mm_loadu_ps(z), b);
+    for(int i = 0; i < COEFFICIENTS; i++)
+        _mm_storeu_ps(basis + 4 * i, b[i].v);
+#else
+    float b[COEFFICIENTS];
+    for(int k = 0; k < 4; k++)
+    {
+        evalBasisKernel<Order, float>(x[k], y[k], z[k], b);
+        for(int i = 0; i < COEFFICIENTS; i++)
+            basis[4 * i + k] = b[i];
+    }
+#endif
+}
+
+template<int Order>
+typename SH<Order>::Coefficients SH<Order>::projectEquirect(const float *pixels, int width, int height)
+{
+    return projectEquirectRegion(pixels, 0, 0, width, height, width, height);
+}
+
+template<int Order>
+typename SH<Order>::Coefficients SH<Order>::projectEquirectRegion(const float *pixels, int x0, int y0, int regionWidth,
+    int regionHeight, int width, int height)
+{
+    const int TERMS = 2 * Order + 1;
+    vector<float> trig((TERMS - 1) * regionWidth);
+    for(int i = 0; i < regionWidth; i++)
+    {
+        float phi = ((x0 + i + .5f) / width - .5f) * 2.f * M_PI;
+        for(int k = 1; k <= Order; k++)
+        {
+            trig[(2 * k - 2) * regionWidth + i] = cos(k * phi);
+            trig[(2 * k - 1) * regionWidth + i] = sin(k * phi);
+        }
+    }
+    // Within a row, every basis function is a polar factor times one of the
+    // azimuthal terms, so each row only needs TERMS weighted sums per
+    // channel. The polar factor of orders m and -m is the same.
+    int term[COEFFICIENTS], polarIndex[COEFFICIENTS];
+    for(int l = 0; l <= Order; l++)
+        for(int m = -l; m <= l; m++)
+        {
+            term[l * (l + 1) + m] = m == 0 ? 0 : m > 0 ? 2 * m - 1 : -2 * m;
+            polarIndex[l * (l + 1) + m] = l * (l + 1) + abs(m);
+        }
+    
+    Matrix<double, COEFFICIENTS, 3> total = Matrix<double, COEFFICIENTS, 3>::Zero();
+    mutex totalMutex;
+    parallelFor(y0, y0 + regionHeight, [&](int begin, int end)
+    {
+        Matrix<double, COEFFICIENTS, 3> local = Matrix<double, COEFFICIENTS, 3>::Zero();
+        float sums[TERMS][3];
+        double polar[COEFFICIENTS];
+        for(int y = begin; y < end; y++)
+        {
+            double theta = (y + .5) * M_PI / height,
+                // Exact solid angle of one texel of the row
+                w = 2. * M_PI / width * (cos(y * M_PI / height) - cos((y + 1) * M_PI / height));
+            // At phi = 0, the functions of order m >= 0 reduce to their polar factor
+            evalBasisKernel<Order, double>(sin(theta), cos(theta), 0., polar);
+            rowFourierSums<TERMS>(pixels + 3 * (y - y0) * regionWidth, regionWidth, trig.data(), sums);
+            for(int i = 0; i < COEFFICIENTS; i++)
+            {
+                double f = w * polar[polarIndex[i]];
+                for(int ch = 0; ch < 3; ch++)
+                    local(i, ch) += f * sums[term[i]][ch];
+            }
+        }
+        lock_guard<mutex> lock(totalMutex);
+        total += local;
+    });
+    return total.template cast<float>();
+}
+
+template<int Order>
+void SH<Order>::updateEquirect(Coefficients &sh, const float *oldPixels, const float *newPixels,
+    int x0, int y0, int regionWidth, int regionHeight, int width, int height, bool irradiance)
+{
+    vector<float> delta(3 * regionWidth * regionHeight);
+    for(unsigned int i = 0; i < delta.size(); i++)
+        delta[i] = newPixels[i] - oldPixels[i];
+    Coefficients change = projectEquirectRegion(delta.data(), x0, y0, regionWidth, regionHeight, width, height);
+    if(irradiance)
+        convolveCosine(change);
+    sh += change;
+}
+
+template<int Order>
+void SH<Order>::convolveCosine(Coefficients &sh)
+{
+    static constexpr float lobe[9] = { cosineLobe(0), cosineLobe(1), cosineLobe(2), cosineLobe(3), cosineLobe(4),
+        cosineLobe(5), cosineLobe(6), cosineLobe(7), cosineLobe(8) };
+    for(int l = 0; l <= Order; l++)
+        sh.middleRows(l * l, 2 * l + 1) *= lobe[l];
+}
+
+template<int Order>
+Vector3f SH<Order>::eval(const Coefficients &sh, const Vector3f &dir)
+{
+    Matrix<float, COEFFICIENTS, 1> basis;
+    evalBasis(dir, basis.data());
+    return sh.transpose() * basis;
+}
+
+template<int Order>
+void SH<Order>::renderEquirect(const Coefficients &sh, int width, int height, float *pixels)
+{
+    vector<float> cosPhi(width), sinPhi(width);
+    for(int x = 0; x < width; x++)
+    {
+        float phi = ((x + .5f) / width - .5f) * 2.f * M_PI;
+        cosPhi[x] = cos(phi);
+        sinPhi[x] = sin(phi);
+    }
+    parallelFor(0, height, [&](int begin, int end)
+    {
+        for(int y = begin; y < end; y++)
+        {
+            float theta = (y + .5f) * M_PI / height, s = sin(theta), c = cos(theta);
+            float *row = pixels + 3 * y * width;
+            int x = 0;
+#ifdef __SSE2__
+            for(; x + 4 <= width; x += 4)
+            {
+                Float4 basis[COEFFICIENTS], color[3];
+                evalBasisKernel<Order, Float4>(Float4(_mm_loadu_ps(&cosPhi[x])) * s, c, Float4(_mm_loadu_ps(&sinPhi[x])) * -s, basis);
+                for(int ch = 0; ch < 3; ch++)
+                {
+                    color[ch] = 0.f;
+                    for(int i = 0; i < COEFFICIENTS; i++)
+                        color[ch] = color[ch] + sh(i, ch) * basis[i];
+                }
+                float lanes[3][4];
+                for(int ch = 0; ch < 3; ch++)
+                    _mm_storeu_ps(lanes[ch], color[ch].v);
+                for(int k = 0; k < 4; k++)
+                    for(int ch = 0; ch < 3; ch++)
+                        row[3 * (x + k) + ch] = lanes[ch][k];
+            }
+#endif
+            for(; x < width; x++)
+            {
+                Vector3f e = eval(sh, Vector3f(cosPhi[x] * s, c, -sinPhi[x] * s));
+                row[3 * x] = e[0];
+                row[3 * x + 1] = e[1];
+                row[3 * x + 2] = e[2];
+            }
+        }
+    });
+}
+
+template struct SH<2>;
+template struct SH<3>;
+template struct SH<4>;
+template struct SH<5>;
+template struct SH<6>;
+template struct SH<7>;
+template struct SH<8>;
+
+}
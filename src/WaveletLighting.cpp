@@ -0,0 +1,508 @@
+#include "WaveletLighting.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+
+#include "Parallel.h"
+#include "utils.h"
+
+using namespace invLight;
+using namespace std;
+
+static const char WAVELET_TRANSFER_MAGIC[4] = { 'P', 'R', 'T', 'W' };
+static const uint32_t WAVELET_TRANSFER_VERSION = 1;
+// Conjugate gradient iterations between two reports of a progressive solve
+static const int PROGRESS_ITERATIONS = 8;
+
+struct WaveletTransferHeader
+{
+    char magic[4];
+    uint32_t version;
+    int32_t size, vertices, nonZeros;
+};
+
+// Nonstandard 2D Haar transform of a size x size face, in place, with a
+// stride of `stride` floats between texels : each pass replaces the n x n
+// top left corner by its 2 x 2 averages, in the (n / 2)² top left corner,
+// and the horizontal, vertical and diagonal details around it. Both
+// directions are orthonormal, and each the other's inverse.
+static void haarForward(float *face, int size, int stride, vector<float> &scratch)
+{
+    scratch.resize(size * size);
+    for(int n = size; n > 1; n /= 2)
+    {
+        int h = n / 2;
+        for(int y = 0; y < h; y++)
+            for(int x = 0; x < h; x++)
+            {
+                float a = face[stride * (2 * y * size + 2 * x)], b = face[stride * (2 * y * size + 2 * x + 1)],
+                    c = face[stride * ((2 * y + 1) * size + 2 * x)], d = face[stride * ((2 * y + 1) * size + 2 * x + 1)];
+                scratch[y * size + x] = .5f * (a + b + c + d);
+                scratch[y * size + x + h] = .5f * (a - b + c - d);
+                scratch[(y + h) * size + x] = .5f * (a + b - c - d);
+                scratch[(y + h) * size + x + h] = .5f * (a - b - c + d);
+            }
+        for(int y = 0; y < n; y++)
+            for(int x = 0; x < n; x++)
+                face[stride * (y * size + x)] = scratch[y * size + x];
+    }
+}
+
+static void haarInverse(float *face, int size, int stride, vector<float> &scratch)
+{
+    scratch.resize(size * size);
+    for(int n = 2; n <= size; n *= 2)
+    {
+        int h = n / 2;
+        for(int y = 0; y < h; y++)
+            for(int x = 0; x < h; x++)
+            {
+                float s = face[stride * (y * size + x)], p = face[stride * (y * size + x + h)],
+                    q = face[stride * ((y + h) * size + x)], r = face[stride * ((y + h) * size + x + h)];
+                scratch[2 * y * size + 2 * x] = .5f * (s + p + q + r);
+                scratch[2 * y * size + 2 * x + 1] = .5f * (s - p + q - r);
+                scratch[(2 * y + 1) * size + 2 * x] = .5f * (s + p - q - r);
+                scratch[(2 * y + 1) * size + 2 * x + 1] = .5f * (s - p - q + r);
+            }
+        for(int y = 0; y < n; y++)
+            for(int x = 0; x < n; x++)
+                face[stride * (y * size + x)] = scratch[y * size + x];
+    }
+}
+
+// Level of the coefficient in texel (x, y) of a face : 0 for the average,
+// j + 1 for the details of level j
+static int haarLevel(int x, int y)
+{
+    int level = 0;
+    for(int m = max(x, y); m > 0; m >>= 1)
+        level++;
+    return level;
+}
+
+// `image` box filtered down to `size` if it's a power of two times larger,
+// bilinearly resampled otherwise
+static CubeMapImage resampled(const CubeMapImage &image, int size)
+{
+    if(image.size == size)
+        return image;
+    if(image.size > size && image.size % size == 0 && ((image.size / size) & (image.size / size - 1)) == 0)
+    {
+        CubeMapImage half = image.downsample();
+        while(half.size > size)
+            half = half.downsample();
+        return half;
+    }
+    CubeMapImage cube(size);
+    parallelFor(0, 6 * size, [&](int begin, int end)
+    {
+        for(int r = begin; r < end; r++)
+        {
+            int face = r / size, y = r % size;
+            float *out = cube.row(face, y);
+            for(int x = 0; x < size; x++)
+            {
+                Vector3f c = image.sample(cube.texelDirection(face, x, y));
+                copy(c.data(), c.data() + 3, out + 3 * x);
+            }
+        }
+    });
+    return cube;
+}
+
+WaveletTransfer::WaveletTransfer(int size, const TransferMatrix &rows) :
+    _size(size),
+    _rows(rows)
+{
+    if(size < 1 || (size & (size - 1)) || rows.cols() != coefficientCount())
+        fatal("Expected a power of two size and " << 6 * size * size << " columns, got " << size << " and " << rows.cols());
+    _rows.makeCompressed();
+}
+
+size_t WaveletTransfer::bytes() const
+{
+    return _rows.nonZeros() * (sizeof(float) + sizeof(int)) + (_rows.rows() + 1) * sizeof(int);
+}
+
+Matrix<float, Dynamic, 3> WaveletTransfer::transform(const CubeMapImage &image) const
+{
+    if(image.size != _size)
+        fatal("Expected a cube map of size " << _size << ", got " << image.size);
+    Matrix<float, Dynamic, 3, RowMajor> coefficients(coefficientCount(), 3);
+    parallelFor(0, 6, [&](int begin, int end)
+    {
+        vector<float> scratch;
+        for(int face = begin; face < end; face++)
+        {
+            float *f = coefficients.data() + 3 * face * _size * _size;
+            copy(image.faces[face].begin(), image.faces[face].end(), f);
+            for(int c = 0; c < 3; c++)
+                haarForward(f + c, _size, 3, scratch);
+        }
+    }, 1);
+    return coefficients;
+}
+
+CubeMapImage WaveletTransfer::reconstruct(const Matrix<float, Dynamic, 3> &coefficients) const
+{
+    if(coefficients.rows() != coefficientCount())
+        fatal("Expected " << coefficientCount() << " coefficients, got " << coefficients.rows());
+    CubeMapImage image(_size);
+    parallelFor(0, 6, [&](int begin, int end)
+    {
+        vector<float> scratch;
+        for(int face = begin; face < end; face++)
+        {
+            float *f = image.faces[face].data();
+            for(int i = 0; i < _size * _size; i++)
+                for(int c = 0; c < 3; c++)
+                    f[3 * i + c] = coefficients(face * _size * _size + i, c);
+            for(int c = 0; c < 3; c++)
+                haarInverse(f + c, _size, 3, scratch);
+        }
+    }, 1);
+    return image;
+}
+
+Matrix<float, SH_COEFFICIENTS, Dynamic> WaveletTransfer::shProjection() const
+{
+    // All the basis functions at once, one per channel of a few cube maps
+    const int maps = (SH_COEFFICIENTS + 2) / 3;
+    vector<CubeMapImage> weighted(maps, CubeMapImage(_size));
+    for(int face = 0; face < 6; face++)
+        for(int y = 0; y < _size; y++)
+            for(int x = 0; x < _size; x++)
+            {
+                Vector3f dir = weighted[0].texelDirection(face, x, y).normalized();
+                float basis[SH_COEFFICIENTS], solidAngle = weighted[0].texelSolidAngle(dir);
+                evalSHBasis(dir, basis);
+                for(int k = 0; k < SH_COEFFICIENTS; k++)
+                    weighted[k / 3].row(face, y)[3 * x + k % 3] = basis[k] * solidAngle;
+            }
+    Matrix<float, SH_COEFFICIENTS, Dynamic> projection(SH_COEFFICIENTS, coefficientCount());
+    for(int m = 0; m < maps; m++)
+    {
+        Matrix<float, Dynamic, 3> transformed = transform(weighted[m]);
+        for(int k = 3 * m; k < min(3 * m + 3, SH_COEFFICIENTS); k++)
+            projection.row(k) = transformed.col(k % 3).transpose();
+    }
+    return projection;
+}
+
+WaveletTransfer invLight::bakeWaveletTransfer(const MeshGeometry &geometry, const Occluder &occluder,
+    const WaveletBakeParams &params, const PRTBakeParams &prt, PRTBakeStats *stats)
+{
+    const int size = params.size, texels = 6 * size * size, terms = max(1, min(params.terms, texels));
+    if(size < 1 || (size & (size - 1)))
+        fatal("Wavelet transfers need a power of two size, got " << size);
+    auto start = chrono::steady_clock::now();
+    
+    // Direction and solid angle over PI of every texel
+    CubeMapImage cube(size);
+    vector<Vector3f> directions(texels);
+    vector<float> solidAngles(texels);
+    for(int face = 0; face < 6; face++)
+        for(int y = 0; y < size; y++)
+            for(int x = 0; x < size; x++)
+            {
+                Vector3f d = cube.texelDirection(face, x, y);
+                int i = (face * size + y) * size + x;
+                directions[i] = d.normalized();
+                float d2 = d.squaredNorm() / d.cwiseAbs().maxCoeff() / d.cwiseAbs().maxCoeff();
+                solidAngles[i] = 4.f / (size * size * d2 * sqrt(d2)) / M_PI;
+            }
+    
+    // Kept coefficients of each vertex, in order, zero where a vertex has
+    // fewer nonzeros
+    const int n = geometry.vertexCount();
+    vector<int> indices(n * terms, 0);
+    vector<float> values(n * terms, 0.f);
+    float bias = prt.bias * geometry.bounds().diagonal().norm();
+    atomic<uint64_t> rays(0);
+    parallelFor(0, n, [&](int begin, int end)
+    {
+        vector<float> transfer(texels), scratch;
+        vector<int> visible, order(texels);
+        vector<Ray> vertexRays;
+        unique_ptr<bool[]> hidden(new bool[texels]());
+        uint64_t cast = 0;
+        for(int v = begin; v < end; v++)
+        {
+            const Vector3f &normal = geometry.normals[v];
+            Vector3f origin = geometry.positions[v] + bias * normal;
+            visible.clear();
+            vertexRays.clear();
+            for(int i = 0; i < texels; i++)
+                if(normal.dot(directions[i]) > 0.f)
+                {
+                    visible.push_back(i);
+                    vertexRays.push_back(Ray(origin, directions[i]));
+                }
+            const int count = visible.size();
+            if(prt.shadowed)
+            {
+                if(prt.batchRays)
+                    occluder.occluded(vertexRays.data(), hidden.get(), count);
+                else
+                    for(int s = 0; s < count; s++)
+                        hidden[s] = occluder.occluded(origin, vertexRays[s].dir, INFINITY);
+                cast += count;
+            }
+            fill(transfer.begin(), transfer.end(), 0.f);
+            for(int s = 0; s < count; s++)
+                if(!hidden[s])
+                    transfer[visible[s]] = normal.dot(directions[visible[s]]) * solidAngles[visible[s]];
+            for(int face = 0; face < 6; face++)
+                haarForward(&transfer[face * size * size], size, 1, scratch);
+            
+            iota(order.begin(), order.end(), 0);
+            nth_element(order.begin(), order.begin() + terms - 1, order.end(),
+                [&](int a, int b) { return fabs(transfer[a]) > fabs(transfer[b]); });
+            sort(order.begin(), order.begin() + terms);
+            for(int k = 0; k < terms; k++)
+            {
+                indices[v * terms + k] = order[k];
+                values[v * terms + k] = transfer[order[k]];
+            }
+        }
+        rays += cast;
+    });
+    
+    WaveletTransfer::TransferMatrix rows(n, texels);
+    rows.reserve(VectorXi::Constant(n, terms));
+    for(int v = 0; v < n; v++)
+        for(int k = 0; k < terms; k++)
+            if(values[v * terms + k] != 0.f)
+                rows.insert(v, indices[v * terms + k]) = values[v * terms + k];
+    if(stats)
+    {
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        stats->rays = rays;
+        stats->time = elapsed.count();
+    }
+    return WaveletTransfer(size, rows);
+}
+
+void invLight::saveTransfer(const string &path, const WaveletTransfer &transfer)
+{
+    ofstream file(path, ios::binary);
+    if(!file)
+        fatal("Couldn't open " << path << " for writing");
+    const WaveletTransfer::TransferMatrix &rows = transfer.rows();
+    WaveletTransferHeader header;
+    memcpy(header.magic, WAVELET_TRANSFER_MAGIC, sizeof(WAVELET_TRANSFER_MAGIC));
+    header.version = WAVELET_TRANSFER_VERSION;
+    header.size = transfer.size();
+    header.vertices = transfer.vertexCount();
+    header.nonZeros = rows.nonZeros();
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)rows.outerIndexPtr(), (rows.rows() + 1) * sizeof(int32_t));
+    file.write((const char *)rows.innerIndexPtr(), rows.nonZeros() * sizeof(int32_t));
+    file.write((const char *)rows.valuePtr(), rows.nonZeros() * sizeof(float));
+    if(!file)
+        fatal("Couldn't write " << path);
+}
+
+bool invLight::loadTransfer(const string &path, WaveletTransfer &transfer)
+{
+    ifstream file(path, ios::binary);
+    if(!file)
+        return false;
+    WaveletTransferHeader header;
+    if(!file.read((char *)&header, sizeof(header)) || memcmp(header.magic, WAVELET_TRANSFER_MAGIC, sizeof(WAVELET_TRANSFER_MAGIC))
+        || header.version != WAVELET_TRANSFER_VERSION || header.size < 1 || (header.size & (header.size - 1))
+        || header.vertices < 0 || header.nonZeros < 0)
+    {
+        trace("Ignoring wavelet transfer " << path << ", invalid");
+        return false;
+    }
+    const int columns = 6 * header.size * header.size;
+    vector<int32_t> outer(header.vertices + 1), inner(header.nonZeros);
+    vector<float> values(header.nonZeros);
+    if(!file.read((char *)outer.data(), outer.size() * sizeof(int32_t))
+        || !file.read((char *)inner.data(), inner.size() * sizeof(int32_t))
+        || !file.read((char *)values.data(), values.size() * sizeof(float)))
+    {
+        trace("Ignoring truncated wavelet transfer " << path);
+        return false;
+    }
+    // Everything Eigen asserts on a compressed matrix : rows covering the
+    // nonzeros exactly, each with increasing coefficients in range
+    if(outer[0] != 0 || outer[header.vertices] != header.nonZeros)
+    {
+        trace("Ignoring wavelet transfer " << path << ", offsets don't span its " << header.nonZeros << " nonzeros");
+        return false;
+    }
+    for(int v = 0; v < header.vertices; v++)
+    {
+        if(outer[v] > outer[v + 1])
+        {
+            trace("Ignoring wavelet transfer " << path << ", bad offsets at vertex " << v);
+            return false;
+        }
+        for(int32_t k = outer[v]; k < outer[v + 1]; k++)
+            if(inner[k] < 0 || inner[k] >= columns || (k > outer[v] && inner[k] <= inner[k - 1]))
+            {
+                trace("Ignoring wavelet transfer " << path << ", coefficient " << inner[k] << " out of " << columns
+                    << " or out of order at vertex " << v);
+                return false;
+            }
+    }
+    transfer = WaveletTransfer(header.size, Map<WaveletTransfer::TransferMatrix>(header.vertices, columns, header.nonZeros,
+        outer.data(), inner.data(), values.data()));
+    return true;
+}
+
+WaveletLightingSolver::WaveletLightingSolver(const WaveletTransfer &transfer, const WaveletLightingOptions &options) :
+    _transfer(transfer),
+    _options(options),
+    _constraintIndices(transfer.vertexCount(), -1)
+{
+    const int size = transfer.size(), k = transfer.coefficientCount();
+    _penalties.resize(k);
+    for(int face = 0; face < 6; face++)
+        for(int y = 0; y < size; y++)
+            for(int x = 0; x < size; x++)
+                _penalties[(face * size + y) * size + x] = 1 << haarLevel(x, y);
+    _prior = Coefficients::Zero(k, 3);
+    _coefficients = _prior;
+}
+
+void WaveletLightingSolver::setPrior(const CubeMapImage &radiance)
+{
+    _prior = _transfer.transform(resampled(radiance, _transfer.size()));
+    if(_constraints.empty())
+        _coefficients = _prior;
+}
+
+void WaveletLightingSolver::addConstraint(int vertex, const Vector3f &target, float weight)
+{
+    if(vertex < 0 || vertex >= _transfer.vertexCount())
+        fatal("Vertex " << vertex << " is out of the " << _transfer.vertexCount() << " vertices");
+    Constraint constraint = { vertex, target, weight };
+    int &index = _constraintIndices[vertex];
+    if(index < 0)
+    {
+        index = _constraints.size();
+        _constraints.push_back(constraint);
+    }
+    else
+        _constraints[index] = constraint;
+}
+
+void WaveletLightingSolver::clearConstraints()
+{
+    for(const Constraint &constraint : _constraints)
+        _constraintIndices[constraint.vertex] = -1;
+    _constraints.clear();
+}
+
+const WaveletLightingSolver::Coefficients& WaveletLightingSolver::solve(const Progress &progress)
+{
+    auto start = chrono::steady_clock::now();
+    _iterations = 0;
+    if(_constraints.empty())
+        _coefficients = _prior;
+    else
+    {
+        // Solves for the difference to the prior, so that the tolerance is
+        // relative to what the strokes ask rather than to the prior : the
+        // painted rows scaled by the square roots of their weights, against
+        // what they miss under the prior, then the penalty's rows. As in the
+        // SH solver, its weight grows with the constraints', and it stands
+        // for the squared radiance over the sphere, each texel covering
+        // about 4 PI / k
+        const int n = _constraints.size(), k = _transfer.coefficientCount();
+        const WaveletTransfer::TransferMatrix &rows = _transfer.rows();
+        double totalWeight = 0.;
+        int nonZeros = k;
+        for(const Constraint &constraint : _constraints)
+        {
+            totalWeight += constraint.weight;
+            nonZeros += rows.outerIndexPtr()[constraint.vertex + 1] - rows.outerIndexPtr()[constraint.vertex];
+        }
+        float penalty = sqrt(_options.regularization * totalWeight * 4. * M_PI / k);
+        
+        WaveletTransfer::TransferMatrix system(n + k, k);
+        system.reserve(nonZeros);
+        Matrix<float, Dynamic, 3> rhs(n + k, 3);
+        for(int i = 0; i < n; i++)
+        {
+            const Constraint &constraint = _constraints[i];
+            float scale = sqrt(constraint.weight);
+            system.startVec(i);
+            for(WaveletTransfer::TransferMatrix::InnerIterator it(rows, constraint.vertex); it; ++it)
+                system.insertBack(i, it.index()) = scale * it.value();
+            rhs.row(i) = scale * (constraint.target.transpose() - rows.row(constraint.vertex) * _prior);
+        }
+        for(int j = 0; j < k; j++)
+        {
+            system.startVec(n + j);
+            system.insertBack(n + j, j) = penalty * _penalties[j];
+        }
+        rhs.bottomRows(k).setZero();
+        system.finalize();
+        
+        // A progressive solve restarts the iterations from the last iterate
+        // after each report, which costs them their conjugacy but little
+        // else this close to the solution
+        LeastSquaresConjugateGradient<WaveletTransfer::TransferMatrix> lscg[3];
+        int iterations[3] = { 0, 0, 0 };
+        bool converged[3] = { false, false, false };
+        const int round = progress ? PROGRESS_ITERATIONS : _options.maxIterations;
+        for(bool done = false; !done; )
+        {
+            parallelFor(0, 3, [&](int begin, int end)
+            {
+                for(int c = begin; c < end; c++)
+                {
+                    if(converged[c])
+                        continue;
+                    if(iterations[c] == 0)
+                    {
+                        lscg[c].setTolerance(_options.tolerance);
+                        lscg[c].compute(system);
+                    }
+                    lscg[c].setMaxIterations(min(round, _options.maxIterations - iterations[c]));
+                    VectorXf x = lscg[c].solveWithGuess(rhs.col(c), _coefficients.col(c) - _prior.col(c));
+                    _coefficients.col(c) = _prior.col(c) + x;
+                    iterations[c] += lscg[c].iterations();
+                    converged[c] = lscg[c].info() == Success || iterations[c] >= _options.maxIterations;
+                }
+            }, 1);
+            done = converged[0] && converged[1] && converged[2];
+            if(!done && progress && !progress(_coefficients))
+                break;
+        }
+        _iterations = max(iterations[0], max(iterations[1], iterations[2]));
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    _solveTime = elapsed.count();
+    return _coefficients;
+}
+
+CubeMapImage WaveletLightingSolver::radiance() const
+{
+    return _transfer.reconstruct(_coefficients);
+}
+
+Vector3f WaveletLightingSolver::shading(int vertex) const
+{
+    return (_transfer.rows().row(vertex) * _coefficients).transpose();
+}
+
+void WaveletLightingSolver::shading(vector<Vector3f> &radiances) const
+{
+    radiances.resize(_transfer.vertexCount());
+    parallelFor(0, _transfer.vertexCount(), [&](int begin, int end)
+    {
+        for(int v = begin; v < end; v++)
+            radiances[v] = shading(v);
+    });
+}
@@ -1,9 +1,12 @@
 #define GLFW_DLL
 // #define TINYGLTF_NOEXCEPTION // optional. disable exception handling.
 
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <Eigen/Eigen>
 #include "imgui.h"
@@ -18,9 +21,16 @@
 #include "tiny_gltf.h"
 #include "utils.h"
 
+#include "BackgroundSolve.h"
+#include "EnvironmentLibrary.h"
 #include "EnvironmentMap.h"
+#include "IlluminationBrush.h"
+#include "InverseLighting.h"
+#include "PRTBaker.h"
 #include "QuadRenderContext.h"
 #include "ShaderProgram.h"
+#include "SphericalGaussians.h"
+#include "WaveletLighting.h"
 #include "TrackballControls.h"
 
 using namespace Eigen;
@@ -123,11 +133,120 @@ int _main(int, char *argv[])
     
     trace("Model done loading");
     
-    trace("Loading environment map ...");
-    invLight::EnvironmentMap envMap("environment.hdr");
-    envMap.precomputeIrradiance(64, 64);
-    trace("Environment map done loading");
-    modelProgram.registerTexture("uIrradianceMap", envMap.getIrradianceMap());
+    // Painted targets are solved for as SH lighting, pulled towards the
+    // current environment where the strokes leave it free
+    invLight::MeshGeometry geometry = model.geometry();
+    invLight::InverseLightingSolver<> solver(geometry.normals);
+    // Shadowed transfer baked by bin/prtbake, if any, compressed first
+    invLight::CompressedTransfer<invLight::SH_ORDER> compressedTransfer;
+    invLight::InverseLightingSolver<>::TransferMatrix transfer;
+    if(invLight::loadTransfer<invLight::SH_ORDER>("DamagedHelmet/DamagedHelmet.cpca", compressedTransfer))
+    {
+        if(compressedTransfer.vertexCount() == geometry.vertexCount())
+        {
+            solver.setTransfer(compressedTransfer);
+            trace("Solving with the baked shadowed transfer, in " << compressedTransfer.clusterCount() << " clusters");
+        }
+        else
+            trace("Ignoring a transfer baked for " << compressedTransfer.vertexCount() << " vertices");
+    }
+    else if(invLight::loadTransfer<invLight::SH_ORDER>("DamagedHelmet/DamagedHelmet.prt", transfer))
+    {
+        if(transfer.rows() == geometry.vertexCount())
+        {
+            solver.setTransfer(transfer);
+            trace("Solving with the baked shadowed transfer");
+        }
+        else
+            trace("Ignoring a transfer baked for " << transfer.rows() << " vertices");
+    }
+    invLight::IlluminationBrush brush(geometry, solver);
+    bool painting = false, useSolvedLighting = true;
+    // Strokes are also solved for as a few spherical Gaussian lights, which
+    // keep sharp highlights that SH can't hold, but don't cast shadows.
+    // Their solves can take longer than a frame : they run in the
+    // background, the lobes showing each step as it comes, and sgSolver is
+    // only touched through sgSolve from then on. Each prior fit gets the
+    // generation it was queued as, and gives up once a newer one is queued :
+    // strokes mustn't cut it short, the solves after them would be pulled
+    // towards a half fitted prior
+    invLight::SGLightingSolver sgSolver(geometry.normals);
+    std::atomic<int> sgFitGeneration(0);
+    invLight::BackgroundSolve<invLight::SGLightingSolver> sgSolve(sgSolver);
+    bool useSGLighting = false;
+    int sgLobes = 8;
+    // With a wavelet transfer baked by bin/prtbake -w, strokes are solved
+    // for as all-frequency lighting too, in the background like the lobes.
+    // The model shows the solution's SH projection, unshadowed like the SH
+    // solve's : the transfer's shadows only shape the solve
+    std::unique_ptr<invLight::WaveletLightingSolver> waveletSolver;
+    std::unique_ptr<invLight::BackgroundSolve<invLight::WaveletLightingSolver>> waveletSolve;
+    Matrix<float, invLight::SH_COEFFICIENTS, Dynamic> waveletProjection;
+    invLight::SHCoefficients waveletIrradiance = invLight::SHCoefficients::Zero();
+    bool useWaveletLighting = false;
+    {
+        invLight::WaveletTransfer waveletTransfer;
+        if(invLight::loadTransfer("DamagedHelmet/DamagedHelmet.wlt", waveletTransfer))
+        {
+            if(waveletTransfer.vertexCount() == geometry.vertexCount())
+            {
+                waveletSolver.reset(new invLight::WaveletLightingSolver(waveletTransfer));
+                waveletSolve.reset(new invLight::BackgroundSolve<invLight::WaveletLightingSolver>(*waveletSolver));
+                waveletProjection = waveletTransfer.shProjection();
+                trace("Solving wavelet lighting over " << waveletTransfer.coefficientCount() << " coefficients");
+            }
+            else
+                trace("Ignoring a wavelet transfer baked for " << waveletTransfer.vertexCount() << " vertices");
+        }
+    }
+    trace("Painting on " << geometry.vertexCount() << " vertices");
+    
+    // Render a placeholder until the first environment is ready, then
+    // switch between the ones in environments/ at runtime
+    invLight::EnvironmentMap envMap;
+    invLight::IBLBakeParams bakeParams;
+    bakeParams.irradianceWidth = bakeParams.irradianceHeight = 64;
+    std::vector<std::string> environments = listFiles("environments", ".hdr");
+    environments.insert(environments.begin(), "environment.hdr");
+    invLight::EnvironmentLibrary library(envMap, environments, bakeParams);
+    // The lobes are fitted to the environment in the background too, from a
+    // copy downsampled to the size the fit works at, keeping the previous
+    // prior when another fit supersedes them
+    invLight::EquirectImage sgEnvironment;
+    auto fitSGPrior = [&]()
+    {
+        invLight::EquirectImage environment = sgEnvironment;
+        int count = sgLobes, generation = ++sgFitGeneration;
+        sgSolve.edit([environment, count, generation, &sgFitGeneration](invLight::SGLightingSolver &solver)
+        {
+            std::vector<invLight::SphericalGaussian> prior = invLight::fitSphericalGaussians(environment, count,
+                invLight::SGFitOptions(), nullptr, 64,
+                [&](const std::vector<invLight::SphericalGaussian>&) { return generation == sgFitGeneration; });
+            if(generation == sgFitGeneration)
+                solver.setPrior(prior);
+        });
+    };
+    // Whichever way the environment changed, instantly from the library's
+    // cache or once loaded, everything derived from it follows
+    auto environmentChanged = [&]()
+    {
+        envMap.bindTextures(modelProgram);
+        solver.setPriorIrradiance(envMap.getIrradianceSH());
+        solver.solve();
+        sgEnvironment = envMap.fitImage();
+        if(useSGLighting)
+            fitSGPrior();
+        if(waveletSolve)
+        {
+            invLight::EquirectImage environment = sgEnvironment;
+            waveletSolve->edit([environment](invLight::WaveletLightingSolver &solver)
+            {
+                solver.setPrior(invLight::CubeMapImage::fromEquirect(environment, solver.transfer().size()));
+            });
+        }
+    };
+    library.select(0);
+    environmentChanged();
     
     int display_w, display_h;
     glfwGetFramebufferSize(window, &display_w, &display_h);
@@ -152,6 +271,14 @@ int _main(int, char *argv[])
     while (!glfwWindowShouldClose(window))
     {
         trackball->update();
+        if(library.update())
+            environmentChanged();
+        sgSolve.update();
+        if(waveletSolve && waveletSolve->update())
+        {
+            waveletIrradiance = waveletProjection * waveletSolve->latest();
+            invLight::convolveSHCosine(waveletIrradiance);
+        }
         
         glfwGetFramebufferSize(window, &display_w, &display_h);
         float newRatio = (float)display_w / display_h;
@@ -165,6 +292,52 @@ int _main(int, char *argv[])
         
         ImGui_ImplGlfwGL3_NewFrame();
         
+        ImGui::Begin("Environments");
+        for(int i = 0; i < library.size(); i++)
+            if(ImGui::Selectable(library.path(i).c_str(), i == library.selected()) && library.select(i))
+                environmentChanged();
+        ImGui::End();
+        
+        ImGui::Begin("Illumination brush");
+        ImGui::Checkbox("Paint", &painting);
+        ImGui::ColorEdit3("Color", brush.color.data());
+        ImGui::SliderFloat("Intensity", &brush.intensity, 0.f, 4.f);
+        ImGui::SliderFloat("Radius", &brush.radius, 2.f, 128.f);
+        invLight::InverseLightingOptions solverOptions = solver.getOptions();
+        if(ImGui::SliderFloat("Regularization", &solverOptions.regularization, 1e-4f, 1.f, "%.4f", 4.f)
+            | ImGui::Checkbox("Non-negative", &solverOptions.nonNegative))
+        {
+            solver.setOptions(solverOptions);
+            solver.solve();
+        }
+        if(ImGui::Button("Clear"))
+        {
+            solver.clearConstraints();
+            sgSolve.edit([](invLight::SGLightingSolver &solver) { solver.clearConstraints(); });
+            if(waveletSolve)
+                waveletSolve->edit([](invLight::WaveletLightingSolver &solver) { solver.clearConstraints(); });
+        }
+        ImGui::Checkbox("Use solved lighting", &useSolvedLighting);
+        ImGui::Text("%d constraints, solved in %.3f ms", solver.constraintCount(), solver.lastSolveTime());
+        if(solverOptions.nonNegative)
+            ImGui::Text("%d least squares solves", solver.lastIterations());
+        if((ImGui::Checkbox("Spherical Gaussians", &useSGLighting) | ImGui::SliderInt("Lobes", &sgLobes, 1, 32))
+            && useSGLighting)
+            fitSGPrior();
+        if(useSGLighting)
+            ImGui::Text("Lobes solved in %.3f ms, %d steps%s", sgSolve.lastSolveTime(), sgSolve.lastIterations(),
+                sgSolve.busy() ? ", solving" : "");
+        if(waveletSolve)
+        {
+            ImGui::Checkbox("Wavelets", &useWaveletLighting);
+            if(useWaveletLighting)
+                ImGui::Text("Wavelets solved in %.3f ms, %d steps%s", waveletSolve->lastSolveTime(),
+                    waveletSolve->lastIterations(), waveletSolve->busy() ? ", solving" : "");
+        }
+        ImGui::End();
+        // Left drags paint rather than rotate while painting
+        trackball->m_enabled = !painting;
+        
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         envMap.render(camera, invP);
@@ -173,8 +346,49 @@ int _main(int, char *argv[])
         modelProgram.uniformMatrix4fv("uP", 1, p.data());
         modelProgram.uniformMatrix4fv("uV", 1, camera.m_viewMatr.data());
         modelProgram.uniform3f("uCameraPos", camera.m_eye[0], camera.m_eye[1], camera.m_eye[2]);
+        envMap.uploadIrradianceSH(modelProgram);
+        if(useSolvedLighting)
+        {
+            // Only the diffuse term : specular still comes from the environment
+            Matrix<float, 3, invLight::SH_COEFFICIENTS> coeffs =
+                (useWaveletLighting && waveletSolve ? waveletIrradiance : solver.irradiance()).transpose();
+            modelProgram.uniform3fv("uIrradianceSH", invLight::SH_COEFFICIENTS, coeffs.data());
+        }
+        invLight::EnvironmentMap::uploadSphericalGaussians(modelProgram,
+            useSolvedLighting && useSGLighting ? sgSolve.latest() : std::vector<invLight::SphericalGaussian>());
+        modelProgram.uniform1f("uSpecularLevels", envMap.getSpecularLevels());
+        modelProgram.uniform1i("uOctahedral", envMap.getOptions().octahedral);
         model.render();
         
+        if(painting && !io.WantCaptureMouse && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
+        {
+            // The depth buffer still holds the model
+            double cursorX, cursorY;
+            int windowWidth, windowHeight;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glfwGetWindowSize(window, &windowWidth, &windowHeight);
+            Matrix4f viewProjection = p * camera.m_viewMatr;
+            if(brush.paint(cursorX * display_w / windowWidth, cursorY * display_h / windowHeight, viewProjection,
+                camera.m_eye, display_w, display_h) > 0)
+            {
+                // Kept even while unused, for when the lobes or wavelets get
+                // enabled. The stroke preempts the solves in flight
+                std::vector<std::pair<int, float> > painted = brush.lastPainted();
+                Vector3f target = brush.color * brush.intensity;
+                sgSolve.edit([painted, target](invLight::SGLightingSolver &solver)
+                {
+                    for(const std::pair<int, float> &vertex : painted)
+                        solver.addConstraint(vertex.first, target, vertex.second);
+                });
+                if(waveletSolve)
+                    waveletSolve->edit([painted, target](invLight::WaveletLightingSolver &solver)
+                    {
+                        for(const std::pair<int, float> &vertex : painted)
+                            solver.addConstraint(vertex.first, target, vertex.second);
+                    });
+            }
+        }
+        
         displayTexture(envMap.getMap().id, 0, 0);
         displayTexture(envMap.getIrradianceMap().id, 0, -1);
         
@@ -185,6 +399,8 @@ int _main(int, char *argv[])
     }
     
     trace("Exiting drawing loop");
+    // No fit is worth finishing now
+    ++sgFitGeneration;
     
     model.cleanup();
     
@@ -1,11 +1,13 @@
 #include "utils.h"
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <stdexcept>
 #include <string>
+#include <dirent.h>
 #include <unistd.h>
 
 void setwd(char **argv)
@@ -34,6 +36,24 @@ std::string getFileContents(const char *path)
     return contents;
 }
 
+std::vector<std::string> listFiles(const char *directory, const char *extension)
+{
+    std::vector<std::string> files;
+    DIR *dir = opendir(directory);
+    if(!dir)
+        return files;
+    size_t extensionLength = strlen(extension);
+    while(dirent *entry = readdir(dir))
+    {
+        size_t length = strlen(entry->d_name);
+        if(length > extensionLength && !strcmp(entry->d_name + length - extensionLength, extension))
+            files.push_back(std::string(directory) + "/" + entry->d_name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
 GLuint createShaderFromSource(GLenum type, const char *path)
 {
     GLuint shader = glCreateShader(type);
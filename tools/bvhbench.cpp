@@ -0,0 +1,218 @@
+// BVH benchmark : times the build over a glTF model's triangles, then
+// closest-hit and any-hit queries one ray at a time, in packets and in
+// streams, optionally checked against brute force.
+
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "tiny_gltf.h"
+
+#include "BVH.h"
+#include "MeshGeometry.h"
+#include "Parallel.h"
+
+using namespace invLight;
+using namespace std;
+
+static void usage(const char *name)
+{
+    cerr << "Usage : " << name << " [options] <model.gltf>\n"
+        << "Times the BVH build and queries over the model's triangles.\n"
+        << "  -j <threads>     threads to use, all cores by default\n"
+        << "  -n <rays>        rays per query kind (1000000)\n"
+        << "  -b <builds>      builds to average (10)\n"
+        << "  -v <rays>        check that many rays against brute force (0)\n";
+}
+
+static double millisecondsSince(const chrono::steady_clock::time_point &start)
+{
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static Vector3f randomDirection(mt19937 &random)
+{
+    normal_distribution<float> gaussian;
+    Vector3f d;
+    do
+        d = Vector3f(gaussian(random), gaussian(random), gaussian(random));
+    while(d.squaredNorm() < 1e-8f);
+    return d.normalized();
+}
+
+// Rays are made and traced in groups of this many
+static const int GROUP_SIZE = 64;
+
+/**
+ * Groups of rays leaving a vertex into the hemisphere around its normal,
+ * like the visibility bake's, and groups of rays from a point around the
+ * mesh through a small square of its box, like a camera tile's.
+ */
+static void makeRays(const MeshGeometry &geometry, int groups, vector<Ray> &occlusionRays, vector<Ray> &primaryRays)
+{
+    mt19937 random(1);
+    uniform_real_distribution<float> uniform(0.f, 1.f);
+    AlignedBox3f bounds = geometry.bounds();
+    float radius = bounds.diagonal().norm(), bias = 1e-4f * radius;
+    uniform_int_distribution<int> vertex(0, geometry.vertexCount() - 1);
+    occlusionRays.resize(groups * GROUP_SIZE);
+    primaryRays.resize(groups * GROUP_SIZE);
+    for(int g = 0; g < groups; g++)
+    {
+        int v = vertex(random);
+        const Vector3f &n = geometry.normals[v];
+        Vector3f origin = bounds.center() + radius * randomDirection(random), target = bounds.sample(),
+            forward = (target - origin).normalized(), right = forward.unitOrthogonal(), up = forward.cross(right);
+        for(int i = g * GROUP_SIZE; i < (g + 1) * GROUP_SIZE; i++)
+        {
+            Vector3f d = randomDirection(random);
+            if(d.dot(n) < 0.f)
+                d = -d;
+            occlusionRays[i] = Ray(geometry.positions[v] + bias * n, d);
+            Vector3f offset = (uniform(random) - .5f) * right + (uniform(random) - .5f) * up;
+            primaryRays[i] = Ray(origin, (target + .05f * radius * offset - origin).normalized());
+        }
+    }
+}
+
+template<typename F>
+static double raysPerSecond(int groups, const F &query)
+{
+    auto start = chrono::steady_clock::now();
+    parallelFor(0, groups, [&](int begin, int end)
+    {
+        for(int g = begin; g < end; g++)
+            query(g * GROUP_SIZE);
+    });
+    return groups * GROUP_SIZE / millisecondsSince(start) * 1e3;
+}
+
+int _main(int argc, char *argv[])
+{
+    string input;
+    int rayCount = 1000000, builds = 10, checks = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "-h" || arg == "--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if(arg == "-j" && hasValue)
+            setWorkerCount(max(1, atoi(argv[++i])));
+        else if(arg == "-n" && hasValue)
+            rayCount = max(1, atoi(argv[++i]));
+        else if(arg == "-b" && hasValue)
+            builds = max(1, atoi(argv[++i]));
+        else if(arg == "-v" && hasValue)
+            checks = max(0, atoi(argv[++i]));
+        else if(arg[0] == '-' || !input.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            input = arg;
+    }
+    if(input.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    tinygltf::Model model;
+    tinygltf::TinyGLTF loader;
+    string err;
+    bool loaded = input.size() > 4 && input.compare(input.size() - 4, 4, ".glb") == 0
+        ? loader.LoadBinaryFromFile(&model, &err, input) : loader.LoadASCIIFromFile(&model, &err, input);
+    if(!loaded)
+    {
+        cerr << "Couldn't load " << input << " : " << err << endl;
+        return 1;
+    }
+    MeshGeometry geometry = MeshGeometry::fromGLTF(model);
+    cout << input << " : " << geometry.triangleCount() << " triangles, " << workerCount() << " threads" << endl;
+    
+    double buildTime = 0.;
+    for(int i = 1; i < builds; i++)
+        buildTime += BVH(geometry).buildTime();
+    BVH bvh(geometry);
+    buildTime = (buildTime + bvh.buildTime()) / builds;
+    cout << "Build : " << buildTime << " ms on average, " << bvh.nodes().size() << " nodes of " << sizeof(BVH::Node)
+        << " bytes, depth " << bvh.depth() << endl;
+    
+    int groups = (rayCount + GROUP_SIZE - 1) / GROUP_SIZE;
+    rayCount = groups * GROUP_SIZE;
+    vector<Ray> occlusionRays, primaryRays;
+    makeRays(geometry, groups, occlusionRays, primaryRays);
+    vector<Hit> hits(rayCount);
+    unique_ptr<bool[]> occluded(new bool[rayCount]);
+    const RayQueryMode modes[] = { RayQueryMode::SINGLE, RayQueryMode::PACKET, RayQueryMode::STREAM };
+    const char *modeNames[] = { "single rays", "packets", "streams" };
+    cout << "Packets of " << BVH::packetWidth() << " rays" << endl;
+    for(int m = 0; m < 3; m++)
+    {
+        double closest = raysPerSecond(groups, [&](int i)
+        {
+            bvh.intersect(&primaryRays[i], &hits[i], GROUP_SIZE, modes[m]);
+        });
+        double any = raysPerSecond(groups, [&](int i)
+        {
+            bvh.occluded(&occlusionRays[i], &occluded[i], GROUP_SIZE, modes[m]);
+        });
+        int hitCount = count_if(hits.begin(), hits.end(), [](const Hit &hit) { return hit.triangle >= 0; }),
+            occludedCount = count(occluded.get(), occluded.get() + rayCount, true);
+        cout << "In " << modeNames[m] << " : closest hit " << closest / 1e6 << " Mrays/s (" << 100. * hitCount / rayCount
+            << " % hit), any hit " << any / 1e6 << " Mrays/s (" << 100. * occludedCount / rayCount << " % occluded)" << endl;
+    }
+    
+    if(checks > 0)
+    {
+        // Against the last results, traced in streams
+        BruteForceOccluder reference(geometry);
+        atomic<int> mismatches(0);
+        checks = min(checks, rayCount);
+        parallelFor(0, checks, [&](int begin, int end)
+        {
+            for(int i = begin; i < end; i++)
+            {
+                const Ray &ray = occlusionRays[i];
+                Hit hit;
+                bvh.intersect(primaryRays[i], hit);
+                if(occluded[i] != reference.occluded(ray.origin, ray.dir, ray.tMax) || hit.triangle != hits[i].triangle)
+                    mismatches++;
+            }
+        });
+        cout << "Checked " << checks << " rays against brute force : " << mismatches << " mismatches" << endl;
+        if(mismatches > 0)
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        return _main(argc, argv);
+    }
+    catch(std::exception &e)
+    {
+        std::cerr << e.what();
+        return 1;
+    }
+}
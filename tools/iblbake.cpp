@@ -0,0 +1,202 @@
+// Headless IBL baker : fills the cache the viewer reads (see IBLCache) for a
+// list of HDR files, without opening a window.
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "stb_image.h"
+
+#include "HDRImage.h"
+#include "IBLBaker.h"
+#include "IBLCache.h"
+#include "Parallel.h"
+
+using namespace invLight;
+using namespace std;
+
+struct BakeOptions
+{
+    string cacheDirectory = "iblcache";
+    IBLBakeParams params;
+    // Bake even if the cache already has the set
+    bool force = false;
+};
+
+struct BakeResult
+{
+    bool baked = false, failed = false;
+    double decodeTime = 0., bakeTime = 0., storeTime = 0.;
+};
+
+static void usage(const char *name)
+{
+    cerr << "Usage : " << name << " [options] <file.hdr | -> ...\n"
+        << "Bakes the IBL set of every HDR file into the cache the viewer reads, '-' reading paths from stdin.\n"
+        << "  -o <directory>   cache directory (iblcache)\n"
+        << "  -j <threads>     threads to use, all cores by default\n"
+        << "  -f               bake again files that are already cached\n"
+        << "  -c <size>        prefilter specular from a cube map this size\n"
+        << "  -s <samples>     GGX samples per specular texel (64)\n";
+}
+
+static double millisecondsSince(const chrono::steady_clock::time_point &start)
+{
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Same steps as EnvironmentMap::prepare() on a cache miss
+static BakeResult bake(const string &path, const BakeOptions &options)
+{
+    BakeResult result;
+    auto start = chrono::steady_clock::now();
+    // RGBE expands to floats exactly, and is the most compact
+    HDRImage hdr = loadHDRImage(path, PIXEL_RGBE);
+    IBLBakeParams resolved = options.params.resolved(hdr.width, hdr.height);
+    IBLCache cache(options.cacheDirectory);
+    uint64_t key = IBLCache::key(path, resolved);
+    if(!options.force && cache.load(key))
+    {
+        result.decodeTime = millisecondsSince(start);
+        return result;
+    }
+    EquirectImage image = hdr.toEquirect();
+    hdr = HDRImage();
+    result.decodeTime = millisecondsSince(start);
+    
+    start = chrono::steady_clock::now();
+    shared_ptr<IBLData> data = bakeIBL(image, resolved, options.cacheDirectory + "/brdfLUT.bin");
+    result.bakeTime = millisecondsSince(start);
+    
+    start = chrono::steady_clock::now();
+    cache.store(key, *data);
+    result.storeTime = millisecondsSince(start);
+    result.baked = true;
+    return result;
+}
+
+int _main(int argc, char *argv[])
+{
+    BakeOptions options;
+    vector<string> paths;
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "-h" || arg == "--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if(arg == "-o" && hasValue)
+            options.cacheDirectory = argv[++i];
+        else if(arg == "-j" && hasValue)
+            setWorkerCount(max(1, atoi(argv[++i])));
+        else if(arg == "-f")
+            options.force = true;
+        else if(arg == "-c" && hasValue)
+            options.params.cubeMapSize = max(0, atoi(argv[++i]));
+        else if(arg == "-s" && hasValue)
+            options.params.specularSamples = max(1, atoi(argv[++i]));
+        else if(arg == "-")
+        {
+            string line;
+            while(getline(cin, line))
+                if(!line.empty())
+                    paths.push_back(line);
+        }
+        else if(arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            paths.push_back(arg);
+    }
+    // Two jobs baking the same file would write the same cache entry
+    sort(paths.begin(), paths.end());
+    paths.erase(unique(paths.begin(), paths.end()), paths.end());
+    if(paths.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    auto start = chrono::steady_clock::now();
+    // The BRDF table is shared by every set : bake it once up front rather
+    // than have concurrent jobs race to write it
+    IBLCache cache(options.cacheDirectory); // Creates the directory
+    loadOrBakeBRDFLUT(options.cacheDirectory + "/brdfLUT.bin", options.params.brdfSize, options.params.brdfSamples);
+    
+    // One task per file, whose loops spread over the pool as well : a few
+    // large files keep every core busy, and so do many small ones
+    ThreadPool &pool = ThreadPool::shared();
+    vector<BakeResult> results(paths.size());
+    atomic<int> finished(0);
+    mutex outputLock;
+    for(unsigned int i = 0; i < paths.size(); i++)
+        pool.submit([&, i]()
+        {
+            BakeResult &result = results[i];
+            try
+            {
+                result = bake(paths[i], options);
+            }
+            catch(exception &e)
+            {
+                result.failed = true;
+                lock_guard<mutex> lock(outputLock);
+                cerr << e.what();
+            }
+            {
+                lock_guard<mutex> lock(outputLock);
+                int count = finished + 1;
+                cout << "[" << count << "/" << paths.size() << "] " << paths[i];
+                if(result.failed)
+                    cout << " : failed" << endl;
+                else if(!result.baked)
+                    cout << " : cached" << endl;
+                else
+                    cout << " : decoded in " << result.decodeTime << " ms, baked in " << result.bakeTime
+                        << " ms, stored in " << result.storeTime << " ms" << endl;
+                finished = count;
+            }
+            pool.notify();
+        });
+    pool.runUntil([&]() { return finished == (int)paths.size(); });
+    
+    int baked = 0, failed = 0;
+    double bakeTime = 0.;
+    for(const BakeResult &result : results)
+    {
+        baked += result.baked;
+        failed += result.failed;
+        bakeTime += result.decodeTime + result.bakeTime + result.storeTime;
+    }
+    double elapsed = millisecondsSince(start);
+    cout << "Baked " << baked << " of " << paths.size() << " files (" << failed << " failed) in " << elapsed << " ms on "
+        << workerCount() << " threads, " << bakeTime / max(elapsed, 1e-3) << " files in flight on average" << endl;
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        return _main(argc, argv);
+    }
+    catch(std::exception &e)
+    {
+        std::cerr << e.what();
+        return 1;
+    }
+}
@@ -0,0 +1,262 @@
+// Headless transfer baker : precomputes the shadowed diffuse transfer of a
+// glTF model's vertices, which the viewer loads next to the model, and
+// times the wavelet solver over replayed strokes.
+
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "tiny_gltf.h"
+
+#include "BVH.h"
+#include "MeshGeometry.h"
+#include "PRTBaker.h"
+#include "Parallel.h"
+#include "WaveletLighting.h"
+
+using namespace invLight;
+using namespace std;
+
+static void usage(const char *name)
+{
+    cerr << "Usage : " << name << " [options] <model.gltf>\n"
+        << "Bakes the diffuse transfer of every vertex, self-shadowing included, next to the model.\n"
+        << "  -o <file>        output file (<model>.prt, <model>.cpca compressed, <model>.wlt wavelet)\n"
+        << "  -j <threads>     threads to use, all cores by default\n"
+        << "  -l <order>       SH order, 2 to 8 (2, what the viewer uses)\n"
+        << "  -s <samples>     square root of the rays per vertex (12)\n"
+        << "  -u               ignore shadows\n"
+        << "  -r               test rays against every triangle, to check the BVH\n"
+        << "  -1               trace rays one at a time rather than in packets\n"
+        << "  -c <clusters>    compress the transfer by clustered PCA into that many clusters\n"
+        << "  -n <vectors>     basis vectors per cluster when compressing (4)\n"
+        << "  -w <size>        bake a Haar wavelet transfer over cube faces this size instead of SH\n"
+        << "  -k <terms>       wavelet coefficients kept per vertex (64)\n"
+        << "  -b <strokes>     with -w, time the solver over that many random strokes, loading the output if baked\n";
+}
+
+template<int Order>
+static void bake(const MeshGeometry &geometry, const Occluder &occluder, const PRTBakeParams &params,
+    const CPCAParams *compression, const string &path)
+{
+    PRTBakeStats stats;
+    typename InverseLightingSolver<Order>::TransferMatrix transfer = bakeTransfer<Order>(geometry, occluder, params, &stats);
+    cout << "Baked " << geometry.vertexCount() << " vertices in " << stats.time << " ms on " << workerCount() << " threads : "
+        << stats.rays << " rays, " << stats.raysPerSecond() / 1e6 << " Mrays/s" << endl;
+    if(!compression)
+    {
+        saveTransfer<Order>(path, transfer);
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    CompressedTransfer<Order> compressed(transfer, *compression);
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cout << "Compressed into " << compressed.clusterCount() << " clusters of " << compressed.basisSize() << " basis vectors in "
+        << elapsed.count() << " ms : " << compressed.bytes() / 1024 << " KB instead of " << transfer.size() * sizeof(float) / 1024
+        << " KB, " << 100.f * compressed.relativeError(transfer) << " % RMS error" << endl;
+    saveTransfer<Order>(path, compressed);
+}
+
+static WaveletTransfer bakeWavelets(const MeshGeometry &geometry, const Occluder &occluder, const PRTBakeParams &params,
+    const WaveletBakeParams &waveletParams, const string &path)
+{
+    PRTBakeStats stats;
+    WaveletTransfer transfer = bakeWaveletTransfer(geometry, occluder, waveletParams, params, &stats);
+    cout << "Baked " << geometry.vertexCount() << " vertices in " << stats.time << " ms on " << workerCount() << " threads : "
+        << stats.rays << " rays, " << stats.raysPerSecond() / 1e6 << " Mrays/s, " << transfer.bytes() / 1024 << " KB instead of "
+        << (size_t)transfer.vertexCount() * transfer.coefficientCount() * sizeof(float) / 1024 << " KB" << endl;
+    saveTransfer(path, transfer);
+    return transfer;
+}
+
+// Radius of the replayed strokes, relative to the model's diagonal
+static const float STROKE_RADIUS = .05f;
+
+/**
+ * Replays `strokes` strokes of random colors around random vertices, each
+ * painting the vertices within its radius with the brush's falloff, then
+ * solving from the previous solution like the viewer does.
+ */
+static void benchWavelets(const MeshGeometry &geometry, const WaveletTransfer &transfer, int strokes)
+{
+    WaveletLightingSolver solver(transfer);
+    mt19937 random(1);
+    uniform_int_distribution<int> vertex(0, geometry.vertexCount() - 1);
+    uniform_real_distribution<float> uniform(0.f, 1.f);
+    float radius = STROKE_RADIUS * geometry.bounds().diagonal().norm();
+    double total = 0., slowest = 0.;
+    int iterations = 0;
+    for(int s = 0; s < strokes; s++)
+    {
+        const Vector3f center = geometry.positions[vertex(random)];
+        Vector3f target(uniform(random), uniform(random), uniform(random));
+        int painted = 0;
+        for(int i = 0; i < geometry.vertexCount(); i++)
+        {
+            float d2 = (geometry.positions[i] - center).squaredNorm() / (radius * radius);
+            if(d2 >= 1.f)
+                continue;
+            solver.addConstraint(i, target, (1.f - d2) * (1.f - d2));
+            painted++;
+        }
+        solver.solve();
+        total += solver.lastSolveTime();
+        slowest = max(slowest, solver.lastSolveTime());
+        iterations += solver.lastIterations();
+        cout << "Stroke " << s << " : " << painted << " vertices, " << solver.constraintCount() << " constraints, "
+            << solver.lastIterations() << " iterations in " << solver.lastSolveTime() << " ms" << endl;
+    }
+    if(strokes > 0)
+        cout << "Solved " << strokes << " strokes over " << transfer.coefficientCount() << " coefficients : "
+            << total / strokes << " ms and " << (float)iterations / strokes << " iterations on average, "
+            << slowest << " ms at worst" << endl;
+}
+
+int _main(int argc, char *argv[])
+{
+    PRTBakeParams params;
+    params.batchRays = true;
+    string input, output;
+    int order = SH_ORDER;
+    bool bruteForce = false;
+    CPCAParams compressionParams;
+    bool compress = false;
+    WaveletBakeParams waveletParams;
+    bool wavelets = false;
+    int strokes = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "-h" || arg == "--help")
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if(arg == "-o" && hasValue)
+            output = argv[++i];
+        else if(arg == "-j" && hasValue)
+            setWorkerCount(max(1, atoi(argv[++i])));
+        else if(arg == "-l" && hasValue)
+            order = atoi(argv[++i]);
+        else if(arg == "-s" && hasValue)
+            params.samplesPerSide = max(1, atoi(argv[++i]));
+        else if(arg == "-u")
+            params.shadowed = false;
+        else if(arg == "-r")
+            bruteForce = true;
+        else if(arg == "-1")
+            params.batchRays = false;
+        else if(arg == "-c" && hasValue)
+        {
+            compressionParams.clusters = max(1, atoi(argv[++i]));
+            compress = true;
+        }
+        else if(arg == "-n" && hasValue)
+            compressionParams.basisSize = max(0, atoi(argv[++i]));
+        else if(arg == "-w" && hasValue)
+        {
+            waveletParams.size = atoi(argv[++i]);
+            wavelets = true;
+        }
+        else if(arg == "-k" && hasValue)
+            waveletParams.terms = max(1, atoi(argv[++i]));
+        else if(arg == "-b" && hasValue)
+            strokes = max(1, atoi(argv[++i]));
+        else if(arg[0] == '-' || !input.empty())
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            input = arg;
+    }
+    if(input.empty() || order < 2 || order > 8 || waveletParams.size < 1 || (waveletParams.size & (waveletParams.size - 1))
+        || (strokes && !wavelets))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(output.empty())
+        output = input.substr(0, input.rfind('.')) + (wavelets ? ".wlt" : compress ? ".cpca" : ".prt");
+    
+    tinygltf::Model model;
+    tinygltf::TinyGLTF loader;
+    string err;
+    bool loaded = input.size() > 4 && input.compare(input.size() - 4, 4, ".glb") == 0
+        ? loader.LoadBinaryFromFile(&model, &err, input) : loader.LoadASCIIFromFile(&model, &err, input);
+    if(!loaded)
+    {
+        cerr << "Couldn't load " << input << " : " << err << endl;
+        return 1;
+    }
+    MeshGeometry geometry = MeshGeometry::fromGLTF(model);
+    cout << input << " : " << geometry.vertexCount() << " vertices, " << geometry.triangleCount() << " triangles, ";
+    if(wavelets)
+        cout << "a ray per texel above the horizon of a " << waveletParams.size << "² cube map" << endl;
+    else
+        cout << params.samplesPerSide * params.samplesPerSide << " rays per vertex" << endl;
+    
+    // Baked before with the same size, for the same model
+    WaveletTransfer transfer;
+    if(strokes && loadTransfer(output, transfer) && transfer.size() == waveletParams.size
+        && transfer.vertexCount() == geometry.vertexCount())
+    {
+        cout << "Loaded " << output << endl;
+        benchWavelets(geometry, transfer, strokes);
+        return 0;
+    }
+    
+    unique_ptr<Occluder> occluder;
+    if(bruteForce)
+        occluder.reset(new BruteForceOccluder(geometry));
+    else
+    {
+        BVH *bvh = new BVH(geometry);
+        occluder.reset(bvh);
+        cout << "Built a BVH of " << bvh->nodes().size() << " nodes and depth " << bvh->depth() << " in "
+            << bvh->buildTime() << " ms" << endl;
+    }
+    const CPCAParams *compression = compress ? &compressionParams : nullptr;
+    if(wavelets)
+        transfer = bakeWavelets(geometry, *occluder, params, waveletParams, output);
+    else
+    {
+        switch(order)
+        {
+        case 2: bake<2>(geometry, *occluder, params, compression, output); break;
+        case 3: bake<3>(geometry, *occluder, params, compression, output); break;
+        case 4: bake<4>(geometry, *occluder, params, compression, output); break;
+        case 5: bake<5>(geometry, *occluder, params, compression, output); break;
+        case 6: bake<6>(geometry, *occluder, params, compression, output); break;
+        case 7: bake<7>(geometry, *occluder, params, compression, output); break;
+        case 8: bake<8>(geometry, *occluder, params, compression, output); break;
+        }
+    }
+    cout << "Wrote " << output << endl;
+    if(strokes)
+        benchWavelets(geometry, transfer, strokes);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        return _main(argc, argv);
+    }
+    catch(std::exception &e)
+    {
+        std::cerr << e.what();
+        return 1;
+    }
+}